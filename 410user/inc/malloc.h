@@ -13,5 +13,12 @@ void *_malloc(size_t size);
 void *_calloc(size_t nelt, size_t eltsize);
 void *_realloc(void *buf, size_t new_size);
 void _free(void *buf);
+size_t _malloc_usable_size(void *buf);
+
+/* Free bytes kept at the top of the heap when it is trimmed, which happens
+ * once there are twice as many, and request bytes served by a run of pages
+ * of their own; 0 turns either off */
+extern int mm_trim_threshold;
+extern int mm_run_threshold;
 
 #endif /* _MALLOC_WRAPPERS_H_ */
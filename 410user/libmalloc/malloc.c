@@ -1,7 +1,7 @@
 /*
  ******************************************************************************
  *                               mm-baseline.c                                *
- *           64-bit struct-based implicit free list memory allocator          *
+ *          64-bit struct-based segregated free list memory allocator         *
  *                  15-213: Introduction to Computer Systems                  *
  *                                                                            *
  *  ************************************************************************  *
@@ -9,34 +9,46 @@
  *                                                                            *
  *  ** STRUCTURE. **                                                          *
  *                                                                            *
- *  Both allocated and free blocks share the same header structure.           *
+ *  Every block starts with the same header.                                  *
  *  HEADER: 8-byte, aligned to 8th byte of an 16-byte aligned heap, where     *
- *          - The lowest order bit is 1 when the block is allocated, and      *
- *            0 otherwise.                                                    *
- *          - The whole 8-byte value with the least significant bit set to 0  *
- *            represents the size of the block as a size_t                    *
- *            The size of a block includes the header and footer.             *
+ *          - bit 0 is 1 when the block is allocated, and 0 otherwise,        *
+ *          - bit 1 is 1 when the previous block is allocated,                *
+ *          - bit 2 is 1 when the previous block is a mini block,             *
+ *          - bit 3 is 1 in the header of a run, see below.                   *
+ *          The whole 8-byte value with the lowest 4 bits set to 0            *
+ *          represents the size of the block as a size_t.                     *
+ *          The size of a block includes the header and footer.               *
  *  FOOTER: 8-byte, aligned to 0th byte of an 16-byte aligned heap. It        *
- *          contains the exact copy of the block's header.                    *
- *  The minimum blocksize is 32 bytes.                                        *
+ *          holds the size and allocation bit of the block's header.          *
+ *  Blocks are a multiple of 16 bytes. A block of 16 bytes, the least         *
+ *  there is, is a mini block.                                                *
  *                                                                            *
  *  Allocated blocks contain the following:                                   *
  *  HEADER, as defined above.                                                 *
  *  PAYLOAD: Memory allocated for program to store information.               *
- *  FOOTER, as defined above.                                                 *
- *  The size of an allocated block is exactly PAYLOAD + HEADER + FOOTER.      *
+ *  They have no footer: coalesce only needs the footer of a free block,      *
+ *  and the next block's header tells whether this one is free.               *
+ *  The size of an allocated block is PAYLOAD + HEADER, at least 16.          *
  *                                                                            *
  *  Free blocks contain the following:                                        *
  *  HEADER, as defined above.                                                 *
- *  FOOTER, as defined above.                                                 *
- *  The size of an unallocated block is at least 32 bytes.                    *
+ *  NEXT, PREV: the neighbours in the block's free list, as 4-byte            *
+ *              offsets from the start of the heap, so both fit in the        *
+ *              8 bytes of a mini block on any machine. 0 means none.         *
+ *  FOOTER, as defined above. Free mini blocks have no room for it, the       *
+ *          next block's header says the block before it is a mini one,       *
+ *          which tells its size.                                             *
+ *  The size of an unallocated block is at least 16 bytes.                    *
  *                                                                            *
  *  Block Visualization.                                                      *
- *                    block     block+8          block+size-8   block+size    *
- *  Allocated blocks:   |  HEADER  |  ... PAYLOAD ...  |  FOOTER  |           *
+ *                    block     block+8                       block+size      *
+ *  Allocated blocks:   |  HEADER  |  ... PAYLOAD ...               |         *
  *                                                                            *
- *                    block     block+8          block+size-8   block+size    *
- *  Unallocated blocks: |  HEADER  |  ... (empty) ...  |  FOOTER  |           *
+ *                    block     block+8                  block+size-8         *
+ *  Unallocated blocks: |  HEADER  | NEXT | PREV | ... |  FOOTER  |           *
+ *                                                                            *
+ *                    block     block+8    block+16                           *
+ *  Free mini blocks:   |  HEADER  | NEXT | PREV |                            *
  *                                                                            *
  *  ************************************************************************  *
  *  ** INITIALIZATION. **                                                     *
@@ -51,24 +63,46 @@
  *                   The epilogue header is moved when the heap is extended.  *
  *                                                                            *
  *  ************************************************************************  *
+ *  ** FREE LISTS. **                                                         *
+ *                                                                            *
+ *  Every free block is in one of SEG_CLASSES doubly linked free lists,       *
+ *  chosen by its size: list 0 holds the mini blocks, and list i > 0          *
+ *  blocks of more than mini_block_size << (i-1) bytes, up to                 *
+ *  mini_block_size << i. The last list holds everything bigger. Freed and    *
+ *  coalesced blocks are pushed at the head of their list; coalesce takes     *
+ *  the neighbours it merges out of their lists first.                        *
+ *                                                                            *
+ *  ************************************************************************  *
  *  ** BLOCK ALLOCATION. **                                                   *
  *                                                                            *
- *  Upon memory request of size S, a block of size S + dsize, rounded up to   *
- *  16 bytes, is allocated on the heap, where dsize is 2*8 = 16.              *
- *  Selecting the block for allocation is performed by finding the first      *
- *  block that can fit the content based on a first-fit or next-fit search    *
- *  policy.                                                                   *
- *  The search starts from the beginning of the heap pointed by heap_listp.   *
- *  It sequentially goes through each block in the implicit free list,        *
- *  the end of the heap, until either                                         *
- *  - A sufficiently-large unallocated block is found, or                     *
- *  - The end of the implicit free list is reached, which occurs              *
- *    when no sufficiently-large unallocated block is available.              *
- *  In case that a sufficiently-large unallocated block is found, then        *
- *  that block will be used for allocation. Otherwise--that is, when no       *
- *  sufficiently-large unallocated block is found--then more unallocated      *
- *  memory of size chunksize or requested size, whichever is larger, is       *
- *  requested through mem_sbrk, and the search is redone.                     *
+ *  Upon memory request of size S, a block of size S + wsize, rounded up to   *
+ *  16 bytes, is allocated on the heap, where wsize is 8. So requests of      *
+ *  up to 8 bytes get a mini block.                                           *
+ *  Selecting the block for allocation is performed by a first-fit search     *
+ *  of the list for that size. If it has no fit, the head of the next         *
+ *  non-empty list is taken: every block there is big enough. So only free    *
+ *  blocks of about the requested size are ever looked at, however big the    *
+ *  heap is.                                                                  *
+ *  If no list has a fit, more unallocated memory of size chunksize or        *
+ *  requested size, whichever is larger, is requested through mem_sbrk,       *
+ *  and the new block is used.                                                *
+ *                                                                            *
+ *  ************************************************************************  *
+ *  ** GIVING MEMORY BACK. **                                                 *
+ *                                                                            *
+ *  Requests of at least mm_run_threshold bytes don't go on the heap. Each    *
+ *  gets a run of pages mapped for it alone by mem_map_run, with a header     *
+ *  a word into the run, so the payload is 16-byte aligned. Freeing it        *
+ *  unmaps the run at once. If no run can be mapped, the request goes on the  *
+ *  heap like any other.                                                      *
+ *  When a free leaves a free block of at least twice mm_trim_threshold       *
+ *  bytes at the top of the heap, the block is cut down to about              *
+ *  mm_trim_threshold bytes: the epilogue header moves to the end of what is  *
+ *  kept, and mem_sbrk moves the brk down and unmaps the pages above it. So   *
+ *  the heap does not stay at its high-water mark, but the slack left at the  *
+ *  top lets blocks of up to that size come and go without a syscall. When    *
+ *  the heap has to grow while its top block is free, it only asks for what   *
+ *  that block is missing.                                                    *
  *                                                                            *
  *  ************************************************************************  *
  *  ** ADVICE FOR STUDENTS. **                                                *
@@ -76,6 +110,9 @@
  *  Write your heap checker. Write your heap checker. Write. Heap. checker.   *
  *  Good luck, and have fun!                                                  *
  *                                                                            *
+ *  mm_checkheap walks the whole heap and every free list, so the checks      *
+ *  around every call are only compiled in with CHECKHEAP defined.            *
+ *                                                                            *
  ******************************************************************************
  */
 
@@ -95,26 +132,57 @@
 #define dbg_assert(...) assert(__VA_ARGS__)
 #define dbg_ensures(...) assert(__VA_ARGS__)
 
+/* Define to check the whole heap on every call, which makes them O(heap) */
+/* #define CHECKHEAP */
+#ifdef CHECKHEAP
+#define dbg_checkheap() assert(mm_checkheap(__LINE__))
+#else
+#define dbg_checkheap()
+#endif
+
 /* Basic constants */
 typedef uint64_t word_t;
 static const size_t wsize = sizeof(word_t);   // word and header size (bytes)
 static const size_t dsize = 2*sizeof(word_t);          // double word size (bytes)
-static const size_t min_block_size = 4*sizeof(word_t); // Minimum block size
+static const size_t mini_block_size = 2*sizeof(word_t); // Mini block size
 static const size_t chunksize = (1 << 12);    // requires (chunksize % 16 == 0)
+static const size_t pagesize = (1 << 12);     // runs are whole pages
+
+/* Number of segregated free lists */
+#define SEG_CLASSES 14
+
+/* Default mm_trim_threshold and mm_run_threshold */
+#define TRIM_THRESHOLD (128 << 10)
+#define RUN_THRESHOLD (256 << 10)
 
 static const word_t alloc_mask = 0x1;
+static const word_t prev_alloc_mask = 0x2;
+static const word_t prev_mini_mask = 0x4;
+static const word_t run_mask = 0x8;
 static const word_t size_mask = ~(word_t)0xF;
 
+/* Offset of a free block from heap_base, 0 for no block */
+typedef uint32_t link_t;
+
 typedef struct block
 {
-    /* Header contains size + allocation flag */
+    /* Header contains size + allocation flags */
     word_t header;
-    /*
-     * We don't know how big the payload will be.  Declaring it as an
-     * array of size 0 allows computing its starting address using
-     * pointer notation.
-     */
-    char payload[0];
+    union
+    {
+        /* Free blocks keep their free list links at the payload's place */
+        struct
+        {
+            link_t next;
+            link_t prev;
+        } links;
+        /*
+         * We don't know how big the payload will be.  Declaring it as an
+         * array of size 0 allows computing its starting address using
+         * pointer notation.
+         */
+        char payload[0];
+    };
     /*
      * We can't declare the footer as part of the struct, since its starting
      * position is unknown
@@ -126,15 +194,38 @@ typedef struct block
 /* Pointer to first block */
 static block_t *heap_listp = NULL;
 
+/* Start of the heap, which links are relative to */
+static char *heap_base = NULL;
+
+/* Heads of the segregated free lists */
+static block_t *seg_list[SEG_CLASSES];
+
+/* The free bytes kept at the top of the heap, which is trimmed down to about
+ * this once it has twice as many, 0 for never */
+int mm_trim_threshold = TRIM_THRESHOLD;
+
+/* Requests this big get a run of pages of their own, 0 for never */
+int mm_run_threshold = RUN_THRESHOLD;
+
 /* Function prototypes for internal helper routines */
 static block_t *extend_heap(size_t size);
 static void place(block_t *block, size_t asize);
 static block_t *find_fit(size_t asize);
 static block_t *coalesce(block_t *block);
+static void trim(block_t *block);
+
+static void *run_alloc(size_t size);
+static bool is_run(block_t *block);
+
+static int get_class(size_t size);
+static void insert_free(block_t *block);
+static void remove_free(block_t *block);
+static block_t *link_to_block(link_t link);
+static link_t block_to_link(block_t *block);
 
 static size_t max(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
-static word_t pack(size_t size, bool alloc);
+static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_mini);
 
 static size_t extract_size(word_t header);
 static size_t get_size(block_t *block);
@@ -142,9 +233,12 @@ static size_t get_payload_size(block_t *block);
 
 static bool extract_alloc(word_t header);
 static bool get_alloc(block_t *block);
+static bool get_prev_alloc(block_t *block);
+static bool get_prev_mini(block_t *block);
 
-static void write_header(block_t *block, size_t size, bool alloc);
-static void write_footer(block_t *block, size_t size, bool alloc);
+static void write_block(block_t *block, size_t size, bool alloc,
+                        bool prev_alloc, bool prev_mini);
+static void update_next(block_t *block);
 
 static block_t *payload_to_header(void *bp);
 static void *header_to_payload(block_t *block);
@@ -166,6 +260,11 @@ bool mm_init(void)
 {
     mem_init(0xffffffff);
 
+    for (int i = 0; i < SEG_CLASSES; i++)
+    {
+        seg_list[i] = NULL;
+    }
+
     // Create the initial empty heap
     word_t *start = (word_t *)(mem_sbrk(2*wsize));
 
@@ -174,10 +273,12 @@ bool mm_init(void)
         return false;
     }
 
-    start[0] = pack(0, true); // Prologue footer
-    start[1] = pack(0, true); // Epilogue header
+    start[0] = pack(0, true, true, false); // Prologue footer
+    start[1] = pack(0, true, true, false); // Epilogue header
     // Heap starts with first block header (epilogue)
     heap_listp = (block_t *) &(start[1]);
+    // No block starts at start, so link 0 means none
+    heap_base = (char *)start;
 
     // Extend the empty heap with a free block of chunksize bytes
     if (extend_heap(chunksize) == NULL)
@@ -188,19 +289,22 @@ bool mm_init(void)
 }
 
 /*
- * malloc: allocates a block with size at least (size + dsize), rounded up to
- *         the nearest 16 bytes, with a minimum of 2*dsize. Seeks a
+ * malloc: allocates a block with size at least (size + wsize), rounded up to
+ *         the nearest 16 bytes, with a minimum of mini_block_size. Seeks a
  *         sufficiently-large unallocated block on the heap to be allocated.
  *         If no such block is found, extends heap by the maximum between
- *         chunksize and (size + dsize) rounded up to the nearest 16 bytes,
+ *         chunksize and (size + wsize) rounded up to the nearest 16 bytes,
  *         and then attempts to allocate all, or a part of, that memory.
  *         Returns NULL on failure, otherwise returns a pointer to such block.
  *         The allocated block will not be used for further allocations until
  *         freed.
+ *         Requests of at least mm_run_threshold bytes are served by a run
+ *         of pages of their own instead, see run_alloc, or by the heap
+ *         when no run can be mapped.
  */
 void *_malloc(size_t size)
 {
-    dbg_requires(mm_checkheap(__LINE__));
+    dbg_checkheap();
 
     size_t asize;      // Adjusted block size
     size_t extendsize; // Amount to extend heap if no fit is found
@@ -214,12 +318,24 @@ void *_malloc(size_t size)
 
     if (size == 0) // Ignore spurious request
     {
-        dbg_ensures(mm_checkheap(__LINE__));
+        dbg_checkheap();
         return bp;
     }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size, dsize) + dsize;
+    // Very large requests don't go on the heap, unless no run can be
+    // mapped for them
+    if (mm_run_threshold > 0 && size >= (size_t)mm_run_threshold)
+    {
+        bp = run_alloc(size);
+        if (bp != NULL)
+        {
+            return bp;
+        }
+    }
+
+    // Adjust block size to include the header and to meet alignment
+    // requirements; allocated blocks have no footer
+    asize = max(round_up(size + wsize, dsize), mini_block_size);
 
     // Search the free list for a fit
     block = find_fit(asize);
@@ -227,7 +343,15 @@ void *_malloc(size_t size)
     // If no fit is found, request more memory, and then and place the block
     if (block == NULL)
     {
-        extendsize = max(asize, chunksize);
+        // A free block at the top of the heap grows into the new memory,
+        // so only ask for what it is missing
+        block_t *epilogue = (block_t *)(heap_base + mem_heapsize() - wsize);
+        extendsize = asize;
+        if (!get_prev_alloc(epilogue))
+        {
+            extendsize -= get_size(find_prev(epilogue));
+        }
+        extendsize = max(extendsize, chunksize);
         block = extend_heap(extendsize);
         if (block == NULL) // extend_heap returns an error
         {
@@ -239,13 +363,15 @@ void *_malloc(size_t size)
     place(block, asize);
     bp = header_to_payload(block);
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    dbg_checkheap();
     return bp;
 }
 
 /*
  * free: Frees the block such that it is no longer allocated while still
  *       maintaining its size. Block will be available for use on malloc.
+ *       A run is unmapped, and a free block of at least twice
+ *       mm_trim_threshold bytes left at the top of the heap is trimmed.
  */
 void _free(void *bp)
 {
@@ -257,11 +383,27 @@ void _free(void *bp)
     block_t *block = payload_to_header(bp);
     size_t size = get_size(block);
 
-    write_header(block, size, false);
-    write_footer(block, size, false);
+    if (is_run(block))
+    {
+        // The run starts a word before the header
+        mem_unmap_run((char *)block - wsize);
+        return;
+    }
+
+    write_block(block, size, false,
+                get_prev_alloc(block), get_prev_mini(block));
+
+    block = coalesce(block);
 
-    coalesce(block);
+    // Cut a big free block at the top of the heap down to the slack
+    if (mm_trim_threshold > 0
+        && get_size(block) >= 2 * (size_t)mm_trim_threshold
+        && get_size(find_next(block)) == 0)
+    {
+        trim(block);
+    }
 
+    dbg_checkheap();
 }
 
 /*
@@ -338,6 +480,21 @@ void *_calloc(size_t nmemb, size_t size)
     return bp;
 }
 
+/*
+ * malloc_usable_size: returns the number of bytes the allocated block at bp
+ *                     can hold, at least what it was allocated with. Only
+ *                     the size bits of the header are read, and those don't
+ *                     change while the block is allocated.
+ */
+size_t _malloc_usable_size(void *bp)
+{
+    if (bp == NULL)
+    {
+        return 0;
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
 /******** The remaining content below are helper and debug routines ********/
 
 /*
@@ -357,13 +514,14 @@ static block_t *extend_heap(size_t size)
         return NULL;
     }
 
-    // Initialize free block header/footer
+    // Initialize free block header/footer, the old epilogue header knows
+    // about the block before it
     block_t *block = payload_to_header(bp);
-    write_header(block, size, false);
-    write_footer(block, size, false);
+    write_block(block, size, false,
+                get_prev_alloc(block), get_prev_mini(block));
     // Create new epilogue header
     block_t *block_next = find_next(block);
-    write_header(block_next, 0, true);
+    write_block(block_next, 0, true, false, false);
 
     // Coalesce in case the previous block was free
     return coalesce(block);
@@ -371,52 +529,119 @@ static block_t *extend_heap(size_t size)
 
 /* Coalesce: Coalesces current block with previous and next blocks if either
  *           or both are unallocated; otherwise the block is not modified.
+ *           The merged neighbours are taken out of their free lists, and
+ *           the result is inserted into its free list.
  *           Returns pointer to the coalesced block. After coalescing, the
- *           immediate contiguous previous and next blocks must be allocated.
+ *           immediate contiguous previous and next blocks must be allocated,
+ *           and the next block's header knows about the coalesced block.
  */
 static block_t *coalesce(block_t * block)
 {
     block_t *block_next = find_next(block);
-    block_t *block_prev = find_prev(block);
+    block_t *block_prev;
 
-    bool prev_alloc = extract_alloc(*(find_prev_footer(block)));
+    bool prev_alloc = get_prev_alloc(block);
     bool next_alloc = get_alloc(block_next);
     size_t size = get_size(block);
 
     if (prev_alloc && next_alloc)              // Case 1
     {
-        return block;
+        // Nothing to merge
     }
 
     else if (prev_alloc && !next_alloc)        // Case 2
     {
+        remove_free(block_next);
         size += get_size(block_next);
-        write_header(block, size, false);
-        write_footer(block, size, false);
+        write_block(block, size, false, true, get_prev_mini(block));
     }
 
     else if (!prev_alloc && next_alloc)        // Case 3
     {
+        block_prev = find_prev(block);
+        remove_free(block_prev);
         size += get_size(block_prev);
-        write_header(block_prev, size, false);
-        write_footer(block_prev, size, false);
+        write_block(block_prev, size, false, true, get_prev_mini(block_prev));
         block = block_prev;
     }
 
     else                                        // Case 4
     {
+        block_prev = find_prev(block);
+        remove_free(block_next);
+        remove_free(block_prev);
         size += get_size(block_next) + get_size(block_prev);
-        write_header(block_prev, size, false);
-        write_footer(block_prev, size, false);
+        write_block(block_prev, size, false, true, get_prev_mini(block_prev));
 
         block = block_prev;
     }
+    insert_free(block);
+    update_next(block);
     return block;
 }
 
+/*
+ * trim: Gives most of a free block at the top of the heap back to the
+ *       kernel. The block keeps mm_trim_threshold bytes, and more up to the
+ *       end of a page, and the epilogue header moves to its new end. The
+ *       pages above the page of the new brk are unmapped by mem_sbrk.
+ */
+static void trim(block_t *block)
+{
+    size_t size = get_size(block);
+    size_t keep;
+
+    // End the heap, epilogue included, on a page boundary
+    keep = round_up((size_t)block + mm_trim_threshold + wsize, pagesize)
+           - wsize - (size_t)block;
+    if (keep >= size)
+    {
+        return;
+    }
+
+    remove_free(block);
+    if (mem_sbrk(-(int)(size - keep)) == NULL)
+    {
+        insert_free(block);
+        return;
+    }
+    // The block before it is allocated, since it was coalesced
+    write_block(block, keep, false, true, get_prev_mini(block));
+    insert_free(block);
+    write_block(find_next(block), 0, true, false, keep == mini_block_size);
+}
+
+/*
+ * run_alloc: Allocates a block of size bytes in a run of pages mapped for
+ *            it alone, which _free unmaps. The block header is a word into
+ *            the run, so the payload is 16-byte aligned; it has run_mask
+ *            set and the size of the whole run. Returns NULL on failure.
+ */
+static void *run_alloc(size_t size)
+{
+    size_t len;
+    block_t *block;
+
+    if (size > (size_t)INT32_MAX - pagesize)
+    {
+        return NULL;
+    }
+    len = round_up(size + dsize, pagesize);
+
+    char *run = mem_map_run((int)len);
+    if (run == NULL)
+    {
+        return NULL;
+    }
+
+    block = (block_t *)(run + wsize);
+    block->header = pack(len, true, true, false) | run_mask;
+    return header_to_payload(block);
+}
+
 /*
  * place: Places block with size of asize at the start of bp. If the remaining
- *        size is at least the minimum block size, then split the block to the
+ *        size is at least the mini block size, then split the block to the
  *        the allocated block and the remaining block as free, which is then
  *        inserted into the segregated list. Requires that the block is
  *        initially unallocated.
@@ -424,45 +649,133 @@ static block_t *coalesce(block_t * block)
 static void place(block_t *block, size_t asize)
 {
     size_t csize = get_size(block);
+    bool prev_mini = get_prev_mini(block);
+
+    remove_free(block);
 
-    if ((csize - asize) >= min_block_size)
+    if ((csize - asize) >= mini_block_size)
     {
         block_t *block_next;
-        write_header(block, asize, true);
-        write_footer(block, asize, true);
+        write_block(block, asize, true, true, prev_mini);
 
         block_next = find_next(block);
-        write_header(block_next, csize-asize, false);
-        write_footer(block_next, csize-asize, false);
+        write_block(block_next, csize-asize, false,
+                    true, asize == mini_block_size);
+        // The block after it is allocated, nothing to coalesce
+        insert_free(block_next);
+        update_next(block_next);
     }
 
     else
     {
-        write_header(block, csize, true);
-        write_footer(block, csize, true);
+        write_block(block, csize, true, true, prev_mini);
+        update_next(block);
     }
 }
 
 /*
  * find_fit: Looks for a free block with at least asize bytes with
- *           first-fit policy. Returns NULL if none is found.
+ *           first-fit policy in the free list for asize, then takes the
+ *           head of the first non-empty list after it, whose blocks all
+ *           fit. Returns NULL if none is found.
  */
 static block_t *find_fit(size_t asize)
 {
     block_t *block;
+    int cls = get_class(asize);
 
-    for (block = heap_listp; get_size(block) > 0;
-                             block = find_next(block))
+    for (block = seg_list[cls]; block != NULL;
+         block = link_to_block(block->links.next))
     {
-
-        if (!(get_alloc(block)) && (asize <= get_size(block)))
+        if (asize <= get_size(block))
         {
             return block;
         }
     }
+
+    for (cls++; cls < SEG_CLASSES; cls++)
+    {
+        if (seg_list[cls] != NULL)
+        {
+            return seg_list[cls];
+        }
+    }
     return NULL; // no fit found
 }
 
+/*
+ * get_class: returns the index of the free list for blocks of size bytes.
+ */
+static int get_class(size_t size)
+{
+    int cls = 0;
+    size_t limit = mini_block_size;
+
+    while (cls < SEG_CLASSES - 1 && size > limit)
+    {
+        limit <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+/*
+ * insert_free: pushes a free block at the head of its free list.
+ */
+static void insert_free(block_t *block)
+{
+    int cls = get_class(get_size(block));
+
+    block->links.prev = 0;
+    block->links.next = block_to_link(seg_list[cls]);
+    if (seg_list[cls] != NULL)
+    {
+        seg_list[cls]->links.prev = block_to_link(block);
+    }
+    seg_list[cls] = block;
+}
+
+/*
+ * remove_free: unlinks a free block from its free list. The block's size
+ *              must be the one it was inserted with.
+ */
+static void remove_free(block_t *block)
+{
+    block_t *prev = link_to_block(block->links.prev);
+    block_t *next = link_to_block(block->links.next);
+
+    if (prev != NULL)
+    {
+        prev->links.next = block->links.next;
+    }
+    else
+    {
+        seg_list[get_class(get_size(block))] = next;
+    }
+
+    if (next != NULL)
+    {
+        next->links.prev = block->links.prev;
+    }
+}
+
+/*
+ * link_to_block: returns the block a free list link refers to, or NULL.
+ */
+static block_t *link_to_block(link_t link)
+{
+    return (link == 0) ? NULL : (block_t *)(heap_base + link);
+}
+
+/*
+ * block_to_link: returns the free list link that refers to a block, which
+ *                may be NULL.
+ */
+static link_t block_to_link(block_t *block)
+{
+    return (block == NULL) ? 0 : (link_t)((char *)block - heap_base);
+}
+
 /*
  * max: returns x if x > y, and y otherwise.
  */
@@ -481,12 +794,27 @@ static size_t round_up(size_t size, size_t n)
 }
 
 /*
- * pack: returns a header reflecting a specified size and its alloc status.
- *       If the block is allocated, the lowest bit is set to 1, and 0 otherwise.
+ * pack: returns a header reflecting a specified size, its alloc status and
+ *       the alloc status and mini-ness of the previous block, in bits 0, 1
+ *       and 2 respectively.
  */
-static word_t pack(size_t size, bool alloc)
+static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_mini)
 {
-    return alloc ? (size | 1) : size;
+    word_t word = size;
+
+    if (alloc)
+    {
+        word |= alloc_mask;
+    }
+    if (prev_alloc)
+    {
+        word |= prev_alloc_mask;
+    }
+    if (prev_mini)
+    {
+        word |= prev_mini_mask;
+    }
+    return word;
 }
 
 
@@ -509,13 +837,23 @@ static size_t get_size(block_t *block)
 }
 
 /*
- * get_payload_size: returns the payload size of a given block, equal to
- *                   the entire block size minus the header and footer sizes.
+ * get_payload_size: returns the payload size of a given allocated block,
+ *                   equal to the entire block size minus the header size,
+ *                   or for a run, minus the header and the word before it.
  */
 static size_t get_payload_size(block_t *block)
 {
     size_t asize = get_size(block);
-    return asize - dsize;
+    return is_run(block) ? asize - dsize : asize - wsize;
+}
+
+/*
+ * is_run: returns true when the allocated block is a run of pages of its
+ *         own rather than part of the heap.
+ */
+static bool is_run(block_t *block)
+{
+    return (bool)(block->header & run_mask);
 }
 
 /*
@@ -537,26 +875,53 @@ static bool get_alloc(block_t *block)
 }
 
 /*
- * write_header: given a block and its size and allocation status,
- *               writes an appropriate value to the block header.
+ * get_prev_alloc: returns true when the block before this one is allocated.
  */
-static void write_header(block_t *block, size_t size, bool alloc)
+static bool get_prev_alloc(block_t *block)
 {
-    block->header = pack(size, alloc);
+    return (bool)(block->header & prev_alloc_mask);
 }
 
+/*
+ * get_prev_mini: returns true when the block before this one is a mini
+ *                block.
+ */
+static bool get_prev_mini(block_t *block)
+{
+    return (bool)(block->header & prev_mini_mask);
+}
 
 /*
- * write_footer: given a block and its size and allocation status,
- *               writes an appropriate value to the block footer by first
- *               computing the position of the footer.
+ * write_block: given a block, its size and allocation status, and those of
+ *              the previous block, writes the block header, and the footer
+ *              if the block is free and has room for it.
+ *              The header of the next block is left alone; see update_next.
  */
-static void write_footer(block_t *block, size_t size, bool alloc)
+static void write_block(block_t *block, size_t size, bool alloc,
+                        bool prev_alloc, bool prev_mini)
 {
-    word_t *footerp = (word_t *)((block->payload) + get_size(block) - dsize);
-    *footerp = pack(size, alloc);
+    block->header = pack(size, alloc, prev_alloc, prev_mini);
+
+    if (!alloc && size > mini_block_size)
+    {
+        word_t *footerp = (word_t *)((block->payload) + size - dsize);
+        *footerp = pack(size, false, false, false);
+    }
 }
 
+/*
+ * update_next: tells the header of the next block whether the given block
+ *              is allocated and whether it is a mini block.
+ */
+static void update_next(block_t *block)
+{
+    block_t *block_next = find_next(block);
+    word_t header = block_next->header & ~(prev_alloc_mask | prev_mini_mask);
+
+    block_next->header = header |
+                         pack(0, false, get_alloc(block),
+                              get_size(block) == mini_block_size);
+}
 
 /*
  * find_next: returns the next consecutive block on the heap by adding the
@@ -581,14 +946,23 @@ static word_t *find_prev_footer(block_t *block)
 }
 
 /*
- * find_prev: returns the previous block position by checking the previous
- *            block's footer and calculating the start of the previous block
- *            based on its size.
+ * find_prev: returns the previous block position, which must be free. A
+ *            mini block is mini_block_size bytes back, any other free
+ *            block tells its size in its footer.
  */
 static block_t *find_prev(block_t *block)
 {
-    word_t *footerp = find_prev_footer(block);
-    size_t size = extract_size(*footerp);
+    dbg_requires(!get_prev_alloc(block));
+    size_t size;
+
+    if (get_prev_mini(block))
+    {
+        size = mini_block_size;
+    }
+    else
+    {
+        size = extract_size(*find_prev_footer(block));
+    }
     return (block_t *)((char *)block - size);
 }
 
@@ -614,24 +988,109 @@ static void *header_to_payload(block_t *block)
  *               the heap is correct, and false otherwise.
  *               can call this function using mm_checkheap(__LINE__);
  *               to identify the line number of the call site.
+ *               Walks every block of the heap and then every free list:
+ *               - the prologue and epilogue are in place,
+ *               - headers of free blocks match their footers, blocks are
+ *                 aligned and big enough,
+ *               - every header knows whether the block before it is
+ *                 allocated and whether it is a mini block,
+ *               - no two free blocks are next to each other,
+ *               - the lists link both ways, hold only free blocks of their
+ *                 size class, and hold all of the free blocks.
  */
 bool mm_checkheap(int lineno)
 {
-    if (heap_listp != NULL)
+    block_t *block;
+    size_t nfree = 0;
+    size_t nlisted = 0;
+    bool prev_free = false;
+    bool prev_mini = false;
+
+    if (heap_listp == NULL)
     {
-        // check prologue footer: size is 0 and prologue is allocated
-        word_t prologue_footer = *find_prev_footer(heap_listp);
-        assert(extract_size(prologue_footer) == 0 && extract_alloc(prologue_footer));
+        return true;
+    }
 
+    // check prologue footer: size is 0 and prologue is allocated
+    word_t prologue_footer = *find_prev_footer(heap_listp);
+    if (extract_size(prologue_footer) != 0 || !extract_alloc(prologue_footer))
+    {
+        printf("mm_checkheap(%d): bad prologue\n", lineno);
+        return false;
+    }
+
+    for (block = heap_listp; get_size(block) > 0; block = find_next(block))
+    {
+        if (get_prev_alloc(block) == prev_free ||
+            get_prev_mini(block) != prev_mini)
+        {
+            printf("mm_checkheap(%d): %p is wrong about the block before it\n",
+                   lineno, block);
+            return false;
+        }
         // check header-footer consistency
-        block_t *block = heap_listp;
-        if (get_size(block) != 0)
+        word_t block_footer = *(find_prev_footer(find_next(block)));
+        if (!get_alloc(block) && get_size(block) > mini_block_size &&
+            (extract_size(block->header) != extract_size(block_footer) ||
+             extract_alloc(block_footer)))
+        {
+            printf("mm_checkheap(%d): header and footer of %p differ\n",
+                   lineno, block);
+            return false;
+        }
+        if (get_size(block) < mini_block_size ||
+            ((uintptr_t)block->payload % dsize) != 0)
+        {
+            printf("mm_checkheap(%d): block %p is misaligned or too small\n",
+                   lineno, block);
+            return false;
+        }
+        if (!get_alloc(block))
+        {
+            if (prev_free)
+            {
+                printf("mm_checkheap(%d): free block %p is not coalesced\n",
+                       lineno, block);
+                return false;
+            }
+            nfree++;
+        }
+        prev_free = !get_alloc(block);
+        prev_mini = (get_size(block) == mini_block_size);
+    }
+
+    // check epilogue header: size is 0 and epilogue is allocated
+    if (!get_alloc(block) || get_prev_alloc(block) == prev_free ||
+        get_prev_mini(block) != prev_mini)
+    {
+        printf("mm_checkheap(%d): bad epilogue\n", lineno);
+        return false;
+    }
+
+    for (int cls = 0; cls < SEG_CLASSES; cls++)
+    {
+        block_t *prev = NULL;
+        for (block = seg_list[cls]; block != NULL;
+             block = link_to_block(block->links.next))
         {
-            word_t block_header = block->header;
-            word_t block_footer = *(find_prev_footer(find_next(heap_listp)));
-            assert(extract_size(block_header) == extract_size(block_footer));
-            assert(extract_alloc(block_header) == extract_alloc(block_footer));
+            // more than there are free blocks means a cycle
+            if (get_alloc(block) || get_class(get_size(block)) != cls ||
+                link_to_block(block->links.prev) != prev ||
+                ++nlisted > nfree)
+            {
+                printf("mm_checkheap(%d): free list %d is broken at %p\n",
+                       lineno, cls, block);
+                return false;
+            }
+            prev = block;
         }
     }
+
+    if (nlisted != nfree)
+    {
+        printf("mm_checkheap(%d): %u free blocks, %u in the lists\n",
+               lineno, (unsigned)nfree, (unsigned)nlisted);
+        return false;
+    }
     return true;
 }
@@ -17,10 +17,24 @@
 #define NULL 0
 #endif
 
+/* Runs are mapped below this address, downwards */
+#define MEM_RUN_TOP ((char *)0xC0000000)
+/* Most ranges of addresses for runs */
+#define MEM_MAX_RUNS 64
+
 /* private global variables */
 static char *mem_max_addr;   /* max virtual address for the heap */
 static char *mem_brkp; /* Simulated brk pointer */
 static char *mem_alloctop; /* Maximum allocated address */
+static char *mem_start_brk; /* First address of the heap */
+
+/* Ranges of addresses for runs, from MEM_RUN_TOP down */
+static struct {
+  char *lo;   /* start of the range */
+  int len;    /* length of the range */
+  int mapped; /* 1 if a run is mapped at lo */
+} mem_runs[MEM_MAX_RUNS];
+static int mem_nruns; /* Ranges in mem_runs */
 
 extern void *_end; /* The end of the ELF binary address space */
 
@@ -35,38 +49,127 @@ void mem_init(int max_heap_addr)
   mem_brkp = (char*)((int)mem_brkp & PAGE_ALIGN_MASK);
   while (new_pages(mem_brkp, PAGE_SIZE))
     mem_brkp += PAGE_SIZE;
+  mem_start_brk = mem_brkp;
   mem_alloctop = mem_brkp + PAGE_SIZE;
 }
 
 /* 
  * mem_sbrk - simply uses the the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap, and the pages wholly above the
+ *    new brk are given back to the kernel. So that any of them can be,
+ *    every page of the heap is mapped by a new_pages of its own.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brkp;
+    char *keep;
 
     /* Error check the request. */
-    if ( (incr < 0) || ((old_brk + incr) > mem_max_addr)) {
+    if ( (old_brk + incr < mem_start_brk) ||
+         ((old_brk + incr) > mem_max_addr)) {
       return (void *)NULL;
     }
 
-    if (old_brk + incr > mem_alloctop) {
-      int allocincr = old_brk + incr - mem_alloctop;
-      allocincr += PAGE_SIZE - 1;
-      allocincr &= PAGE_ALIGN_MASK;
-
+    while (old_brk + incr > mem_alloctop) {
       /* Issue a SBRK for more memory. */
-      if (new_pages((void*)mem_alloctop, allocincr)) {
+      if (new_pages((void*)mem_alloctop, PAGE_SIZE)) {
 	return (void *)NULL;
       }
 
-      mem_alloctop += allocincr;
+      mem_alloctop += PAGE_SIZE;
     }
 
     mem_brkp += incr;
 
+    /* Give back the pages above the brk, keep the one it is in. */
+    keep = (char*)(((int)mem_brkp + PAGE_SIZE - 1) & PAGE_ALIGN_MASK);
+    while (mem_alloctop > keep) {
+      if (remove_pages(mem_alloctop - PAGE_SIZE) < 0)
+        break;
+      mem_alloctop -= PAGE_SIZE;
+    }
+
     return (void *)old_brk;
 }
+
+/*
+ * mem_map_run - maps len bytes, rounded up to whole pages, out of the
+ *    heap, for one big block. The runs are placed from MEM_RUN_TOP down,
+ *    each in a range of addresses of its own; the range of an unmapped run
+ *    is reused for a run that fits in it, else a new range is taken.
+ *    Returns the page-aligned start of the run, or NULL if it can't be
+ *    mapped.
+ */
+void *mem_map_run(int len)
+{
+    char *lo;
+    int i;
+
+    len = (len + PAGE_SIZE - 1) & PAGE_ALIGN_MASK;
+    if (len <= 0) {
+      return (void *)NULL;
+    }
+
+    for (i = 0; i < mem_nruns; i++) {
+      /* the heap may have grown into a free range, try the next one */
+      if (!mem_runs[i].mapped && mem_runs[i].len >= len &&
+          !new_pages(mem_runs[i].lo, len)) {
+        mem_runs[i].mapped = 1;
+        return mem_runs[i].lo;
+      }
+    }
+
+    if (mem_nruns == MEM_MAX_RUNS) {
+      return (void *)NULL;
+    }
+    lo = (mem_nruns > 0) ? mem_runs[mem_nruns - 1].lo : MEM_RUN_TOP;
+    if (lo - len <= mem_alloctop) {
+      return (void *)NULL;
+    }
+    lo -= len;
+    if (new_pages(lo, len)) {
+      return (void *)NULL;
+    }
+
+    mem_runs[mem_nruns].lo = lo;
+    mem_runs[mem_nruns].len = len;
+    mem_runs[mem_nruns].mapped = 1;
+    mem_nruns++;
+    return lo;
+}
+
+/*
+ * mem_unmap_run - gives a run from mem_map_run back to the kernel.
+ *    Returns 0 on success, -1 if run is not a mapped run.
+ */
+int mem_unmap_run(void *run)
+{
+    int i;
+
+    for (i = 0; i < mem_nruns; i++) {
+      if (mem_runs[i].mapped && mem_runs[i].lo == run) {
+        break;
+      }
+    }
+    if (i == mem_nruns || remove_pages(run) < 0) {
+      return -1;
+    }
+    mem_runs[i].mapped = 0;
+
+    /* the lowest ranges are free for runs of any size again */
+    while (mem_nruns > 0 && !mem_runs[mem_nruns - 1].mapped) {
+      mem_nruns--;
+    }
+    return 0;
+}
+
+/*
+ * mem_heapsize - returns the heap size in bytes, from its start to the
+ *    simulated brk pointer.
+ */
+int mem_heapsize(void)
+{
+    return (int)(mem_brkp - mem_start_brk);
+}
 /* $end memlib */
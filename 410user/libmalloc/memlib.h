@@ -9,5 +9,8 @@
 
 void *mem_init(int size);
 void *mem_sbrk(int incr);
+int mem_heapsize(void);
+void *mem_map_run(int len);
+int mem_unmap_run(void *run);
 
 #endif /* _MEMLIB_H */
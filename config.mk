@@ -97,14 +97,21 @@ UPDATE_METHOD = afs
 # A list of the test programs you want compiled in from the user/progs
 # directory
 #
-STUDENTTESTS = test_xadd
+STUDENTTESTS = test_xadd bench_mutex test_thr_join_any\
+               test_mutex_trylock bench_mutex_latency test_cond_timedwait\
+               test_sem_batch bench_rwlock bench_rmlock\
+               test_seqlock test_rwlock_upgrade bench_barrier\
+               bench_malloc bench_malloc_trace test_malloc_trim\
+               bench_pool test_thr_detach test_thr_key test_pool
 
 ###########################################################################
 # Object files for your thread library
 ###########################################################################
-THREAD_OBJS = malloc.o panic.o xadd_wrapper.o mutex.o cond.o\
-              thread.o thr_create_asm.o get_ebp.o\
-	      sem.o rwlock.o handler.o
+THREAD_OBJS = malloc.o panic.o xadd_wrapper.o xchg_wrapper.o xaddn_wrapper.o\
+              cmpxchg_wrapper.o mutex.o cond.o\
+              thread.o thr_create_asm.o thr_vanish_asm.o get_ebp.o park.o\
+	      sem.o rwlock.o handler.o thr_key.o lockstat.o\
+              timer.o rmlock.o seqlock.o barrier.o pool.o
 
 # Thread Group Library Support.
 #
@@ -0,0 +1,19 @@
+/** @file barrier.h
+ *  @brief This file defines the interface to barriers.
+ *
+ *  barrier_wait() returns once all n threads of barrier_init() have
+ *  called it, and the barrier is ready for the next phase right away.
+ *  It returns 1 in one of the threads and 0 in the others, so that one
+ *  thread can do the serial work between two phases.
+ */
+
+#ifndef BARRIER_H
+#define BARRIER_H
+
+#include <barrier_type.h>
+
+int barrier_init( barrier_t *b, int n );
+int barrier_wait( barrier_t *b );
+void barrier_destroy( barrier_t *b );
+
+#endif /* BARRIER_H */
@@ -0,0 +1,45 @@
+/** @file barrier_type.h
+ *  @brief This file defines the type for barriers.
+ */
+
+#ifndef _BARRIER_TYPE_H
+#define _BARRIER_TYPE_H
+
+/** @brief A counter that a fixed number of threads meet at, see barrier.c */
+typedef struct barrier_node {
+    /* The arrivals of this phase in the low bits, and the sense of this
+     * phase in BARRIER_SENSE, so both are claimed with one cmpxchg */
+    int state;
+    /* The number of arrivals that completes the phase */
+    int cap;
+    /* The winner of this node goes on to the parent, NULL at the root */
+    struct barrier_node *parent;
+    /* The threads in barrier_wait that arrived at this leaf, 0 for the
+     * upper nodes */
+    int users;
+    /* The threads parked for the phase with sense 0 and with sense 1.
+     * Pushed with a cmpxchg, closed by the release of their phase */
+    void *parked[2];
+} barrier_node_t;
+
+typedef struct barrier {
+    /* Indicate whether the barrier is initialized or not.
+     * 1 is yes, 0 is no. If init is 0, it could also mean that
+     * the barrier has been destroyed */
+    int init;
+
+    /* The number of threads that meet at the barrier */
+    int n;
+
+    /* The nodes threads arrive at first, nleaves of them. Either
+     * &central, or the start of a malloc'd tree, whose last node is
+     * the root */
+    barrier_node_t *leaves;
+    int nleaves;
+    int nnodes;
+
+    /* The only node of a barrier for a few threads */
+    barrier_node_t central;
+} barrier_t;
+
+#endif /* _BARRIER_TYPE_H */
@@ -0,0 +1,13 @@
+/** @file cond_ext.h
+ *  @brief This file defines condition variable functions that are not
+ *  part of the standard interface in cond.h.
+ */
+
+#ifndef COND_EXT_H
+#define COND_EXT_H
+
+#include <cond.h>
+
+int cond_timedwait( cond_t *cv, mutex_t *mp, unsigned int ticks );
+
+#endif /* COND_EXT_H */
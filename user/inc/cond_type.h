@@ -5,6 +5,7 @@
 #ifndef _COND_TYPE_H
 #define _COND_TYPE_H
 
+#include <lockstat_type.h>
 #include <mutex_type.h>
 
 typedef struct cond {
@@ -12,19 +13,27 @@ typedef struct cond {
      * no. If init is 0, it could also mean that the mutex has been
      * destroyed. */
     int init;
-    /* The lock used in condition variable's world to make sure the queue
-     * state changes are protected. */
-    mutex_t mutex;
+    /* Spin lock serializing the threads that take waiters out of the
+     * queue. Waiters never take it. */
+    int guard;
+    /* The number of waiters in the incoming stack and the queue. A
+     * signal with nobody waiting only loads this. */
+    int nwaiters;
+    /* Waiters push themselves here with a cmpxchg, newest first, linked
+     * through thr_stk_t's "cv_next" pointer. The guard holder moves them
+     * over to the queue below. */
+    void *incoming;
     /* The head pointer of the waiting thread queue. When deq an item
      * from the queue, the head move to the next item using thr_t data
-     * structure's "next" pointer. */
+     * structure's "cv_next" pointer. */
     void *head;
-    /* The tail pointer of the waiting thread queue. When enq an item
-     * to the queue, the current tail would link with the new item using
-     * thr_t data structure's "next" pointer. Then the tail pointer would
-     * be moved to the new thread item. The new thread item's "next"
-     * pointer is NULL. */
+    /* The tail pointer of the waiting thread queue, the last thread
+     * item, whose "cv_next" pointer is NULL. */
     void *tail;
+#ifdef THR_LOCKSTATS
+    /* Contention statistics, see lockstat.c */
+    lockstat_t stat;
+#endif
 } cond_t;
 
 #endif /* _COND_TYPE_H */
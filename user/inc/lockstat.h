@@ -0,0 +1,28 @@
+/** @file lockstat.h
+ *  @brief This file defines the interface for lock statistics.
+ *
+ *  When libthread is built without THR_LOCKSTATS these are empty inline
+ *  functions that compile to nothing.
+ */
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include <lockstat_type.h>
+
+#ifdef THR_LOCKSTATS
+
+int thr_lockstats_name( void *lock, const char *name );
+void thr_lockstats_dump( int n );
+
+#else
+
+static inline int thr_lockstats_name( void *lock, const char *name )
+{
+    return 0;
+}
+static inline void thr_lockstats_dump( int n ) {}
+
+#endif /* THR_LOCKSTATS */
+
+#endif /* LOCKSTAT_H */
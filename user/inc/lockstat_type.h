@@ -0,0 +1,43 @@
+/** @file lockstat_type.h
+ *  @brief This file defines the per-lock statistics record.
+ *
+ *  Lock statistics are a build-time option. Define THR_LOCKSTATS below to
+ *  give every mutex, condition variable, semaphore and rwlock a lockstat_t
+ *  and to make the lock operations count into it. Without it the lock
+ *  types and the lock operations are exactly what they would be without
+ *  this file.
+ */
+
+#ifndef _LOCKSTAT_TYPE_H
+#define _LOCKSTAT_TYPE_H
+
+/* Uncomment to build libthread with per-lock statistics */
+/* #define THR_LOCKSTATS */
+
+#ifdef THR_LOCKSTATS
+
+typedef struct lockstat lockstat_t;
+struct lockstat {
+    /* The lock these counters belong to, and its kind, like "mutex" */
+    void *lock;
+    const char *kind;
+    /* Set with thr_lockstats_name(), NULL if the lock has no name */
+    const char *name;
+    /* The number of acquisitions, and how many of them had to wait */
+    unsigned int acquired;
+    unsigned int contended;
+    /* Busy-wait iterations and sleeps spent waiting for the lock */
+    unsigned int spins;
+    unsigned int parks;
+    /* Hold times in get_ticks() units, for locks that are held */
+    unsigned int hold_start;
+    unsigned int hold_total;
+    unsigned int hold_max;
+    /* The list of all live locks, see lockstat.c */
+    lockstat_t *next;
+    lockstat_t *prev;
+};
+
+#endif /* THR_LOCKSTATS */
+
+#endif /* _LOCKSTAT_TYPE_H */
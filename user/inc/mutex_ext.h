@@ -0,0 +1,14 @@
+/** @file mutex_ext.h
+ *  @brief This file defines mutex functions that are not part of the
+ *  standard interface in mutex.h.
+ */
+
+#ifndef MUTEX_EXT_H
+#define MUTEX_EXT_H
+
+#include <mutex.h>
+
+int mutex_trylock( mutex_t *mp );
+int mutex_lock_until( mutex_t *mp, unsigned int ticks );
+
+#endif /* MUTEX_EXT_H */
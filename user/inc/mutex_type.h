@@ -5,6 +5,7 @@
 #ifndef _MUTEX_TYPE_H
 #define _MUTEX_TYPE_H
 
+#include <lockstat_type.h>
 
 typedef struct mutex {
     /* Indicate whether the mutex is initialized or not. 1 is yes, 0 is 
@@ -17,5 +18,18 @@ typedef struct mutex {
     /* The global turn for waiting threads. Only when a thread's ticket
      * matches this global turn, the thread could get the lock. */
     int turn;
+    /* Spin lock guarding the wait queue below. Held only for a few
+     * instructions, never across a system call. */
+    int guard;
+    /* The number of threads parked in the wait queue. Lets mutex_unlock
+     * skip the guard when nobody is asleep. */
+    int nparked;
+    /* The parked waiters, sorted by ticket. The head is the first one
+     * to get the lock. */
+    void *waitq;
+#ifdef THR_LOCKSTATS
+    /* Contention statistics, see lockstat.c */
+    lockstat_t stat;
+#endif
 } mutex_t;
 #endif /* _MUTEX_TYPE_H */
@@ -0,0 +1,21 @@
+/** @file pool.h
+ *  @brief This file defines the interface to object pools.
+ *
+ *  A pool hands out objects of one size, aligned as asked in
+ *  pool_init(). pool_alloc() and pool_free() mostly take and put back
+ *  objects in a cache of the calling thread, without a lock. An object
+ *  may be freed by another thread than the one that allocated it.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <types.h>
+#include <pool_type.h>
+
+int pool_init( pool_t *pool, size_t obj_size, size_t align );
+void *pool_alloc( pool_t *pool );
+void pool_free( pool_t *pool, void *obj );
+void pool_destroy( pool_t *pool );
+
+#endif /* POOL_H */
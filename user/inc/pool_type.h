@@ -0,0 +1,42 @@
+/** @file pool_type.h
+ *  @brief This file defines the type for object pools.
+ */
+
+#ifndef _POOL_TYPE_H
+#define _POOL_TYPE_H
+
+#include <mutex_type.h>
+
+typedef struct pool {
+    /* Indicate whether the pool is initialized or not.
+     * 1 is yes, 0 is no. If init is 0, it could also mean that
+     * the pool has been destroyed */
+    int init;
+
+    /* The size of an object, a multiple of the alignment */
+    int obj_size;
+
+    /* Where the first object of a slab starts, and how many fit */
+    int first;
+    int per_slab;
+
+    /* Free objects no thread caches, linked through their first word */
+    void *free;
+
+    /* Tells this pool from an earlier one initialized at the same address */
+    int gen;
+
+    /* Objects exited threads gave back, linked like free. Guarded by the
+     * library's pool lock, like the list of live pools */
+    void *returned;
+    struct pool *next;
+    struct pool *prev;
+
+    /* The slabs of the pool, linked through their first word */
+    void *slabs;
+
+    /* Guards free and slabs */
+    mutex_t mutex;
+} pool_t;
+
+#endif /* _POOL_TYPE_H */
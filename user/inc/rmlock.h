@@ -0,0 +1,20 @@
+/** @file rmlock.h
+ *  @brief This file defines the interface to read-mostly locks.
+ *
+ *  An rmlock is taken like an rwlock, with RWLOCK_READ or RWLOCK_WRITE.
+ *  Readers are much cheaper and writers much more expensive than with
+ *  an rwlock, so use it only for data that is rarely written.
+ */
+
+#ifndef RMLOCK_H
+#define RMLOCK_H
+
+#include <rwlock.h>
+#include <rmlock_type.h>
+
+int rmlock_init( rmlock_t *rmlock );
+void rmlock_lock( rmlock_t *rmlock, int type );
+void rmlock_unlock( rmlock_t *rmlock );
+void rmlock_destroy( rmlock_t *rmlock );
+
+#endif /* RMLOCK_H */
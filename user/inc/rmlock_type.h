@@ -0,0 +1,25 @@
+/** @file rmlock_type.h
+ *  @brief This file defines the type for read-mostly locks.
+ */
+
+#ifndef _RMLOCK_TYPE_H
+#define _RMLOCK_TYPE_H
+
+#include <rwlock_type.h>
+
+typedef struct rmlock {
+    /* Indicate whether the rmlock is initialized or not.
+     * 1 is yes, 0 is no. If init is 0, it could also mean that
+     * the rmlock has been destroyed */
+    int init;
+
+    /* The writers holding or waiting for the lock. While it is not 0,
+     * readers take the slow path through rw */
+    int num_writer;
+
+    /* The slow path, held by writers and by the readers that come
+     * while a writer is around */
+    rwlock_t rw;
+} rmlock_t;
+
+#endif /* _RMLOCK_TYPE_H */
@@ -0,0 +1,16 @@
+/** @file rwlock_ext.h
+ *  @brief This file defines rwlock functions that are not part of the
+ *  standard interface in rwlock.h.
+ */
+
+#ifndef RWLOCK_EXT_H
+#define RWLOCK_EXT_H
+
+#include <rwlock.h>
+
+int rwlock_trylock( rwlock_t *rwlock, int type );
+int rwlock_lock_until( rwlock_t *rwlock, int type, unsigned int ticks );
+int rwlock_tryupgrade( rwlock_t *rwlock );
+int rwlock_upgrade( rwlock_t *rwlock );
+
+#endif /* RWLOCK_EXT_H */
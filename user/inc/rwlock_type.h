@@ -6,6 +6,7 @@
 #define _RWLOCK_TYPE_H
 
 #include <cond_type.h>
+#include <lockstat_type.h>
 
 typedef struct rwlock {
     /* Indicate whether the rwlock is initialized or not. 
@@ -13,8 +14,16 @@ typedef struct rwlock {
      * the rwlock has been destroyed */
     int init;
 
+    /* The readers holding the lock */
     int num_reader;
+    /* The writers waiting for the lock */
     int num_wait_writer;
+    /* The readers waiting for the next read phase */
+    int num_wait_reader;
+    /* Bumped every time a read phase starts */
+    int read_phase;
+    /* 1 if a reader is waiting in rwlock_upgrade */
+    int upgrader;
 
     /* The utid of writer thread */
     int writer_tid;
@@ -24,10 +33,15 @@ typedef struct rwlock {
 
     cond_t writer_cv;
     cond_t reader_cv;
+    /* The upgrader waits here for the other readers to leave */
+    cond_t upgrade_cv;
 
     mutex_t mutex;
-    
-    
+
+#ifdef THR_LOCKSTATS
+    /* Contention statistics, see lockstat.c */
+    lockstat_t stat;
+#endif
 } rwlock_t;
 
 #endif /* _RWLOCK_TYPE_H */
@@ -0,0 +1,16 @@
+/** @file sem_ext.h
+ *  @brief This file defines semaphore functions that are not part of the
+ *  standard interface in sem.h.
+ */
+
+#ifndef SEM_EXT_H
+#define SEM_EXT_H
+
+#include <sem.h>
+
+int sem_trywait( sem_t *sem );
+int sem_timedwait( sem_t *sem, unsigned int ticks );
+void sem_wait_n( sem_t *sem, int n );
+void sem_signal_n( sem_t *sem, int n );
+
+#endif /* SEM_EXT_H */
@@ -6,6 +6,7 @@
 #define _SEM_TYPE_H
 
 #include <cond_type.h>
+#include <lockstat_type.h>
 #include <mutex_type.h>
 
 typedef struct sem {
@@ -14,13 +15,27 @@ typedef struct sem {
      * destroyed. */
     int init;
 
-    /* The number of threads are premited to decrease the semaphore */
+    /* The number of threads are premited to decrease the semaphore.
+     * Updated atomically. Below zero, it is minus the number of tokens
+     * the waiters are missing. */
     int count;
 
+    /* Permits posted for the waiters and not taken yet. Protected by
+     * mutex. */
+    int wakeups;
+
+    /* The number of waiters missing more than one token. Protected by
+     * mutex. */
+    int nbatch;
+
     mutex_t mutex;
 
     cond_t cv;
 
+#ifdef THR_LOCKSTATS
+    /* Contention statistics, see lockstat.c */
+    lockstat_t stat;
+#endif
 } sem_t;
 
 #endif /* _SEM_TYPE_H */
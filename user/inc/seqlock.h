@@ -0,0 +1,28 @@
+/** @file seqlock.h
+ *  @brief This file defines the interface to sequence locks.
+ *
+ *  A reader copies the data out in a loop:
+ *
+ *      do {
+ *          seq = seqlock_read_begin(&sl);
+ *          ... copy the data ...
+ *      } while (seqlock_read_retry(&sl, seq));
+ *
+ *  The copy may be torn while inside the loop, so it must not be used
+ *  until seqlock_read_retry() returns 0, and must not follow pointers
+ *  read from the data.
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <seqlock_type.h>
+
+int seqlock_init( seqlock_t *sl );
+int seqlock_read_begin( seqlock_t *sl );
+int seqlock_read_retry( seqlock_t *sl, int seq );
+void seqlock_write_lock( seqlock_t *sl );
+void seqlock_write_unlock( seqlock_t *sl );
+void seqlock_destroy( seqlock_t *sl );
+
+#endif /* SEQLOCK_H */
@@ -0,0 +1,24 @@
+/** @file seqlock_type.h
+ *  @brief This file defines the type for sequence locks.
+ */
+
+#ifndef _SEQLOCK_TYPE_H
+#define _SEQLOCK_TYPE_H
+
+#include <mutex_type.h>
+
+typedef struct seqlock {
+    /* Indicate whether the seqlock is initialized or not.
+     * 1 is yes, 0 is no. If init is 0, it could also mean that
+     * the seqlock has been destroyed */
+    int init;
+
+    /* Bumped when a writer starts and when it ends, so it is odd
+     * while a write is in progress */
+    int seq;
+
+    /* Serializes the writers */
+    mutex_t mutex;
+} seqlock_t;
+
+#endif /* _SEQLOCK_TYPE_H */
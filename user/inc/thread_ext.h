@@ -0,0 +1,24 @@
+/** @file thread_ext.h
+ *  @brief This file defines thread-management functions that are not
+ *  part of the standard interface in thread.h.
+ */
+
+#ifndef THREAD_EXT_H
+#define THREAD_EXT_H
+
+#include <thread.h>
+
+/* detached threads */
+int thr_create_detached( void *(*func)(void *), void *args );
+int thr_detach( int tid );
+
+/* reaping any thread or a batch of threads */
+int thr_join_any( int *tidp, void **statusp );
+int thr_join_many( int *tids, int n, void **statuses );
+
+/* thread-local storage */
+int thr_key_create( int *keyp, void (*destructor)(void *) );
+void *thr_getspecific( int key );
+int thr_setspecific( int key, const void *value );
+
+#endif /* THREAD_EXT_H */
@@ -0,0 +1,361 @@
+/** @file barrier.c
+ *  @brief Implementation of barrier.
+ *
+ *  A barrier is a tree of sense-reversing counters, the nodes. Each
+ *  node expects cap arrivals per phase. The last thread to arrive at a
+ *  node goes on to its parent, the others wait at the node. The thread
+ *  that completes the root has seen everybody arrive, and releases the
+ *  nodes it climbed through, top down. Every thread woken up at a node
+ *  releases the nodes below it that it climbed through, and so on.
+ *
+ *  For a few threads, up to barrier_tree_min, the tree is a single node
+ *  with cap n, which is the usual central barrier. For more, the leaves
+ *  take BARRIER_FANIN threads each, so no counter and no list of sleepers
+ *  is shared by more than BARRIER_FANIN threads, and the wakeups are done
+ *  by many threads in parallel instead of by the last one to arrive.
+ *
+ *  Threads find a leaf with room by starting at their utid and probing.
+ *  The caps add up to n, so each phase fills every node exactly once.
+ *
+ *  The sense of the phase is kept in the same word as the count, so a
+ *  thread learns which phase it joined with the cmpxchg that counts it
+ *  in. The release flips the sense and clears the count with one xchg.
+ *
+ *  A waiter spins a little, then parks on the node's list for its
+ *  phase. The release closes that list with BARRIER_CLOSED, so a waiter
+ *  that comes too late sees the list closed and never sleeps. The list
+ *  of the next phase is reopened before the flip. Nobody can still be
+ *  using it: the last phase that did ended before all n threads could
+ *  arrive for this one.
+ *
+ *  A released thread may still be spinning on or pushing onto a node
+ *  after the phase is over, so every leaf counts the threads that are
+ *  in barrier_wait through it, and barrier_destroy waits for them all
+ *  to leave before freeing the tree.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stddef.h> /* NULL */
+#include <malloc.h>
+#include <simics.h> /* lprintf() */
+#include <assert.h> /* panic() */
+#include <syscall.h> /* yield() */
+#include <barrier.h>
+#include <thread.h> /* thr_getid() */
+#include <thr_internals.h>
+
+/** @brief The sense bit in barrier_node_t's state */
+#define BARRIER_SENSE 0x40000000
+
+/** @brief The arrivals in barrier_node_t's state */
+#define BARRIER_COUNT(st) ((st) & (BARRIER_SENSE - 1))
+
+/** @brief The sense of the phase in barrier_node_t's state, 0 or 1 */
+#define BARRIER_PHASE(st) (((st) & BARRIER_SENSE) ? 1 : 0)
+
+/** @brief The number of children of a tree node */
+#define BARRIER_FANIN 4
+
+/** @brief Tree levels, enough for BARRIER_FANIN ^ 16 threads */
+#define BARRIER_MAX_DEPTH 16
+
+/** @brief Checks of the sense before a waiter parks */
+#define BARRIER_SPIN 64
+
+/** @brief Marks a list of parked threads whose phase is released */
+#define BARRIER_CLOSED ((void *)1)
+
+int barrier_tree_min = BARRIER_TREE_MIN;
+
+/** @brief A thread parked at a node, on its stack */
+typedef struct barrier_waiter {
+    park_t park;
+    struct barrier_waiter *next;
+} barrier_waiter_t;
+
+/** @brief Set up a node for its first phase, whose sense is 0.
+ *
+ *  @param node The node.
+ *  @param cap The arrivals per phase.
+ *  @return Void.
+ */
+static void node_init(barrier_node_t *node, int cap) {
+    node->state = 0;
+    node->cap = cap;
+    node->parent = NULL;
+    node->users = 0;
+    node->parked[0] = NULL;
+    /* as if a phase with sense 1 was just released */
+    node->parked[1] = BARRIER_CLOSED;
+}
+
+/** @brief Count the caller in at a node.
+ *
+ *  @param node The node.
+ *  @param last Set to 1 if the caller completed the phase, else 0.
+ *  @return The sense of the phase the caller joined, -1 if the node
+ *          is full.
+ */
+static int node_arrive(barrier_node_t *node, int *last) {
+    int st;
+
+    do {
+        st = node->state;
+        /* full, its release hasn't reached it yet */
+        if (BARRIER_COUNT(st) >= node->cap) {
+            return -1;
+        }
+    } while (cmpxchg_wrapper(&(node->state), st, st + 1) != st);
+
+    *last = (BARRIER_COUNT(st) + 1 == node->cap);
+    return BARRIER_PHASE(st);
+}
+
+/** @brief Wait until the phase the caller joined at a node is released.
+ *
+ *  @param node The node.
+ *  @param sense The sense of the phase, from node_arrive().
+ *  @return Void.
+ */
+static void node_wait(barrier_node_t *node, int sense) {
+    barrier_waiter_t self;
+    void *top;
+    int spin;
+
+    /* the phase may be about to end */
+    for (spin = 0; spin < BARRIER_SPIN; spin++) {
+        if (BARRIER_PHASE(node->state) != sense) {
+            return;
+        }
+    }
+
+    park_init(&(self.park), get_thr_stk()->ktid);
+    do {
+        top = node->parked[sense];
+        /* released already */
+        if (top == BARRIER_CLOSED) {
+            return;
+        }
+        self.next = top;
+    } while (cmpxchg_wrapper((int *)&(node->parked[sense]), (int)top,
+                             (int)&self) != (int)top);
+
+    park_wait(&(self.park));
+}
+
+/** @brief Release a completed phase at a node.
+ *
+ *  @param node The node.
+ *  @param sense The sense of the phase.
+ *  @return Void.
+ */
+static void node_release(barrier_node_t *node, int sense) {
+    barrier_waiter_t *w, *next;
+
+    /* the next phase parks here, it starts with the flip below */
+    node->parked[!sense] = NULL;
+    xchg_wrapper(&(node->state), sense ? 0 : BARRIER_SENSE);
+
+    w = (barrier_waiter_t *)xchg_wrapper((int *)&(node->parked[sense]),
+                                         (int)BARRIER_CLOSED);
+    while (w != NULL) {
+        /* w is gone once woken up */
+        next = w->next;
+        park_wake(&(w->park));
+        w = next;
+    }
+}
+
+/** @brief Initialize the barrier
+ *
+ *  This should be only called once before calling other
+ *  barrier methods. The barrier could be re-init after it is
+ *  successfully destroyed.
+ *
+ *  @param b Address of barrier.
+ *  @param n The number of threads that meet at the barrier.
+ *  @return 0 on success, -1 on error.
+ */
+int barrier_init(barrier_t *b, int n) {
+    barrier_node_t *nodes;
+    int width, up, lo, next, total, i;
+
+    /* check null pointer */
+    if (!b) {
+        lprintf("Input barrier is null");
+        return -1;
+    }
+    if (n <= 0) {
+        lprintf("Barrier needs at least one thread");
+        return -1;
+    }
+
+    if (n <= barrier_tree_min) {
+        node_init(&(b->central), n);
+        b->leaves = &(b->central);
+        b->nleaves = 1;
+        b->nnodes = 1;
+    }
+    else {
+        /* count the nodes, level by level */
+        width = (n + BARRIER_FANIN - 1) / BARRIER_FANIN;
+        total = width;
+        while (width > 1) {
+            width = (width + BARRIER_FANIN - 1) / BARRIER_FANIN;
+            total += width;
+        }
+        nodes = malloc(total * sizeof(barrier_node_t));
+        if (!nodes) {
+            lprintf("Cannot allocate the barrier tree");
+            return -1;
+        }
+
+        /* the leaves take the threads, the last one the rest */
+        width = (n + BARRIER_FANIN - 1) / BARRIER_FANIN;
+        for (i = 0; i < width; i++) {
+            node_init(&nodes[i], (n - i * BARRIER_FANIN < BARRIER_FANIN) ?
+                                 n - i * BARRIER_FANIN : BARRIER_FANIN);
+        }
+        b->nleaves = width;
+
+        /* each upper node takes the winners of its children */
+        lo = 0;
+        next = width;
+        while (width > 1) {
+            up = (width + BARRIER_FANIN - 1) / BARRIER_FANIN;
+            for (i = 0; i < up; i++) {
+                node_init(&nodes[next + i],
+                          (width - i * BARRIER_FANIN < BARRIER_FANIN) ?
+                          width - i * BARRIER_FANIN : BARRIER_FANIN);
+            }
+            for (i = 0; i < width; i++) {
+                nodes[lo + i].parent = &nodes[next + i / BARRIER_FANIN];
+            }
+            lo = next;
+            next += up;
+            width = up;
+        }
+
+        b->leaves = nodes;
+        b->nnodes = total;
+    }
+
+    b->n = n;
+    b->init = 1;
+
+    return 0;
+}
+
+/** @brief Wait for all the threads to arrive at the barrier.
+ *
+ *  @param b The address of barrier.
+ *  @return 1 in the one thread that completed the phase, else 0.
+ */
+int barrier_wait(barrier_t *b) {
+    barrier_node_t *path[BARRIER_MAX_DEPTH];
+    int senses[BARRIER_MAX_DEPTH];
+    barrier_node_t *leaf, *node;
+    int depth = 0;
+    int sense, last, start, i;
+
+    if (!b) {
+        panic("barrier_wait: The input pointer is null");
+    }
+
+    if (!b->init) {
+        panic("barrier_wait: The barrier hasn't been initialized");
+    }
+
+    /* find a leaf with room, we are one of its users before we arrive */
+    start = thr_getid() % b->nleaves;
+    i = start;
+    for (;;) {
+        leaf = &(b->leaves[i]);
+        xaddn_wrapper(&(leaf->users), 1);
+        if ((sense = node_arrive(leaf, &last)) >= 0) {
+            break;
+        }
+        xaddn_wrapper(&(leaf->users), -1);
+        i = (i + 1) % b->nleaves;
+        /* all full, the release of the last phase is on its way down */
+        if (i == start) {
+            yield(-1);
+        }
+    }
+    node = leaf;
+
+    /* the last one to arrive climbs, until the root or until it isn't
+       the last one */
+    while (last) {
+        path[depth] = node;
+        senses[depth] = sense;
+        depth++;
+        if (node->parent == NULL) {
+            break;
+        }
+        node = node->parent;
+        /* the parent was released before the child we come from */
+        if ((sense = node_arrive(node, &last)) < 0) {
+            panic("barrier_wait: Barrier node is full");
+        }
+    }
+
+    if (!last) {
+        node_wait(node, sense);
+    }
+
+    /* release the nodes we completed, top down */
+    for (i = depth - 1; i >= 0; i--) {
+        node_release(path[i], senses[i]);
+    }
+
+    /* done with the tree */
+    xaddn_wrapper(&(leaf->users), -1);
+
+    return last;
+}
+
+/** @brief Destroy the barrier.
+ *
+ *  Waits for the threads of the last phase that are still on their way
+ *  out of barrier_wait.
+ *
+ *  @note Only after this instruction is done, the barrier
+ *        can be called init again.
+ *
+ *  @param b The address of barrier.
+ *  @return Void.
+ */
+void barrier_destroy(barrier_t *b) {
+    barrier_node_t *node;
+    int st, i;
+
+    if (!b) {
+        panic("barrier_destroy: The input pointer is null");
+    }
+
+    if (!b->init) {
+        panic("barrier_destroy: The barrier hasn't been initialized");
+    }
+
+    for (i = 0; i < b->nnodes; i++) {
+        node = &(b->leaves[i]);
+        for (;;) {
+            st = node->state;
+            if (BARRIER_COUNT(st) > 0 && BARRIER_COUNT(st) < node->cap) {
+                panic("barrier_destroy: Threads are waiting at the barrier");
+            }
+            /* done once no thread uses it, only leaves count them */
+            if (node->users == 0) {
+                break;
+            }
+            yield(-1);
+        }
+    }
+
+    if (b->leaves != &(b->central)) {
+        free(b->leaves);
+    }
+    b->init = 0;
+}
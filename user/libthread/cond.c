@@ -8,21 +8,55 @@
  *  threads. The cond_wait thread will be singled by other thread
  *  through cond_signal.
  *
+ *  A waiter sleeps on the park in its own thr_stk_t. The signaler sets
+ *  the waiter's reject flag and only calls make_runnable() if the waiter
+ *  is already asleep, so signaling never spins, no matter how far the
+ *  waiter got on its way to deschedule().
+ *
+ *  cond_broadcast doesn't wake its waiters up, they would only fight
+ *  for the mutex they have to reacquire. It moves them to the wait queue
+ *  of that mutex instead (wait morphing), and each of them wakes up once
+ *  the lock is handed to it.
+ *
+ *  cond_timedwait arms a timer with the timer service. If the timer fires
+ *  before a signal, it takes the waiter out of the queue itself and wakes
+ *  it up, so all timed waiters together cost one timer thread.
+ *
+ *  Waiters never take a lock to queue up. They push themselves onto the
+ *  incoming stack with a cmpxchg. The threads that take waiters out of
+ *  the cv, the signalers and the timer, serialize on a small guard and
+ *  move the incoming stack over to the FIFO queue as they need it. Both
+ *  are linked through thr_stk_t.cv_next. nwaiters counts the waiters in
+ *  either, so a signal with nobody waiting is a single load.
+ *
  *  @author Zhipeng Zhao (zzhao1)
  *  @bug No known bugs.
  */
 #include <stdio.h>
 #include <mutex.h>
 #include <cond.h>
+#include <cond_ext.h>
 #include <libsimics/simics.h>
 #include <thr_internals.h>
 #include <syscall.h>
 #include <assert.h>
 
 /* Internal helper functions */
-static int empty(cond_t *cv);
+static void guard_lock(cond_t *cv);
+static void guard_unlock(cond_t *cv);
 static void enq(cond_t *cv, thr_stk_t *thr);
-static int deq(cond_t *cv);
+static void drain(cond_t *cv);
+static thr_stk_t *deq(cond_t *cv);
+static int unlink_thr(cond_t *cv, thr_stk_t *thr);
+static void timeout(thr_timer_t *t);
+
+/** @brief A timed waiter, its timer fires timeout() */
+typedef struct cond_timer {
+    thr_timer_t timer;  /* must be first, timeout() casts it back */
+    cond_t *cv;         /* the cv we wait on */
+    thr_stk_t *thr;     /* the waiting thread */
+    int timedout;       /* set by timeout() if it dequeued the waiter */
+} cond_timer_t;
 
 /** @brief cond_init Initialize the condition variable.
  *
@@ -43,21 +77,15 @@ int cond_init(cond_t *cv)
         return -1;
     }
     else{
-        /* Initialize the mutex */
-        if(mutex_init(&(cv->mutex)) < 0){
-            printf("Cond_init: Failed to initialize condition variable"
-                   " mutex! \n");
-            lprintf("Cond_init: Failed to initialize condition variable"
-                   " mutex! \n");
-            return -1;
-        }
-        else{
-            /* Set the init flag, initialize head and tail pointer as
-             * NULL. So the queue is empty. */
-            cv->init = 1;
-            cv->head = NULL;
-            cv->tail = NULL;
-        }
+        /* Set the init flag, initialize head, tail and incoming
+         * pointer as NULL. So the queue is empty. */
+        cv->guard = 0;
+        cv->nwaiters = 0;
+        cv->incoming = NULL;
+        cv->head = NULL;
+        cv->tail = NULL;
+        cv->init = 1;
+        LOCKSTAT(lockstat_register(&(cv->stat), cv, "cond"));
     }
     return 0;
 }
@@ -66,7 +94,7 @@ int cond_init(cond_t *cv)
 /** @brief cond_destroy Destroy the cond variable.
  *
  *  Deassert the init field, so the object become uninitialized/
- *  destroyed. It's illegal to call this function when the CV_Mutex
+ *  destroyed. It's illegal to call this function when the guard
  *  is still locked or threads are still blocked.
  *
  *  @param cv The condition variable object
@@ -83,19 +111,19 @@ void cond_destroy(cond_t *cv)
         panic("Cond_destroy: The condition variable has not been "
               "initialized!");
     }
-    /* The CV_Mutex is locked */
-    else if(mutex_underlocked(&(cv->mutex))){
+    /* The guard is locked */
+    else if(cv->guard){
         panic("Cond_destroy: Some threads are still locked!");
     }
     /* Some threads are still in sleep */
-    else if(cv->head != NULL){
+    else if(cv->nwaiters != 0){
         panic("Cond_destroy: Some threads are still blocked!");
     }
     else{
         /* Clear init, so that the lock/unlock could not be directly
          * used after destroy. */
         cv->init = 0;
-        mutex_destroy(&(cv->mutex));
+        LOCKSTAT(lockstat_unregister(&(cv->stat)));
     }
 }
 
@@ -119,38 +147,93 @@ void cond_wait(cond_t *cv, mutex_t *mp)
     }
     /* We are ready to release the lock and block the thread */
     else {
-        /* Get cv_mutex before changing the cv's queue states */
-        mutex_lock(&(cv->mutex));
-        int reject = 0;
-        /* Enq this calling thread into CV's queue */
-        enq(cv, get_thr_stk());
+        thr_stk_t *thr = get_thr_stk();
+        /* Prepare the park the signaler will wake us up on */
+        park_init(&(thr->cv_node.park), thr->ktid);
+        thr->cv_mp = mp;
+        thr->cv_morphed = 0;
+        /* Enq this calling thread into CV's queue. We still hold the
+         * outside mutex, so a signaler that holds it sees us */
+        enq(cv, thr);
         /* Release the outside mutex, so other thread can acquire this
          * lock.*/
         mutex_unlock(mp);
-        /* Release the cv_mutex, so that other thread can use
-         * cond_signal or cond_broadcast to change cv's queue state */
-        mutex_unlock(&(cv->mutex));
-        /* System call to let the calling thread go to sleep. This
-         * syscall itself is atomic with respect to the make_runnable()*/
-        deschedule(&reject);
+        /* Go to sleep, unless the signaler already came by. We don't
+         * leave before the signaler is done with our park */
+        park_wait(&(thr->cv_node.park));
         /* Reacquire the outside lock, so when we exit, we're in
-         * critical section again */
-        mutex_lock(mp);
+         * critical section again. After a broadcast we already hold
+         * it. */
+        if(thr->cv_morphed){
+            LOCKSTAT(lockstat_acquired(&(mp->stat), 0, 1));
+            LOCKSTAT(lockstat_hold_begin(&(mp->stat)));
+        }
+        else
+            mutex_lock(mp);
     }
 }
 
+/** @brief cond_timedwait Like cond_wait, but give up at a deadline.
+ *
+ *  @param cv The condition variable object
+ *  @param mp The outside mutex
+ *  @param ticks The deadline, in get_ticks() units
+ *  @return 0 if we were signaled, -1 if the deadline came first. The
+ *  outside mutex is held again either way.
+ **/
+int cond_timedwait(cond_t *cv, mutex_t *mp, unsigned int ticks)
+{
+    cond_timer_t ct;
+
+    if(!cv || !mp){
+        panic("Cond_timedwait: The input pointer is NULL");
+    }
+    /* Condition variable is uninitialized/destroyed */
+    else if(!cv->init){
+        panic("Cond_timedwait: The condition variable has not been "
+              "initialized!");
+    }
+
+    thr_stk_t *thr = get_thr_stk();
+    park_init(&(thr->cv_node.park), thr->ktid);
+    thr->cv_mp = mp;
+    thr->cv_morphed = 0;
+    enq(cv, thr);
+    mutex_unlock(mp);
+
+    ct.timer.when = ticks;
+    ct.timer.fire = timeout;
+    ct.timer.arg = NULL;
+    ct.cv = cv;
+    ct.thr = thr;
+    ct.timedout = 0;
+    /* Without a timer thread, time out right away */
+    if(timer_add(&(ct.timer)) < 0)
+        timeout(&(ct.timer));
+
+    park_wait(&(thr->cv_node.park));
+    /* The timer must be done with ct before we return */
+    timer_cancel(&(ct.timer));
+
+    if(thr->cv_morphed){
+        LOCKSTAT(lockstat_acquired(&(mp->stat), 0, 1));
+        LOCKSTAT(lockstat_hold_begin(&(mp->stat)));
+    }
+    else
+        mutex_lock(mp);
+
+    return ct.timedout ? -1 : 0;
+}
+
 /** @brief cond_signal Signal the thread under cond_wait.
  *
  *  This method will only wake up the very first thread in the cv's
  *  queue. If there is no sleeping thread in the queue, we do nothing.
  *
- *  Spin on the waking up process. make_runnable would return 0 only
- *  when ktid exists and thread-ktid is in sleep. Since ktid comes
- *  from the thread queue, we are sure ktid exists, and thread-ktid
- *  is going to sleep. But we are not sure if thread-ktid is already
- *  in sleep or not, because this thread might execute before thread-ktid
- *  really gets into sleep. So we keep trying make_runnable, until
- *  thread-ktid goes to sleep and make_runnable wakes it up successfully
+ *  The dequeued thread might not be asleep yet, because this thread
+ *  might execute before it really gets into sleep. park_wake sets its
+ *  reject flag, so it won't go to sleep at all, and only calls
+ *  make_runnable if it is already asleep.
  *
  *  @param cv The condition variable object
  *  @return Void
@@ -166,32 +249,27 @@ void cond_signal(cond_t *cv)
         panic("Cond_signal: The condition variable has not been "
               "initialized!");
     }
-    else{
-        /* Get cv_mutex before changing the cv's queue states */
-        mutex_lock(&(cv->mutex));
-        int ktid;
-        /* Act only when the cv's queue is not empty */
-        if(!empty(cv)){
-            /* Get the first sleeping thread's id in the queue */
-            ktid = deq(cv);
-            /* Busy waitting on waking up process */
-            while(make_runnable(ktid) < 0)
-                continue;
-        }
-        /* Unlock the cv_mutex so that other threads can change the
+    /* Act only when the cv's queue is not empty */
+    else if(cv->nwaiters > 0){
+        /* Get the guard before changing the cv's queue states */
+        guard_lock(cv);
+        /* Get the first sleeping thread in the queue */
+        thr_stk_t *thr = deq(cv);
+        /* Wake it up, or keep it from going to sleep */
+        if(thr != NULL)
+            park_wake(&(thr->cv_node.park));
+        /* Unlock the guard so that other threads can change the
          * cv's states */
-        mutex_unlock(&(cv->mutex));
+        guard_unlock(cv);
     }
 }
 
 /** @brief cond_broadcast Wake up all the waiting threads
  *
- *  If there is no sleeping thread in the queue, we do nothing. The
- *  threads that are woken up by this method would not go to sleep before
- *  the end of this method, because right now we hold the cv_mutex. The
- *  thread that want to go to sleep again has to acquire the cv_mutex
- *  first. Since we have the cv_mutex now, the thread would not go to
- *  sleep during the execution of waking up.
+ *  If there is no sleeping thread in the queue, we do nothing. Every
+ *  waiter is moved to the queue of the mutex it passed to cond_wait, in
+ *  order, and stays asleep until mutex_unlock hands the lock to it. If
+ *  the mutex is free, the first one is woken up with it right away.
  *
  *  @param cv The condition variable object
  *  @return Void
@@ -206,22 +284,20 @@ void cond_broadcast(cond_t *cv)
         panic("Cond_broadcast: The condition variable has not been "
               "initialized!");
     }
-    else{
-        /* Get cv_mutex before changing the cv's queue states */
-        mutex_lock(&(cv->mutex));
-        int ktid;
-        /* If the cv's queue is not empty, we keep dequeueing */
-        while(!empty(cv)){
-            /* Dequeue the queue to get the thread id of a sleeping
-             * thread. */
-            ktid = deq(cv);
-            /* Busy waitting on waking up process */
-            while(make_runnable(ktid) < 0)
-                continue;
+    /* Act only when the cv's queue is not empty */
+    else if(cv->nwaiters > 0){
+        /* Get the guard before changing the cv's queue states */
+        guard_lock(cv);
+        thr_stk_t *thr;
+        /* Keep dequeueing until the queue is empty */
+        while((thr = deq(cv)) != NULL){
+            /* Let it sleep on until it gets the mutex */
+            thr->cv_morphed = 1;
+            mutex_requeue(thr->cv_mp, &(thr->cv_node));
         }
-        /* Unlock the cv_mutex so that other threads can change the
+        /* Unlock the guard so that other threads can change the
          * cv's states */
-        mutex_unlock(&(cv->mutex));
+        guard_unlock(cv);
     }
 }
 
@@ -229,78 +305,162 @@ void cond_broadcast(cond_t *cv)
 /* Internal helper functions */
 /*****************************/
 
-/** @brief empty Check if cv's queue is empty or not.
+/** @brief guard_lock Acquire the guard of the cv's queue.
+ *
+ *  Only the threads taking waiters out of the queue use the guard. It
+ *  is held for a few instructions and a wakeup, so it is a plain
+ *  test-and-set spin lock. We yield if the holder got descheduled.
  *
  *  @param cv The condition variable object
- *  @return 1 if the queue is empty, 0 if not.
+ *  @return Void
  **/
+static void guard_lock(cond_t *cv){
+    while(xchg_wrapper(&(cv->guard), 1) != 0)
+        yield(-1);
+}
 
-int empty(cond_t *cv){
-    return (cv->head == NULL);
+/** @brief guard_unlock Release the guard of the cv's queue.
+ *
+ *  @param cv The condition variable object
+ *  @return Void
+ **/
+static void guard_unlock(cond_t *cv){
+    cv->guard = 0;
 }
 
 /** @brief enq Put a thread into cv's waiting thread queue.
  *
- *  The queue is implemented using linked list. CV holds the head and
- *  tail pointer of this FIFO queue. When enqueue, we put the new item
- *  in tail. When dequeue, we remove an item from the head. The thr_stk_t
- *  data structure has the "cv_next" pointer, which will point to the
- *  next item(thead) in the queue.
+ *  The thread is pushed onto the incoming stack with a cmpxchg loop,
+ *  without any lock. A thread waits on one cv at a time and the guard
+ *  holder only ever takes the whole stack, so the pointer we compare
+ *  against can't be recycled under us.
  *
  *  @param cv The condition variable object
  *  @param thr The thread object that needs to be stored in queue
  *  @return Void
  **/
-void enq(cond_t *cv, thr_stk_t *thr){
-    /* If the queue is empty initially, we intialize the head and tail
-     * pointer to this very first thread item. */
-    if(empty(cv)){
-        cv->head = thr;
-        cv->tail = thr;
-    }
-    else{
-        /* link current tail thread's cv_next pointer to new thread */
-        ((thr_stk_t*)cv->tail)->cv_next = thr;
-        /* Set the cv_next pointer of this new thread as NULL */
-        thr->cv_next = NULL;
-        /* Move the tail pointer to the new thread */
-        cv->tail = thr;
-    }
+static void enq(cond_t *cv, thr_stk_t *thr){
+    thr_stk_t *top;
+
+    /* Count ourselves first, signalers look at nwaiters only */
+    xadd_wrapper(&(cv->nwaiters));
+    do{
+        top = cv->incoming;
+        thr->cv_next = top;
+    } while(cmpxchg_wrapper((int *)&(cv->incoming), (int)top, (int)thr)
+            != (int)top);
 }
 
+/** @brief drain Move the incoming stack to the end of the FIFO queue.
+ *
+ *  The stack is newest first, so we reverse it on the way. Guard held.
+ *
+ *  @param cv The condition variable object
+ *  @return Void
+ **/
+static void drain(cond_t *cv){
+    thr_stk_t *stack;
+    thr_stk_t *fifo = NULL;
+    thr_stk_t *last;
+
+    if(cv->incoming == NULL)
+        return;
+    stack = (thr_stk_t *)xchg_wrapper((int *)&(cv->incoming), (int)NULL);
+
+    /* The first thread we pop off the stack ends up last */
+    last = stack;
+    while(stack != NULL){
+        thr_stk_t *next = stack->cv_next;
+        stack->cv_next = fifo;
+        fifo = stack;
+        stack = next;
+    }
+
+    if(cv->head == NULL)
+        cv->head = fifo;
+    else
+        ((thr_stk_t *)cv->tail)->cv_next = fifo;
+    cv->tail = last;
+}
 
 /** @brief deq Remove a thread from cv's waiting thread queue.
  *
  *  We remove a thread from the head of the queue. If this is the last
- *  thread item, we set the head and tail pointers as NULL.
+ *  thread item, we set the head and tail pointers as NULL. Guard held.
  *
  *  @param cv The condition variable object
- *  @return thread id of the first thread item in the queue on success,
- *  otherwise return -1.
+ *  @return the first thread item in the queue, NULL if there is none.
  **/
-int deq(cond_t *cv){
+static thr_stk_t *deq(cond_t *cv){
     thr_stk_t *thr;
-    /* No element in queue. This should not happen, since the caller
-     * is responsible to check if the queue is empty or not before even
-     * call this method. */
-    if(empty(cv)){
-        panic("Cond_variable: dequeue an empty queue!");
-        return -1;
-    }
-    else{
-        /* Return the thread item pointed by head pointer */
-        thr = cv->head;
-        /* This is the last element, clear head and tail pointers */
-        if(cv->head == cv->tail){
-            cv->head = NULL;
-            cv->tail = NULL;
-        }
-        else{
-            /* Move head pointer forward */
-            cv->head = (void*)(((thr_stk_t*)cv->head)->cv_next);
-        }
+
+    if(cv->head == NULL)
+        drain(cv);
+    /* A waiter may have counted itself in nwaiters but not be
+     * pushed yet, then there is nobody for us */
+    thr = cv->head;
+    if(thr == NULL)
+        return NULL;
+
+    /* Move head pointer forward, clear tail after the last one */
+    cv->head = thr->cv_next;
+    if(cv->head == NULL)
+        cv->tail = NULL;
+    cv->nwaiters--;
+    /* Every wait sleeps, count it while the guard protects stat */
+    LOCKSTAT(lockstat_acquired(&(cv->stat), 0, 1));
+
+    return thr;
+}
+
+/** @brief unlink_thr Remove a given thread from cv's queue.
+ *
+ *  The thread may still be on the incoming stack, so drain it first.
+ *  Guard held.
+ *
+ *  @param cv The condition variable object
+ *  @param thr The thread to remove
+ *  @return 1 if the thread was in the queue, 0 if not.
+ **/
+static int unlink_thr(cond_t *cv, thr_stk_t *thr){
+    thr_stk_t *prev = NULL;
+    thr_stk_t *cur;
+
+    drain(cv);
+    for(cur = cv->head; cur != NULL; prev = cur, cur = cur->cv_next){
+        if(cur != thr)
+            continue;
+        if(prev == NULL)
+            cv->head = cur->cv_next;
+        else
+            prev->cv_next = cur->cv_next;
+        /* Removing the tail, move the tail pointer back */
+        if(cv->tail == cur)
+            cv->tail = prev;
+        cv->nwaiters--;
+        LOCKSTAT(lockstat_acquired(&(cv->stat), 0, 1));
+        return 1;
     }
-    /* We only return the ktid field of this thread. */
-    return thr->ktid;
+    return 0;
 }
 
+/** @brief timeout Wake up a timed waiter whose deadline has come.
+ *
+ *  Runs on the timer thread. If the waiter is still in the queue, we
+ *  take it out and wake it up, so no signal can get to it anymore. If it
+ *  is gone already, a signal came first and we do nothing.
+ *
+ *  @param t The timer of a cond_timer_t
+ *  @return Void
+ **/
+static void timeout(thr_timer_t *t){
+    cond_timer_t *ct = (cond_timer_t *)t;
+    cond_t *cv = ct->cv;
+
+    guard_lock(cv);
+    if(unlink_thr(cv, ct->thr)){
+        ct->timedout = 1;
+        park_wake(&(ct->thr->cv_node.park));
+    }
+    guard_unlock(cv);
+}
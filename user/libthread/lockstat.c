@@ -0,0 +1,213 @@
+/** @file lockstat.c
+ *  @brief Per-lock contention statistics.
+ *
+ *  Every lock initialized while libthread is built with THR_LOCKSTATS
+ *  puts its lockstat_t on a list of live locks, and takes it off again
+ *  when it is destroyed. The counters themselves are only written by
+ *  threads that hold the lock, or its internal mutex, so they need no
+ *  atomics. The list is guarded by a spin lock, not a mutex, because
+ *  mutexes register themselves on it.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug Counters of destroyed locks are gone.
+ */
+
+#include <lockstat.h>
+
+#ifdef THR_LOCKSTATS
+
+#include <stdio.h>
+#include <stddef.h>
+#include <simics.h> /* lprintf() */
+#include <syscall.h>
+#include <thr_internals.h>
+
+/** @brief The most locks thr_lockstats_dump() prints */
+#define LOCKSTATS_TOP_MAX 64
+
+/** @brief All live locks */
+static lockstat_t *lockstats_head = NULL;
+
+/** @brief Spin lock guarding lockstats_head and the links of the list */
+static int lockstats_guard = 0;
+
+/** @brief Acquire the list guard.
+ *  @return Void.
+ */
+static void lockstats_lock(void) {
+    while (xchg_wrapper(&lockstats_guard, 1) != 0) {
+        yield(-1);
+    }
+}
+
+/** @brief Release the list guard.
+ *  @return Void.
+ */
+static void lockstats_unlock(void) {
+    lockstats_guard = 0;
+}
+
+/** @brief Clear the counters of a lock and put it on the list.
+ *
+ *  @param ls The record embedded in the lock.
+ *  @param lock The lock.
+ *  @param kind The kind of lock, printed by the dump.
+ *  @return Void.
+ */
+void lockstat_register(lockstat_t *ls, void *lock, const char *kind) {
+    ls->lock = lock;
+    ls->kind = kind;
+    ls->name = NULL;
+    ls->acquired = 0;
+    ls->contended = 0;
+    ls->spins = 0;
+    ls->parks = 0;
+    ls->hold_start = 0;
+    ls->hold_total = 0;
+    ls->hold_max = 0;
+
+    lockstats_lock();
+    ls->prev = NULL;
+    ls->next = lockstats_head;
+    if (lockstats_head != NULL) {
+        lockstats_head->prev = ls;
+    }
+    lockstats_head = ls;
+    lockstats_unlock();
+}
+
+/** @brief Take a destroyed lock off the list.
+ *
+ *  @param ls The record embedded in the lock.
+ *  @return Void.
+ */
+void lockstat_unregister(lockstat_t *ls) {
+    lockstats_lock();
+    if (ls->prev != NULL) {
+        ls->prev->next = ls->next;
+    } else {
+        lockstats_head = ls->next;
+    }
+    if (ls->next != NULL) {
+        ls->next->prev = ls->prev;
+    }
+    lockstats_unlock();
+}
+
+/** @brief Count an acquisition.
+ *
+ *  @param ls The record embedded in the lock.
+ *  @param spins Busy-wait iterations before we got the lock.
+ *  @param parks Times we went to sleep before we got the lock.
+ *  @return Void.
+ */
+void lockstat_acquired(lockstat_t *ls, int spins, int parks) {
+    ls->acquired++;
+    if (spins > 0 || parks > 0) {
+        ls->contended++;
+    }
+    ls->spins += spins;
+    ls->parks += parks;
+}
+
+/** @brief The lock is held from now on.
+ *
+ *  @param ls The record embedded in the lock.
+ *  @return Void.
+ */
+void lockstat_hold_begin(lockstat_t *ls) {
+    ls->hold_start = get_ticks();
+}
+
+/** @brief The lock is about to be released.
+ *
+ *  @param ls The record embedded in the lock.
+ *  @return Void.
+ */
+void lockstat_hold_end(lockstat_t *ls) {
+    unsigned int held = get_ticks() - ls->hold_start;
+
+    ls->hold_total += held;
+    if (held > ls->hold_max) {
+        ls->hold_max = held;
+    }
+}
+
+/** @brief Give a lock a name to show in the dump.
+ *
+ *  @param lock Any initialized lock.
+ *  @param name The name, must stay valid as long as the lock lives.
+ *  @return 0 on success, -1 if lock is not initialized.
+ */
+int thr_lockstats_name(void *lock, const char *name) {
+    lockstat_t *ls;
+    int ret = -1;
+
+    lockstats_lock();
+    for (ls = lockstats_head; ls != NULL; ls = ls->next) {
+        if (ls->lock == lock) {
+            ls->name = name;
+            ret = 0;
+            break;
+        }
+    }
+    lockstats_unlock();
+
+    return ret;
+}
+
+/** @brief Print the n most contended live locks.
+ *
+ *  Nothing here takes a mutex, so it is safe to call from anywhere,
+ *  but the counters of busy locks may be a little off.
+ *
+ *  @param n The number of locks to print, at most LOCKSTATS_TOP_MAX.
+ *  @return Void.
+ */
+void thr_lockstats_dump(int n) {
+    lockstat_t *top[LOCKSTATS_TOP_MAX];
+    lockstat_t *ls;
+    int ntop, i;
+
+    if (n > LOCKSTATS_TOP_MAX) {
+        n = LOCKSTATS_TOP_MAX;
+    }
+
+    /* insertion sort into top, most contended first */
+    lockstats_lock();
+    ntop = 0;
+    for (ls = lockstats_head; ls != NULL; ls = ls->next) {
+        for (i = ntop; i > 0 && top[i - 1]->contended < ls->contended; i--) {
+            if (i < n) {
+                top[i] = top[i - 1];
+            }
+        }
+        if (i < n) {
+            top[i] = ls;
+            if (ntop < n) {
+                ntop++;
+            }
+        }
+    }
+
+    printf("%-16s %-6s %10s %10s %10s %8s %10s %8s\n", "lock", "kind",
+           "acquired", "contended", "spins", "parks", "hold", "max");
+    for (i = 0; i < ntop; i++) {
+        ls = top[i];
+        if (ls->name != NULL) {
+            printf("%-16s ", ls->name);
+        } else {
+            printf("%-16p ", ls->lock);
+        }
+        printf("%-6s %10u %10u %10u %8u %10u %8u\n", ls->kind, ls->acquired,
+               ls->contended, ls->spins, ls->parks, ls->hold_total,
+               ls->hold_max);
+        lprintf("lockstat %p %s: acq %u cont %u spins %u parks %u "
+                "hold %u max %u", ls->lock, ls->kind, ls->acquired,
+                ls->contended, ls->spins, ls->parks, ls->hold_total,
+                ls->hold_max);
+    }
+    lockstats_unlock();
+}
+
+#endif /* THR_LOCKSTATS */
@@ -5,7 +5,24 @@
  *  a global mutex that initialized at thr_init() and lock the
  *  malloc methods. Since, malloc touches Heap which is shared
  *  by all the threads, we just lock these methods, so that at
- *  one time only one thread can manipulate on Heap. 
+ *  one time only one thread can manipulate on Heap.
+ *
+ *  Small blocks are cached per thread so most of them don't take the
+ *  lock at all. Each thread keeps a free list per size class in its
+ *  thr_stk. It refills an empty list with MALLOC_BATCH blocks from the
+ *  heap under one lock, and gives MALLOC_BATCH blocks back under one lock
+ *  when a list reaches MALLOC_CACHE_MAX.
+ *
+ *  A cached block is an ordinary heap block, not owned by any thread,
+ *  so a block freed by another thread than the one that allocated it
+ *  just goes to the freeing thread's list. A thread that makes blocks
+ *  for others to free refills from the heap, and the threads that free
+ *  them give them back, so no list grows without bound.
+ *
+ *  The classes are the payloads of the 16, 32, ... 256 byte heap blocks,
+ *  so a class block is exactly what _malloc() makes of its class size,
+ *  and free() tells the class of a block from _malloc_usable_size().
+ *  Blocks whose usable size isn't a class size go straight to the heap.
  *
  *  @author Zhipeng Zhao (zzhao1)
  *  @bug No known bugs.
@@ -14,9 +31,132 @@
 #include <stdlib.h>
 #include <types.h>
 #include <stddef.h>
+#include <string.h>
+#include <malloc.h>
 #include <mutex.h>
 #include <thr_internals.h>
 
+/** @brief The smallest heap block, each class doubles it */
+#define MALLOC_MIN_BLOCK 16
+
+/** @brief The header _malloc() puts in front of a heap block */
+#define MALLOC_HDR 8
+
+/** @brief Class of the blocks too big to be cached */
+#define MALLOC_BIG (-1)
+
+/** @brief Blocks moved between a thread and the heap at once */
+#define MALLOC_BATCH 16
+
+/** @brief A thread gives blocks back once it caches this many per class */
+#define MALLOC_CACHE_MAX (4 * MALLOC_BATCH)
+
+/** @brief The size of a class, the payload of its heap block */
+#define CLASS_SIZE(cls) ((MALLOC_MIN_BLOCK << (cls)) - MALLOC_HDR)
+
+/** @brief Get the class that serves a size.
+ *
+ *  @param size The request size in bytes.
+ *  @return The class, or MALLOC_BIG if it is not cached.
+ */
+static int size_class(size_t size)
+{
+    int cls = 0;
+
+    while (cls < MALLOC_NCLASSES && CLASS_SIZE(cls) < size)
+        cls++;
+    return (cls < MALLOC_NCLASSES) ? cls : MALLOC_BIG;
+}
+
+/** @brief Get the class a block belongs to.
+ *
+ *  @param buf The block.
+ *  @return The class, or MALLOC_BIG if its size isn't a class size.
+ */
+static int block_class(void *buf)
+{
+    size_t size = _malloc_usable_size(buf);
+    int cls = size_class(size);
+
+    return (cls != MALLOC_BIG && CLASS_SIZE(cls) == size) ? cls : MALLOC_BIG;
+}
+
+/** @brief Allocate a block off the cache.
+ *
+ *  @param size The request size in bytes.
+ *  @return The block, or NULL.
+ */
+static void *big_alloc(size_t size)
+{
+    void *buf;
+
+    mutex_lock(&malloc_mp);
+    buf = _malloc(size);
+    mutex_unlock(&malloc_mp);
+    return buf;
+}
+
+/** @brief Fill an empty class list from the heap.
+ *
+ *  @param thr_stk The caller's thr_stk.
+ *  @param cls The class.
+ *  @return Void. The list is still empty if the heap is full.
+ */
+static void cache_refill(thr_stk_t *thr_stk, int cls)
+{
+    void *buf;
+    int i;
+
+    mutex_lock(&malloc_mp);
+    for (i = 0; i < MALLOC_BATCH; i++) {
+        buf = _malloc(CLASS_SIZE(cls));
+        if (!buf)
+            break;
+        /* link through the payload */
+        *(void **)buf = thr_stk->mcache[cls];
+        thr_stk->mcache[cls] = buf;
+        thr_stk->mcache_len[cls]++;
+    }
+    mutex_unlock(&malloc_mp);
+}
+
+/** @brief Give up to n blocks of a class list back to the heap.
+ *
+ *  @param thr_stk The caller's thr_stk.
+ *  @param cls The class.
+ *  @param n The number of blocks.
+ *  @return Void.
+ */
+static void cache_drain(thr_stk_t *thr_stk, int cls, int n)
+{
+    void *buf;
+
+    mutex_lock(&malloc_mp);
+    while (n-- > 0 && (buf = thr_stk->mcache[cls]) != NULL) {
+        thr_stk->mcache[cls] = *(void **)buf;
+        thr_stk->mcache_len[cls]--;
+        _free(buf);
+    }
+    mutex_unlock(&malloc_mp);
+}
+
+/** @brief Give all the blocks a thread caches back, and stop caching.
+ *
+ *  Called by an exiting thread. Whatever it frees from now on goes
+ *  straight to the heap, its cache would be lost with its stack.
+ *
+ *  @param thr_stk The caller's thr_stk.
+ *  @return Void.
+ */
+void malloc_cache_flush(thr_stk_t *thr_stk)
+{
+    int cls;
+
+    thr_stk->mcache_off = 1;
+    for (cls = 0; cls < MALLOC_NCLASSES; cls++)
+        cache_drain(thr_stk, cls, thr_stk->mcache_len[cls]);
+}
+
 /** @brief Malloc wrapper.
  *
  *  @param __size The request memory size in bytes.
@@ -24,10 +164,28 @@
  **/
 void *malloc(size_t __size)
 {
-    mutex_lock(&malloc_mp);
-    void *ret = _malloc(__size);
-    mutex_unlock(&malloc_mp);
-    return ret;
+    thr_stk_t *thr_stk = get_thr_stk();
+    void *buf;
+    int cls;
+
+    /* like _malloc */
+    if (__size == 0)
+        return NULL;
+
+    cls = size_class(__size);
+    if (cls == MALLOC_BIG || thr_stk->mcache_off)
+        return big_alloc(__size);
+
+    if (!thr_stk->mcache[cls]) {
+        cache_refill(thr_stk, cls);
+        if (!thr_stk->mcache[cls])
+            return NULL;
+    }
+
+    buf = thr_stk->mcache[cls];
+    thr_stk->mcache[cls] = *(void **)buf;
+    thr_stk->mcache_len[cls]--;
+    return buf;
 }
 
 /** @brief Calloc wrapper.
@@ -38,9 +196,16 @@ void *malloc(size_t __size)
  **/
 void *calloc(size_t __nelt, size_t __eltsize)
 {
-    mutex_lock(&malloc_mp);
-    void *ret = _calloc(__nelt, __eltsize);
-    mutex_unlock(&malloc_mp);
+    size_t size = __nelt * __eltsize;
+    void *ret;
+
+    /* Multiplication overflowed */
+    if (__nelt != 0 && size / __nelt != __eltsize)
+        return NULL;
+
+    ret = malloc(size);
+    if (ret)
+        memset(ret, 0, size);
     return ret;
 }
 
@@ -53,9 +218,34 @@ void *calloc(size_t __nelt, size_t __eltsize)
  **/
 void *realloc(void *__buf, size_t __new_size)
 {
-    mutex_lock(&malloc_mp);
-    void *ret = _realloc(__buf, __new_size);
-    mutex_unlock(&malloc_mp);
+    size_t copysize;
+    void *ret;
+    int cls;
+
+    if (__buf == NULL)
+        return malloc(__new_size);
+
+    if (__new_size == 0) {
+        free(__buf);
+        return NULL;
+    }
+
+    cls = block_class(__buf);
+
+    /* still fits in its class */
+    if (cls != MALLOC_BIG && __new_size <= CLASS_SIZE(cls))
+        return __buf;
+
+    ret = malloc(__new_size);
+    /* If malloc fails, the original block is left untouched */
+    if (!ret)
+        return NULL;
+
+    copysize = _malloc_usable_size(__buf);
+    if (__new_size < copysize)
+        copysize = __new_size;
+    memcpy(ret, __buf, copysize);
+    free(__buf);
     return ret;
 }
 
@@ -67,7 +257,24 @@ void *realloc(void *__buf, size_t __new_size)
  **/
 void free(void *__buf)
 {
-    mutex_lock(&malloc_mp);
-    _free(__buf);
-    mutex_unlock(&malloc_mp);
+    thr_stk_t *thr_stk;
+    int cls;
+
+    if (__buf == NULL)
+        return;
+
+    cls = block_class(__buf);
+    thr_stk = get_thr_stk();
+
+    if (cls == MALLOC_BIG || thr_stk->mcache_off) {
+        mutex_lock(&malloc_mp);
+        _free(__buf);
+        mutex_unlock(&malloc_mp);
+        return;
+    }
+
+    *(void **)__buf = thr_stk->mcache[cls];
+    thr_stk->mcache[cls] = __buf;
+    if (++thr_stk->mcache_len[cls] >= MALLOC_CACHE_MAX)
+        cache_drain(thr_stk, cls, MALLOC_BATCH);
 }
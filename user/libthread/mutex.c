@@ -5,12 +5,14 @@
  *  simultaneous execution of critical section by multiple threads.
  *  If a thread acquires a mutex, it can safely modify some global
  *  information in the critical section. The other threads that try
- *  to acquire the mutex will do busy waiting. We assume the running
+ *  to acquire the mutex will first do busy waiting. We assume the running
  *  environment will be multi-processor. In that case, it's ok to 
- *  let one processor spin, because the critical section is usually
- *  short, the thread that spinning would acquire the lock in a short
- *  period. The may save time to do the context-switch which could
- *  be expensive.  
+ *  let one processor spin for a while, because the critical section is
+ *  usually short, the thread that spinning would acquire the lock in a
+ *  short period. The may save time to do the context-switch which could
+ *  be expensive. But if the holder is descheduled, spinning just burns
+ *  the waiter's timeslice, so after mutex_spin_limit spins the waiter
+ *  parks itself and goes to sleep.
  *
  *  The mutex is implemented using atomic instruction XADD. This
  *  is a ticket-lock. Each thread that tries to aquire the lock would
@@ -22,17 +24,51 @@
  *  the threads that try to acquire the lock can eventually get the
  *  lock.  
  *
+ *  Parked waiters sit in a per-mutex queue sorted by ticket, so the head
+ *  of the queue is always the next ticket to be served. mutex_unlock
+ *  advances the turn, which hands the lock to the next ticket, and if
+ *  that ticket is parked it wakes exactly that thread up. Parking never
+ *  changes the ticket order.
+ *
+ *  A thread in mutex_lock_until parks the same way, with a timer armed
+ *  for its deadline. If the timer fires first, it gives up the ticket
+ *  for the thread. Since the ticket order can't skip a ticket by itself,
+ *  the timer swaps the thread's node in the queue for an abandoned node
+ *  the thread allocated before taking the ticket, and the unlocker that
+ *  hands the lock to that ticket passes it right on to the next one.
+ *
  *  @author Zhipeng Zhao (zzhao1)
  *  @bug If the number of mutex_lock() calls exceeds the TMAX, the
  *  behavior is undefined. 
  */
 #include <assert.h>
 #include <stdio.h>
+#include <malloc.h>
 #include <mutex.h>
+#include <mutex_ext.h>
 #include <libsimics/simics.h>
 #include <thr_internals.h>
 #include <syscall.h>
 
+/** @brief The number of spins before a contended mutex_lock() parks */
+int mutex_spin_limit = MUTEX_SPIN_LIMIT;
+
+/** @brief A waiter in mutex_lock_until, its timer fires timeout() */
+typedef struct mutex_timer {
+    thr_timer_t timer;  /* must be first, timeout() casts it back */
+    mutex_t *mp;        /* the mutex we wait on */
+    mutex_node_t *node; /* our node in the wait queue */
+    mutex_node_t *spare; /* left in the queue for our ticket if we give
+                            up, NULL once it is handed over */
+    int timedout;       /* set by timeout() if it gave up our ticket */
+} mutex_timer_t;
+
+/* Internal helper functions */
+static void guard_lock(mutex_t *mp);
+static void guard_unlock(mutex_t *mp);
+static int park_ticket(mutex_t *mp, int myturn, mutex_timer_t *mt);
+static void wake_ticket(mutex_t *mp, int turn);
+static void timeout(thr_timer_t *t);
 
 /** @brief mutex_init Initialize the mutex object.
  *  
@@ -58,7 +94,11 @@ int mutex_init(mutex_t *mp)
     else{            
         mp->ticket = 0;
         mp->turn = 0;
+        mp->guard = 0;
+        mp->nparked = 0;
+        mp->waitq = NULL;
         mp->init = 1;
+        LOCKSTAT(lockstat_register(&(mp->stat), mp, "mutex"));
     }
     return 0;
 }
@@ -91,6 +131,9 @@ void mutex_destroy(mutex_t *mp)
         mp->init = 0;
         mp->ticket = 0;
         mp->turn = 0;
+        mp->nparked = 0;
+        mp->waitq = NULL;
+        LOCKSTAT(lockstat_unregister(&(mp->stat)));
     }
 }
 
@@ -98,7 +141,8 @@ void mutex_destroy(mutex_t *mp)
  * 
  *  If a thread calls this function and returned, that means that thread
  *  gets the lock. Otherwise, that thread will be blocked util it gets
- *  the lock. 
+ *  the lock. The thread spins for at most mutex_spin_limit rounds, then
+ *  it parks until mutex_unlock hands the lock to its ticket.
  *  
  *  @param mp The mutex object
  *  @return Void
@@ -117,10 +161,19 @@ void mutex_lock(mutex_t *mp)
         /* Get current ticket value and atomically increase the
          * ticket value. */
         int myturn = xadd_wrapper(&(mp->ticket));
+        int spin;
         /* Wait until the ticket value in my hand matches the 
          * global turn */
-        while(mp->turn != myturn)
-            continue;
+        for(spin = 0; spin < mutex_spin_limit; spin++){
+            if(mp->turn == myturn)
+                break;
+        }
+        /* The holder is taking long, go to sleep instead */
+        if(spin == mutex_spin_limit)
+            park_ticket(mp, myturn, NULL);
+        LOCKSTAT(lockstat_acquired(&(mp->stat), spin,
+                                   spin == mutex_spin_limit));
+        LOCKSTAT(lockstat_hold_begin(&(mp->stat)));
     }
 }
 
@@ -142,12 +195,134 @@ void mutex_unlock(mutex_t *mp)
         panic("Mutex_unlock: The mutex has not been initialized!");
     }
     else{
+        LOCKSTAT(lockstat_hold_end(&(mp->stat)));
         /* increase the turn value, so the next thread could acquire
-         * the lock */
-        mp->turn = mp->turn + 1;
+         * the lock. The locked XADD also orders the write of turn
+         * before the read of nparked. */
+        int turn = xadd_wrapper(&(mp->turn)) + 1;
+        /* The next ticket might be asleep */
+        if(mp->nparked > 0)
+            wake_ticket(mp, turn);
     }
 }
 
+/** @brief mutex_trylock Acquire the lock only if it is free.
+ *
+ *  The lock is free when the next ticket is the current turn. We take
+ *  that ticket only if nobody took it in the meantime, so we never wait
+ *  and never leave a ticket behind.
+ *
+ *  @param mp The mutex object
+ *  @return 0 if we got the lock, -1 if it was held
+ **/
+int mutex_trylock(mutex_t *mp)
+{
+    if(!mp){
+        panic("Mutex_trylock: The input pointer is NULL");
+    }
+    /* Mutex is uninitialized/destroyed */
+    else if(!mp->init){
+        panic("Mutex_trylock: The mutex has not been initialized!");
+    }
+    int turn = mp->turn;
+    if(mp->ticket != turn)
+        return -1;
+    if(cmpxchg_wrapper(&(mp->ticket), turn, turn + 1) != turn)
+        return -1;
+    LOCKSTAT(lockstat_acquired(&(mp->stat), 0, 0));
+    LOCKSTAT(lockstat_hold_begin(&(mp->stat)));
+    return 0;
+}
+
+/** @brief mutex_lock_until Acquire the lock, or give up at a deadline.
+ *
+ *  Like mutex_lock, but the thread parks with a timer armed for the
+ *  deadline, and timeout() gives the ticket up if the timer fires
+ *  before the lock comes our way. The abandoned node it leaves behind is
+ *  allocated before we take a ticket, so giving up never waits.
+ *
+ *  @param mp The mutex object
+ *  @param ticks The deadline, in get_ticks() units
+ *  @return 0 if we got the lock, -1 if the deadline passed first, or if
+ *  the lock was held and there was no memory to wait for it
+ **/
+int mutex_lock_until(mutex_t *mp, unsigned int ticks)
+{
+    mutex_timer_t mt;
+    int myturn, spin;
+
+    if(!mp){
+        panic("Mutex_lock_until: The input pointer is NULL");
+    }
+    /* Mutex is uninitialized/destroyed */
+    else if(!mp->init){
+        panic("Mutex_lock_until: The mutex has not been initialized!");
+    }
+    /* Don't allocate if the lock is free */
+    if(mutex_trylock(mp) == 0)
+        return 0;
+    mt.spare = malloc(sizeof(mutex_node_t));
+    if(mt.spare == NULL)
+        return -1;
+
+    myturn = xadd_wrapper(&(mp->ticket));
+    /* Spin first, like mutex_lock */
+    for(spin = 0; spin < mutex_spin_limit; spin++){
+        if(mp->turn == myturn)
+            break;
+    }
+    if(spin == mutex_spin_limit){
+        mt.timer.when = ticks;
+        /* The unlocker frees the spare node */
+        if(park_ticket(mp, myturn, &mt) < 0)
+            return -1;
+    }
+    free(mt.spare);
+    LOCKSTAT(lockstat_acquired(&(mp->stat), spin,
+                               spin == mutex_spin_limit));
+    LOCKSTAT(lockstat_hold_begin(&(mp->stat)));
+    return 0;
+}
+
+/** @brief mutex_requeue Make a sleeping thread wait for the mutex.
+ *
+ *  This is how cond_broadcast hands its waiters to the mutex instead of
+ *  waking them all up at once. We take a ticket on behalf of the thread
+ *  and queue its node, as if it had parked in mutex_lock, so unlockers
+ *  wake the threads up one at a time, each holding the lock.
+ *
+ *  @param mp The mutex object
+ *  @param node The node of a thread sleeping on node->park
+ *  @return Void
+ **/
+void mutex_requeue(mutex_t *mp, mutex_node_t *node)
+{
+    mutex_node_t **pp;
+    int myturn = xadd_wrapper(&(mp->ticket));
+
+    node->ticket = myturn;
+    node->abandoned = 0;
+
+    guard_lock(mp);
+    /* Keep the queue sorted by ticket */
+    pp = (mutex_node_t **)&(mp->waitq);
+    while(*pp != NULL && (*pp)->ticket < myturn)
+        pp = &((*pp)->next);
+    node->next = *pp;
+    *pp = node;
+    xadd_wrapper(&(mp->nparked));
+
+    /* The lock is free already, the thread gets it right away */
+    if(mp->turn == myturn){
+        *pp = node->next;
+        mp->nparked--;
+        guard_unlock(mp);
+        park_wake(&(node->park));
+        return;
+    }
+    guard_unlock(mp);
+}
+
 /** @brief Check if the mutex is still locked or not
  * 
  *  
@@ -159,4 +334,178 @@ int mutex_underlocked(mutex_t *mp)
     return (mp->turn != mp->ticket);
 }
 
+/*****************************/
+/* Internal helper functions */
+/*****************************/
 
+/** @brief guard_lock Acquire the wait queue guard of the mutex.
+ *
+ *  The guard is only held for a few instructions, so it is a plain
+ *  test-and-set spin lock. We yield if the holder got descheduled.
+ *
+ *  @param mp The mutex object
+ *  @return Void
+ **/
+static void guard_lock(mutex_t *mp)
+{
+    while(xchg_wrapper(&(mp->guard), 1) != 0)
+        yield(-1);
+}
+
+/** @brief guard_unlock Release the wait queue guard of the mutex.
+ *
+ *  @param mp The mutex object
+ *  @return Void
+ **/
+static void guard_unlock(mutex_t *mp)
+{
+    mp->guard = 0;
+}
+
+/** @brief park_ticket Sleep until the turn reaches our ticket.
+ *
+ *  Insert this thread into the wait queue in ticket order, then check
+ *  the turn once more. Announcing ourselves in nparked and reading the
+ *  turn are ordered by the locked XADD, and mutex_unlock writes the turn
+ *  before reading nparked, so either the unlocker sees us parked or we
+ *  see the new turn.
+ *
+ *  With a timer, the thread is also woken up by timeout() at the
+ *  deadline, which then takes the node out of the queue.
+ *
+ *  @param mp The mutex object
+ *  @param myturn The ticket held by the calling thread
+ *  @param mt The timer with its deadline and spare node set, or NULL
+ *  @return 0 if we got the lock, -1 if timeout() gave our ticket up
+ **/
+static int park_ticket(mutex_t *mp, int myturn, mutex_timer_t *mt)
+{
+    mutex_node_t node;
+    mutex_node_t **pp;
+
+    node.ticket = myturn;
+    node.abandoned = 0;
+    park_init(&(node.park), gettid());
+
+    guard_lock(mp);
+    /* Keep the queue sorted by ticket */
+    pp = (mutex_node_t **)&(mp->waitq);
+    while(*pp != NULL && (*pp)->ticket < myturn)
+        pp = &((*pp)->next);
+    node.next = *pp;
+    *pp = &node;
+    xadd_wrapper(&(mp->nparked));
+
+    /* The lock was handed to us while we were queueing */
+    if(mp->turn == myturn){
+        *pp = node.next;
+        mp->nparked--;
+        guard_unlock(mp);
+        return 0;
+    }
+    guard_unlock(mp);
+
+    if(mt == NULL){
+        /* mutex_unlock dequeues us before waking us up */
+        park_wait(&(node.park));
+        return 0;
+    }
+
+    mt->timer.fire = timeout;
+    mt->timer.arg = NULL;
+    mt->mp = mp;
+    mt->node = &node;
+    mt->timedout = 0;
+    /* Without a timer thread, time out right away */
+    if(timer_add(&(mt->timer)) < 0)
+        timeout(&(mt->timer));
+
+    /* Either mutex_unlock or timeout() dequeues us */
+    park_wait(&(node.park));
+    /* The timer must be done with mt and node before we return */
+    timer_cancel(&(mt->timer));
+
+    return mt->timedout ? -1 : 0;
+}
+
+/** @brief wake_ticket Wake up the parked owner of a ticket, if any.
+ *
+ *  The queue is sorted, and no parked ticket is behind the turn, so
+ *  only the head can own the turn. If the owner is not parked it is
+ *  still spinning and will see the turn by itself. If the owner gave
+ *  up, we hand the lock on to the next turn, as many times as needed.
+ *
+ *  @param mp The mutex object
+ *  @param turn The turn that was just handed out
+ *  @return Void
+ **/
+static void wake_ticket(mutex_t *mp, int turn)
+{
+    mutex_node_t *node;
+    mutex_node_t *dead = NULL;
+
+    guard_lock(mp);
+    node = mp->waitq;
+    /* Nobody is behind an abandoned ticket, pass the lock on */
+    while(node != NULL && node->ticket == turn && node->abandoned){
+        mp->waitq = node->next;
+        mp->nparked--;
+        node->next = dead;
+        dead = node;
+        turn = xadd_wrapper(&(mp->turn)) + 1;
+        node = mp->waitq;
+    }
+    if(node != NULL && node->ticket == turn){
+        mp->waitq = node->next;
+        mp->nparked--;
+    }
+    else{
+        node = NULL;
+    }
+    guard_unlock(mp);
+
+    /* Free the abandoned nodes outside of the guard */
+    while(dead != NULL){
+        mutex_node_t *next = dead->next;
+        free(dead);
+        dead = next;
+    }
+
+    /* The waiter stays in park_wait until we are done with its node */
+    if(node != NULL)
+        park_wake(&(node->park));
+}
+
+/** @brief timeout Give up the ticket of a timed waiter.
+ *
+ *  Runs on the timer thread. If the waiter is still in the queue, the
+ *  lock hasn't been handed to it, so we put its spare node in its place
+ *  as an abandoned node and wake it up. If it is gone already, the lock
+ *  came first and we do nothing.
+ *
+ *  @param t The timer of a mutex_timer_t
+ *  @return Void
+ **/
+static void timeout(thr_timer_t *t)
+{
+    mutex_timer_t *mt = (mutex_timer_t *)t;
+    mutex_t *mp = mt->mp;
+    mutex_node_t *spare = mt->spare;
+    mutex_node_t **pp;
+
+    guard_lock(mp);
+    pp = (mutex_node_t **)&(mp->waitq);
+    while(*pp != NULL && *pp != mt->node)
+        pp = &((*pp)->next);
+    if(*pp != NULL){
+        spare->ticket = mt->node->ticket;
+        spare->abandoned = 1;
+        spare->next = mt->node->next;
+        /* From now on the spare node belongs to the unlocker */
+        *pp = spare;
+        mt->spare = NULL;
+        mt->timedout = 1;
+        park_wake(&(mt->node->park));
+    }
+    guard_unlock(mp);
+}
@@ -0,0 +1,78 @@
+/** @file park.c
+ *  @brief Sleep/wakeup handshake used by the blocking primitives.
+ *
+ *  deschedule() and make_runnable() alone leave two races. The waker
+ *  may run before the waiter is really asleep, in which case
+ *  make_runnable() fails. The waker may also be so late that the
+ *  waiter already returned and went to sleep somewhere else, in which
+ *  case make_runnable() wakes up the wrong sleep.
+ *
+ *  A park closes both. The waker first sets the reject flag that the
+ *  waiter passes to deschedule(), so a waiter that has not gone to
+ *  sleep yet never will. The waker only issues make_runnable() when the
+ *  waiter has announced that it is going to sleep. Finally, the waiter
+ *  does not leave park_wait() before the waker has set done, which is
+ *  the last write the waker makes to the park.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+
+#include <syscall.h>
+#include <thr_internals.h>
+
+/** @brief Prepare a park for a waiter.
+ *
+ *  @param pk The park, usually on the waiter's stack.
+ *  @param ktid The kernel tid of the waiter.
+ *  @return Void.
+ */
+void park_init(park_t *pk, int ktid) {
+    pk->reject = 0;
+    pk->asleep = 0;
+    pk->done = 0;
+    pk->ktid = ktid;
+}
+
+/** @brief Sleep until park_wake() is called on this park.
+ *
+ *  Announcing asleep and reading reject are ordered by the locked xchg,
+ *  and so are the waker's write of reject and read of asleep. So either
+ *  the waker sees we are asleep, or we see its reject flag.
+ *
+ *  @param pk The park initialized by the caller.
+ *  @return Void.
+ */
+void park_wait(park_t *pk) {
+    xchg_wrapper(&pk->asleep, 1);
+
+    /* deschedule() checks reject atomically, and we loop in case we
+     * were woken up by someone else */
+    while (!pk->reject) {
+        deschedule(&pk->reject);
+    }
+
+    /* the waker may still be about to call make_runnable() on us */
+    while (!pk->done) {
+        yield(-1);
+    }
+}
+
+/** @brief Wake up the waiter of a park.
+ *
+ *  @param pk The park, must be waited on exactly once.
+ *  @return Void.
+ */
+void park_wake(park_t *pk) {
+    int ktid = pk->ktid;
+
+    xchg_wrapper(&pk->reject, 1);
+    /* the waiter is asleep or about to be; if make_runnable() comes too
+     * early, deschedule() sees the reject flag and returns instead */
+    if (pk->asleep) {
+        make_runnable(ktid);
+    }
+
+    /* last touch, the waiter may return and drop pk after this */
+    pk->done = 1;
+}
@@ -0,0 +1,558 @@
+/** @file pool.c
+ *  @brief Implementation of object pools.
+ *
+ *  A pool carves slabs, pages mapped with new_pages, into objects of its
+ *  size. A slab starts with the link to the next slab of the pool, and
+ *  the objects follow from the first aligned offset. A free object is
+ *  linked through its first word. The slabs stay with the pool until
+ *  pool_destroy.
+ *
+ *  Each thread caches the free objects of up to THR_POOL_SLOTS pools in
+ *  its thr_stk, the way malloc.c caches small blocks: an empty cache is
+ *  refilled with POOL_BATCH objects from the pool under its mutex, and a
+ *  cache that reaches POOL_CACHE_MAX gives POOL_BATCH of them back. A
+ *  thread with no slot left for a pool, and no slot with an empty cache
+ *  to take over, goes to the pool under its mutex for every object.
+ *  Either way pool_alloc and pool_free are O(1); only the first
+ *  allocation from a new slab links its objects up.
+ *
+ *  Only the owner touches its slots. A slot remembers the generation of
+ *  its pool, which pool_init draws from a counter, so a slot left over
+ *  from a destroyed pool is told apart from a new pool at the same
+ *  address and dropped when the owner comes across it. The owner looks
+ *  for slots of destroyed pools in the list of live pools when it is
+ *  out of slots, if a pool was destroyed since it last looked. An
+ *  exiting thread hands its objects of the live pools over to them, so
+ *  it never touches a destroyed pool either.
+ *
+ *  Slabs are mapped from POOL_SLAB_TOP down. The slabs of destroyed pools
+ *  are kept mapped for the next pools, up to POOL_SLAB_CACHE_MAX, the rest
+ *  are unmapped and their addresses remembered like thread.c remembers
+ *  unmapped stacks.
+ *
+ *  Like malloc, pools can only be used after thr_init.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stddef.h> /* NULL */
+#include <malloc.h>
+#include <simics.h> /* lprintf() */
+#include <assert.h> /* panic() */
+#include <syscall.h> /* new_pages(), remove_pages() */
+#include <mutex.h>
+#include <pool.h>
+#include <thr_internals.h>
+
+/** @brief Objects moved between a thread and a pool at once */
+#define POOL_BATCH 16
+
+/** @brief A thread gives objects back once it caches this many */
+#define POOL_CACHE_MAX (4 * POOL_BATCH)
+
+/** @brief Slabs are mapped below this address */
+#define POOL_SLAB_TOP ((void *)0x80000000)
+
+/** @brief Slabs of destroyed pools kept mapped for reuse */
+#define POOL_SLAB_CACHE_MAX 16
+
+/** @brief An unmapped slab below slab_curr */
+typedef struct slab_hole slab_hole_t;
+struct slab_hole {
+    void *lo;          /* the slab's address */
+    slab_hole_t *next; /* next unmapped slab */
+};
+
+/** @brief The lowest slab mapped at the watermark. Protected by pool_mp. */
+static void *slab_curr = POOL_SLAB_TOP;
+
+/** @brief Mapped slabs no pool uses, linked through their first word.
+ *  Protected by pool_mp. */
+static void *slab_cache = NULL;
+static int slab_cache_len = 0;
+
+/** @brief Unmapped slabs to be reused before slab_curr moves down again.
+ *  Protected by pool_mp. */
+static slab_hole_t *slab_holes = NULL;
+
+/** @brief The initialized pools. Protected by pool_mp. */
+static pool_t *pool_live = NULL;
+
+/** @brief The number of pools destroyed so far. Protected by pool_mp. */
+static int pool_destroys = 0;
+
+/** @brief The last pool generation handed out */
+static int pool_gen = 0;
+
+/** @brief Get a mapped slab.
+ *
+ *  @return The slab, NULL if it can't be mapped.
+ */
+static void *slab_get(void) {
+    slab_hole_t *hole;
+    void *lo = NULL;
+
+    mutex_lock(&pool_mp);
+    if (slab_cache != NULL) {
+        lo = slab_cache;
+        slab_cache = *(void **)lo;
+        slab_cache_len--;
+    }
+    else if (slab_holes != NULL) {
+        hole = slab_holes;
+        if (new_pages(hole->lo, PAGE_SIZE) == 0) {
+            lo = hole->lo;
+            slab_holes = hole->next;
+            free(hole);
+        }
+    }
+    else if (new_pages(slab_curr - PAGE_SIZE, PAGE_SIZE) == 0) {
+        slab_curr -= PAGE_SIZE;
+        lo = slab_curr;
+    }
+    mutex_unlock(&pool_mp);
+
+    return lo;
+}
+
+/** @brief Give back a slab no pool uses anymore.
+ *
+ *  Keep it mapped in the cache if there is room. Otherwise unmap it, and
+ *  give its address back to the watermark or remember it as a hole. If
+ *  that fails, it is kept mapped anyway.
+ *
+ *  @param lo The slab.
+ *  @return Void.
+ */
+static void slab_put(void *lo) {
+    slab_hole_t *hole;
+
+    mutex_lock(&pool_mp);
+    if (slab_cache_len >= POOL_SLAB_CACHE_MAX) {
+        hole = (lo == slab_curr) ? NULL : malloc(sizeof(slab_hole_t));
+        if ((lo == slab_curr || hole != NULL) && remove_pages(lo) == 0) {
+            if (hole == NULL) {
+                slab_curr += PAGE_SIZE;
+            }
+            else {
+                hole->lo = lo;
+                hole->next = slab_holes;
+                slab_holes = hole;
+            }
+            mutex_unlock(&pool_mp);
+            return;
+        }
+        free(hole);
+    }
+
+    *(void **)lo = slab_cache;
+    slab_cache = lo;
+    slab_cache_len++;
+    mutex_unlock(&pool_mp);
+}
+
+/** @brief Take up to n objects off the pool's free list.
+ *
+ *  If the list is empty, a new slab is mapped and carved up first.
+ *
+ *  @note Caller must hold pool->mutex.
+ *
+ *  @param pool The pool.
+ *  @param n The most objects to take, at least 1.
+ *  @param taken Set to the number of objects taken.
+ *  @return The objects, linked, NULL if no slab can be mapped.
+ */
+static void *pool_take(pool_t *pool, int n, int *taken) {
+    char *slab, *obj;
+    void *head, *tail;
+    int i;
+
+    /* take the objects exited threads gave back first */
+    if (pool->free == NULL && pool->returned != NULL) {
+        mutex_lock(&pool_mp);
+        pool->free = pool->returned;
+        pool->returned = NULL;
+        mutex_unlock(&pool_mp);
+    }
+
+    if (pool->free == NULL) {
+        if ((slab = slab_get()) == NULL) {
+            *taken = 0;
+            return NULL;
+        }
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+
+        /* link them up from the end, so they go out in address order */
+        for (i = pool->per_slab - 1; i >= 0; i--) {
+            obj = slab + pool->first + i * pool->obj_size;
+            *(void **)obj = pool->free;
+            pool->free = obj;
+        }
+    }
+
+    head = tail = pool->free;
+    for (i = 1; i < n && *(void **)tail != NULL; i++) {
+        tail = *(void **)tail;
+    }
+    pool->free = *(void **)tail;
+    *(void **)tail = NULL;
+    *taken = i;
+
+    return head;
+}
+
+/** @brief Give the first n objects of a thread's cache back to the pool.
+ *
+ *  @param pool The pool.
+ *  @param pc The cache, with at least n objects.
+ *  @param n The number of objects.
+ *  @return Void.
+ */
+static void cache_drain(pool_t *pool, pool_cache_t *pc, int n) {
+    void *head, *tail;
+    int i;
+
+    head = tail = pc->head;
+    for (i = 1; i < n; i++) {
+        tail = *(void **)tail;
+    }
+    pc->head = *(void **)tail;
+    pc->len -= n;
+
+    mutex_lock(&pool->mutex);
+    *(void **)tail = pool->free;
+    pool->free = head;
+    mutex_unlock(&pool->mutex);
+}
+
+/** @brief Tell whether a slot's pool is still alive.
+ *
+ *  @note Caller must hold pool_mp.
+ *
+ *  @param pc The slot.
+ *  @return The pool if it is still the one the slot was claimed for, else
+ *          NULL.
+ */
+static pool_t *cache_pool(pool_cache_t *pc) {
+    pool_t *pool;
+
+    /* compare the address first, the slot's pool may be gone */
+    for (pool = pool_live; pool != NULL; pool = pool->next) {
+        if (pool == pc->pool && pool->gen == pc->gen) {
+            return pool;
+        }
+    }
+    return NULL;
+}
+
+/** @brief Empty a slot, its objects are the pool's again or gone.
+ *
+ *  @param pc The slot.
+ *  @return Void.
+ */
+static void cache_clear(pool_cache_t *pc) {
+    pc->pool = NULL;
+    pc->head = NULL;
+    pc->len = 0;
+}
+
+/** @brief Drop the caller's slots of destroyed pools.
+ *
+ *  @param thr_stk The caller's thr_stk.
+ *  @return A slot that was dropped, NULL if none.
+ */
+static pool_cache_t *cache_reclaim(thr_stk_t *thr_stk) {
+    pool_cache_t *spare = NULL;
+    pool_cache_t *pc;
+    int i;
+
+    mutex_lock(&pool_mp);
+    thr_stk->pcache_seen = pool_destroys;
+    for (i = 0; i < THR_POOL_SLOTS; i++) {
+        pc = &(thr_stk->pcache[i]);
+        if (pc->pool != NULL && cache_pool(pc) == NULL) {
+            cache_clear(pc);
+            spare = pc;
+        }
+    }
+    mutex_unlock(&pool_mp);
+
+    return spare;
+}
+
+/** @brief Find the caller's cache for a pool.
+ *
+ *  Claims an unused slot, or else one whose cache is empty, or else one
+ *  of a destroyed pool, if the pool has none yet.
+ *
+ *  @param thr_stk The caller's thr_stk.
+ *  @param pool The pool.
+ *  @return The cache, NULL if the caller has no slot for the pool.
+ */
+static pool_cache_t *cache_of(thr_stk_t *thr_stk, pool_t *pool) {
+    pool_cache_t *spare = NULL;
+    pool_cache_t *pc;
+    int i;
+
+    /* gone through pool_cache_flush */
+    if (thr_stk->mcache_off) {
+        return NULL;
+    }
+
+    for (i = 0; i < THR_POOL_SLOTS; i++) {
+        pc = &(thr_stk->pcache[i]);
+        if (pc->pool == pool) {
+            if (pc->gen == pool->gen) {
+                return pc;
+            }
+            /* left from a destroyed pool at the same address, its
+             * objects went with the slabs */
+            cache_clear(pc);
+        }
+        /* an unused slot is better than one of another pool */
+        if (pc->pool == NULL) {
+            if (spare == NULL || spare->pool != NULL) {
+                spare = pc;
+            }
+        }
+        else if (pc->len == 0 && spare == NULL) {
+            spare = pc;
+        }
+    }
+
+    /* some slot may belong to a pool destroyed since we last looked */
+    if (spare == NULL && thr_stk->pcache_seen != pool_destroys) {
+        spare = cache_reclaim(thr_stk);
+    }
+
+    if (spare != NULL) {
+        spare->pool = pool;
+        spare->gen = pool->gen;
+        spare->head = NULL;
+        spare->len = 0;
+    }
+    return spare;
+}
+
+/** @brief Give all the objects a thread caches back, and stop caching.
+ *
+ *  Called by an exiting thread, after malloc_cache_flush has set
+ *  mcache_off. The objects of the pools that are still alive go to
+ *  their returned list, the others went with their slabs.
+ *
+ *  @param thr_stk The caller's thr_stk.
+ *  @return Void.
+ */
+void pool_cache_flush(thr_stk_t *thr_stk) {
+    pool_cache_t *pc;
+    pool_t *pool;
+    void *tail;
+    int i;
+
+    mutex_lock(&pool_mp);
+    for (i = 0; i < THR_POOL_SLOTS; i++) {
+        pc = &(thr_stk->pcache[i]);
+        if (pc->pool != NULL && pc->len > 0 &&
+            (pool = cache_pool(pc)) != NULL) {
+            tail = pc->head;
+            while (*(void **)tail != NULL) {
+                tail = *(void **)tail;
+            }
+            *(void **)tail = pool->returned;
+            pool->returned = pc->head;
+        }
+        cache_clear(pc);
+    }
+    mutex_unlock(&pool_mp);
+}
+
+/** @brief Initialize the pool
+ *
+ *  This should be only called once before calling other
+ *  pool methods. The pool could be re-init after it is
+ *  successfully destroyed.
+ *
+ *  @param pool Address of pool.
+ *  @param obj_size The size of the objects.
+ *  @param align The alignment of the objects, a power of 2.
+ *  @return 0 on success, -1 on error.
+ */
+int pool_init(pool_t *pool, size_t obj_size, size_t align) {
+    int size;
+
+    /* check null pointer */
+    if (!pool) {
+        lprintf("Input pool is null");
+        return -1;
+    }
+    if (align == 0 || (align & (align - 1)) != 0) {
+        lprintf("Pool alignment must be a power of 2");
+        return -1;
+    }
+    if (obj_size == 0 || obj_size > PAGE_SIZE || align > PAGE_SIZE) {
+        lprintf("Pool objects must fit in a page");
+        return -1;
+    }
+
+    /* a free object holds a link, aligned */
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    size = (obj_size + align - 1) & ~(align - 1);
+    pool->first = (sizeof(void *) + align - 1) & ~(align - 1);
+    if (pool->first + size > PAGE_SIZE) {
+        lprintf("Pool objects must fit in a page");
+        return -1;
+    }
+
+    if (mutex_init(&(pool->mutex)) < 0) {
+        lprintf("Cannot initialize the mutex in pool");
+        return -1;
+    }
+    pool->obj_size = size;
+    pool->per_slab = (PAGE_SIZE - pool->first) / size;
+    pool->free = NULL;
+    pool->slabs = NULL;
+    pool->gen = xaddn_wrapper(&pool_gen, 1) + 1;
+    pool->returned = NULL;
+
+    mutex_lock(&pool_mp);
+    pool->prev = NULL;
+    pool->next = pool_live;
+    if (pool_live != NULL) {
+        pool_live->prev = pool;
+    }
+    pool_live = pool;
+    mutex_unlock(&pool_mp);
+
+    pool->init = 1;
+
+    return 0;
+}
+
+/** @brief Allocate an object.
+ *
+ *  @param pool The address of pool.
+ *  @return The object, NULL if no slab can be mapped.
+ */
+void *pool_alloc(pool_t *pool) {
+    pool_cache_t *pc;
+    void *obj;
+    int n;
+
+    if (!pool) {
+        panic("pool_alloc: The input pointer is null");
+    }
+
+    if (!pool->init) {
+        panic("pool_alloc: The pool hasn't been initialized");
+    }
+
+    pc = cache_of(get_thr_stk(), pool);
+    if (pc == NULL) {
+        mutex_lock(&(pool->mutex));
+        obj = pool_take(pool, 1, &n);
+        mutex_unlock(&(pool->mutex));
+        return obj;
+    }
+
+    if (pc->head == NULL) {
+        mutex_lock(&(pool->mutex));
+        pc->head = pool_take(pool, POOL_BATCH, &(pc->len));
+        mutex_unlock(&(pool->mutex));
+        if (pc->head == NULL) {
+            return NULL;
+        }
+    }
+
+    obj = pc->head;
+    pc->head = *(void **)obj;
+    pc->len--;
+    return obj;
+}
+
+/** @brief Free an object.
+ *
+ *  @param pool The address of pool.
+ *  @param obj The object, from pool_alloc() of the same pool, or NULL.
+ *  @return Void.
+ */
+void pool_free(pool_t *pool, void *obj) {
+    pool_cache_t *pc;
+
+    if (!pool) {
+        panic("pool_free: The input pointer is null");
+    }
+
+    if (!pool->init) {
+        panic("pool_free: The pool hasn't been initialized");
+    }
+
+    if (obj == NULL) {
+        return;
+    }
+
+    pc = cache_of(get_thr_stk(), pool);
+    if (pc == NULL) {
+        mutex_lock(&(pool->mutex));
+        *(void **)obj = pool->free;
+        pool->free = obj;
+        mutex_unlock(&(pool->mutex));
+        return;
+    }
+
+    *(void **)obj = pc->head;
+    pc->head = obj;
+    if (++pc->len >= POOL_CACHE_MAX) {
+        cache_drain(pool, pc, POOL_BATCH);
+    }
+}
+
+/** @brief Destroy the pool.
+ *
+ *  The slabs go back, so objects still allocated are gone too, and so
+ *  are the ones threads cache. Each thread drops its cache of the pool
+ *  when it next comes across it.
+ *
+ *  @note No thread may use the pool while it is destroyed. Only after
+ *        this instruction is done, the pool can be called init again.
+ *
+ *  @param pool The address of pool.
+ *  @return Void.
+ */
+void pool_destroy(pool_t *pool) {
+    void *slab;
+
+    if (!pool) {
+        panic("pool_destroy: The input pointer is null");
+    }
+
+    if (!pool->init) {
+        panic("pool_destroy: The pool hasn't been initialized");
+    }
+
+    /* from now on the threads' slots of the pool are stale */
+    mutex_lock(&pool_mp);
+    if (pool->prev != NULL) {
+        pool->prev->next = pool->next;
+    }
+    else {
+        pool_live = pool->next;
+    }
+    if (pool->next != NULL) {
+        pool->next->prev = pool->prev;
+    }
+    pool->returned = NULL;
+    pool_destroys++;
+    mutex_unlock(&pool_mp);
+
+    while ((slab = pool->slabs) != NULL) {
+        pool->slabs = *(void **)slab;
+        slab_put(slab);
+    }
+    pool->free = NULL;
+
+    mutex_destroy(&(pool->mutex));
+    pool->init = 0;
+}
@@ -0,0 +1,202 @@
+/** @file rmlock.c
+ *  @brief Implementation of read-mostly lock.
+ *
+ *  An rwlock makes every reader lock and update the rwlock, so readers
+ *  on different CPUs fight over its cache lines even though they never
+ *  wait for each other. An rmlock lets readers skip that while no
+ *  writer is around:
+ *
+ *  - A reader puts the lock's address in a free rm_slot of its own
+ *    thr_stk, then checks num_writer. If it is 0, the reader is in, and
+ *    it has written nothing but its own thr_stk.
+ *  - A writer raises num_writer, so that new readers back off to rw,
+ *    and takes rw for writing, which keeps out the other writers and
+ *    the readers that backed off. Then it walks the thread table until
+ *    no thread has the lock in a slot.
+ *
+ *  Setting the slot and raising num_writer are both locked instructions,
+ *  and each side reads the other's flag only after its own write. So a
+ *  reader that does not see num_writer has its slot seen by the writer.
+ *
+ *  Readers that come while a writer is around, and readers with no free
+ *  slot, take rw for reading. rw is phase-fair, so they are not starved
+ *  by a stream of writers. Writers are slow, they scan every thread.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stddef.h> /* NULL */
+#include <simics.h> /* lprintf() */
+#include <assert.h> /* panic() */
+#include <syscall.h> /* yield() */
+#include <rwlock.h>
+#include <rmlock.h>
+#include <thread.h> /* thr_getid() */
+#include <thr_internals.h>
+
+/** @brief Check if a thread read-holds an rmlock on the fast path.
+ *
+ *  @param thr_stk The thread.
+ *  @param rmlock The address of rmlock.
+ *  @return 1 if one of its slots holds rmlock, else 0.
+ */
+static int holds_slot(thr_stk_t *thr_stk, void *rmlock) {
+    int i;
+
+    for (i = 0; i < THR_RM_SLOTS; i++) {
+        if (thr_stk->rm_slot[i] == rmlock) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** @brief Initialize the rmlock
+ *
+ *  This should be only called once before calling other
+ *  rmlock methods. The rmlock could be re-init after it is
+ *  successfully destroyed.
+ *
+ *  @param rmlock Address of rmlock.
+ *  @return 0 on success, -1 on error.
+ */
+int rmlock_init(rmlock_t *rmlock) {
+    /* check null pointer */
+    if (!rmlock) {
+        lprintf("Input rmlock is null");
+        return -1;
+    }
+    if (rwlock_init(&(rmlock->rw)) < 0) {
+        lprintf("Cannot initialize the rwlock in rmlock");
+        return -1;
+    }
+
+    rmlock->num_writer = 0;
+    rmlock->init = 1;
+
+    return 0;
+}
+
+/** @brief Acquire the lock.
+ *
+ *  A reader takes the fast path if it has a free slot and no writer is
+ *  around, else it takes rw. A writer takes rw and waits for the fast
+ *  path readers to leave.
+ *
+ *  @param rmlock The address of rmlock.
+ *  @param type The type of lock, RWLOCK_READ or RWLOCK_WRITE.
+ *  @return Void.
+ */
+void rmlock_lock(rmlock_t *rmlock, int type) {
+    if (!rmlock) {
+        panic("rmlock_lock: The input pointer is null");
+    }
+
+    if (!rmlock->init) {
+        panic("rmlock_lock: The rmlock hasn't been initialized");
+    }
+
+    if (type != RWLOCK_READ && type != RWLOCK_WRITE) {
+        panic("rmlock_lock: Unknown lock type %d", type);
+    }
+
+    /* reader */
+    if (type == RWLOCK_READ) {
+        thr_stk_t *thr_stk = get_thr_stk();
+        int i;
+
+        for (i = 0; i < THR_RM_SLOTS; i++) {
+            if (thr_stk->rm_slot[i] == NULL) {
+                break;
+            }
+        }
+
+        /* publish ourselves, then look for writers */
+        if (i < THR_RM_SLOTS && rmlock->num_writer == 0) {
+            xchg_wrapper((int *)&thr_stk->rm_slot[i], (int)rmlock);
+            if (rmlock->num_writer == 0) {
+                return;
+            }
+            /* a writer came in between, let it go first */
+            thr_stk->rm_slot[i] = NULL;
+        }
+
+        rwlock_lock(&(rmlock->rw), RWLOCK_READ);
+        return;
+    }
+
+    /* writer, keep new readers off the fast path */
+    xaddn_wrapper(&(rmlock->num_writer), 1);
+    rwlock_lock(&(rmlock->rw), RWLOCK_WRITE);
+
+    /* wait for the fast path readers already in */
+    while (thr_tbl_any(holds_slot, rmlock)) {
+        yield(-1);
+    }
+}
+
+/** @brief Release the lock.
+ *
+ *  @param rmlock The address of rmlock.
+ *  @return Void.
+ */
+void rmlock_unlock(rmlock_t *rmlock) {
+    thr_stk_t *thr_stk;
+    int i;
+
+    if (!rmlock) {
+        panic("rmlock_unlock: The input pointer is null");
+    }
+
+    if (!rmlock->init) {
+        panic("rmlock_unlock: The rmlock hasn't been intialized");
+    }
+
+    /* caller thread is a fast path reader, the writer scanning for us
+     * may go on once the slot is cleared */
+    thr_stk = get_thr_stk();
+    for (i = 0; i < THR_RM_SLOTS; i++) {
+        if (thr_stk->rm_slot[i] == rmlock) {
+            thr_stk->rm_slot[i] = NULL;
+            return;
+        }
+    }
+
+    /* caller thread is writer */
+    if ((rmlock->rw.write_flag) && (rmlock->rw.writer_tid == thr_getid())) {
+        rwlock_unlock(&(rmlock->rw));
+        xaddn_wrapper(&(rmlock->num_writer), -1);
+        return;
+    }
+
+    /* caller thread is a slow path reader */
+    rwlock_unlock(&(rmlock->rw));
+}
+
+/** @brief Destroy the rmlock.
+ *
+ *  @note Only after this instruction is done, the rmlock
+ *        can be called init again.
+ *
+ *  @param rmlock The address of rmlock.
+ *  @return Void.
+ */
+void rmlock_destroy(rmlock_t *rmlock) {
+    if (!rmlock) {
+        panic("rmlock_destroy: The input pointer is null");
+    }
+
+    if (!rmlock->init) {
+        panic("rmlock_destroy: The rmlock hasn't been initialized");
+    }
+
+    if (rmlock->num_writer > 0 || thr_tbl_any(holds_slot, rmlock)) {
+        panic("rmlock_destroy: The rmlock is still held");
+    }
+
+    /* rw checks the slow path holders */
+    rwlock_destroy(&(rmlock->rw));
+
+    rmlock->init = 0;
+    return;
+}
@@ -2,19 +2,38 @@
  *  @brief Implementation of reader/writer lock.
  *
  *  This file contains implementation for rwlock. We implement
- *  a rwlock that satisfy the second rw problem. That is it is
- *  in favor of writer, whenever there is any writer waiting.
- *  the reader cannot grab the lock.
+ *  a phase-fair rwlock. Readers and writers take turns in phases:
+ *
+ *  - A reader gets in right away only if no writer holds the lock or
+ *    waits for it. Otherwise it waits for the next read phase.
+ *  - When a writer unlocks, every reader waiting at that moment is let
+ *    in together, and that is the next read phase. Readers that come
+ *    while a writer waits don't join the current read phase.
+ *  - When the last reader of a read phase leaves, the next writer
+ *    gets in.
+ *
+ *  So a reader waits for at most one write phase, and a writer for at
+ *  most one read phase after the writers ahead of it, and no side can
+ *  starve the other. Readers of a new phase are admitted by the writer,
+ *  they don't race each other for the lock.
+ *
+ *  A reader may upgrade to writer. A waiting upgrader is treated like a
+ *  writer that is already first in line: new readers wait for the read
+ *  phase after its write.
  *
  *  @author Che-Yuan Liang (cheyuanl)
  *  @bug No known bugs.
  */
 #include <simics.h> /* lprintf() */
 #include <assert.h> /* panic() */
+#include <stddef.h> /* NULL */
 #include <cond.h>
+#include <cond_ext.h>
 #include <mutex.h>
 #include <rwlock.h>
+#include <rwlock_ext.h>
 #include <thread.h> /* thr_getid() */
+#include <thr_internals.h>
 
 /** @brief Initialize the rwlock
  *
@@ -45,23 +64,170 @@ int rwlock_init(rwlock_t *rwlock) {
         lprintf("Cannot initialize the reader cv in rwlock");
         return -1;
     }
+    if (cond_init(&(rwlock->upgrade_cv)) < 0) {
+        lprintf("Cannot initialize the upgrade cv in rwlock");
+        return -1;
+    }
 
     rwlock->init = 1;
 
     rwlock->num_reader = 0;
     rwlock->num_wait_writer = 0;
+    rwlock->num_wait_reader = 0;
+    rwlock->read_phase = 0;
+    rwlock->upgrader = 0;
 
     rwlock->writer_tid = 0;
     rwlock->write_flag = 0;
+    LOCKSTAT(lockstat_register(&(rwlock->stat), rwlock, "rwlock"));
 
     return 0;
 }
 
+/** @brief Start a read phase with all the waiting readers.
+ *
+ *  @note Caller must hold rwlock->mutex, and no writer may be in.
+ *
+ *  @param rwlock The address of rwlock.
+ *  @return 1 if there were readers to let in, 0 if not.
+ */
+static int start_read_phase(rwlock_t *rwlock) {
+    if (rwlock->num_wait_reader == 0) {
+        return 0;
+    }
+
+    /* the hold time covers the whole time any reader is in */
+    if (rwlock->num_reader == 0) {
+        LOCKSTAT(lockstat_hold_begin(&(rwlock->stat)));
+    }
+    /* let them all in at once */
+    rwlock->num_reader += rwlock->num_wait_reader;
+    rwlock->num_wait_reader = 0;
+    rwlock->read_phase++;
+    cond_broadcast(&(rwlock->reader_cv));
+
+    return 1;
+}
+
+/** @brief Check if a reader may join the current read phase.
+ *
+ *  @note Caller must hold rwlock->mutex.
+ *
+ *  @param rwlock The address of rwlock.
+ *  @return 1 if nobody is writing, waiting to write or upgrading.
+ */
+static int read_open(rwlock_t *rwlock) {
+    return (rwlock->num_wait_writer == 0) && (!rwlock->write_flag) &&
+           (!rwlock->upgrader);
+}
+
+/** @brief Check if a writer may get in.
+ *
+ *  @note Caller must hold rwlock->mutex.
+ *
+ *  @param rwlock The address of rwlock.
+ *  @return 1 if nobody is writing or reading.
+ */
+static int write_open(rwlock_t *rwlock) {
+    return (!rwlock->write_flag) && (rwlock->num_reader == 0);
+}
+
+/** @brief Wait on one of the rwlock's cvs, up to a deadline.
+ *
+ *  @param rwlock The address of rwlock, its mutex is held.
+ *  @param cv The cv to wait on.
+ *  @param deadline The deadline in get_ticks() units, NULL for none.
+ *  @return 0 if we were signaled, -1 if the deadline came first.
+ */
+static int rw_wait(rwlock_t *rwlock, cond_t *cv, unsigned int *deadline) {
+    if (!deadline) {
+        cond_wait(cv, &(rwlock->mutex));
+        return 0;
+    }
+    return cond_timedwait(cv, &(rwlock->mutex), *deadline);
+}
+
+/** @brief Acquire the lock, or give up at a deadline.
+ *
+ *  If there is any writer in the lock or waiting in the line, or an
+ *  upgrader, a reader waits for the next read phase, which starts when
+ *  that writer unlocks.
+ *
+ *  @note Caller must hold rwlock->mutex.
+ *
+ *  @param rwlock Address of the rwlock.
+ *  @param type The type of lock (either RWLOCK_READ or RWLOCK_WRITE)
+ *  @param deadline The deadline in get_ticks() units, NULL for none.
+ *  @return 0 if we got the lock, -1 if the deadline passed first.
+ */
+static int rw_acquire(rwlock_t *rwlock, int type, unsigned int *deadline) {
+    /* rounds of cond_wait before we got the lock */
+    int parks = 0;
+
+    /* reader */
+    if (type == RWLOCK_READ) {
+        /* if nobody is writing or waiting to write, join the current
+           read phase */
+        if (read_open(rwlock)) {
+            /* reader gets the lock */
+            rwlock->num_reader++;
+            LOCKSTAT(lockstat_acquired(&(rwlock->stat), 0, 0));
+            /* the hold time covers the whole time any reader is in */
+            if (rwlock->num_reader == 1) {
+                LOCKSTAT(lockstat_hold_begin(&(rwlock->stat)));
+            }
+            return 0;
+        }
+
+        /* else wait for the writer to start the next read phase, it
+           counts us in num_reader for us */
+        int phase = rwlock->read_phase;
+        rwlock->num_wait_reader++;
+        while (rwlock->read_phase == phase) {
+            if ((rw_wait(rwlock, &(rwlock->reader_cv), deadline) < 0) &&
+                (rwlock->read_phase == phase)) {
+                /* not counted in yet, so just leave the line */
+                rwlock->num_wait_reader--;
+                return -1;
+            }
+            parks++;
+        }
+        LOCKSTAT(lockstat_acquired(&(rwlock->stat), 0, parks));
+        return 0;
+    }
+
+    /* writer */
+    /* register as waiting writer, so new readers wait for the
+       next read phase */
+    rwlock->num_wait_writer++;
+    /* wait if any thread is writing or any thread is reading */
+    while (!write_open(rwlock)) {
+        if ((rw_wait(rwlock, &(rwlock->writer_cv), deadline) < 0) &&
+            (!write_open(rwlock))) {
+            rwlock->num_wait_writer--;
+            /* readers may be waiting on nobody but us now, let them
+               join the readers in */
+            if ((rwlock->num_wait_writer == 0) && (!rwlock->write_flag) &&
+                (!rwlock->upgrader)) {
+                start_read_phase(rwlock);
+            }
+            return -1;
+        }
+        parks++;
+    }
+    /* writer gets the semaphore */
+    rwlock->num_wait_writer--;
+    rwlock->writer_tid = thr_getid();
+    rwlock->write_flag = 1;
+    LOCKSTAT(lockstat_acquired(&(rwlock->stat), 0, parks));
+    LOCKSTAT(lockstat_hold_begin(&(rwlock->stat)));
+    return 0;
+}
+
 /** @brief Acquire the lock.
  *
  *  The method will perform different operatio depend on the type of
- *  lock requested. This function is in favor of writer, if there is any
- *  writer waiting in the line, the reader will conditional wait on that.
+ *  lock requested. See rw_acquire.
  *
  *  @param rwlock Address of the rwlock.
  *  @param type The type of lock (either RWLOCK_READ or RWLOCK_WRITE)
@@ -81,46 +247,159 @@ void rwlock_lock(rwlock_t *rwlock, int type) {
     }
 
     mutex_lock(&(rwlock->mutex));
+    rw_acquire(rwlock, type, NULL);
+    mutex_unlock(&(rwlock->mutex));
+}
 
-    /* reader */
-    if (type == RWLOCK_READ) {
-        /* if any thread is writing or if there is any writer waiting,
-           the reader should be blocked */
-        while ((rwlock->num_wait_writer > 0) || (rwlock->write_flag)) {
-            cond_wait(&(rwlock->reader_cv), &(rwlock->mutex));
-        }
-        /* reader gets the lock */
-        rwlock->num_reader++;
+/** @brief Acquire the lock, or give up at a deadline.
+ *
+ *  @param rwlock Address of the rwlock.
+ *  @param type The type of lock (either RWLOCK_READ or RWLOCK_WRITE)
+ *  @param ticks The deadline, in get_ticks() units
+ *  @return 0 if we got the lock, -1 if the deadline passed first.
+ */
+int rwlock_lock_until(rwlock_t *rwlock, int type, unsigned int ticks) {
+    int ret;
 
-        mutex_unlock(&(rwlock->mutex));
-        return;
+    if (!rwlock) {
+        panic("rwlock_lock_until: The input pointer is null");
     }
-    /* writer */
-    else {
-        /* register as waiting writer, so reader thread can yield */
-        rwlock->num_wait_writer++;
-        /* wait if any thread is writing or any thread is reading */
-        while (rwlock->write_flag == 1 || rwlock->num_reader > 0) {
-            cond_wait(&(rwlock->writer_cv), &(rwlock->mutex));
-        }
-        /* writer gets the semaphore */
-        rwlock->num_wait_writer--;
+
+    if (!rwlock->init) {
+        panic("rwlock_lock_until: The rwlock hasn't been intialized");
+    }
+
+    if ((type != RWLOCK_READ) && (type != RWLOCK_WRITE)) {
+        panic("rwlock_lock_until: Invalid lock type %d", type);
+    }
+
+    mutex_lock(&(rwlock->mutex));
+    ret = rw_acquire(rwlock, type, &ticks);
+    mutex_unlock(&(rwlock->mutex));
+    return ret;
+}
+
+/** @brief Acquire the lock only if it can be done without waiting.
+ *
+ *  @param rwlock Address of the rwlock.
+ *  @param type The type of lock (either RWLOCK_READ or RWLOCK_WRITE)
+ *  @return 0 if we got the lock, -1 if we would have to wait.
+ */
+int rwlock_trylock(rwlock_t *rwlock, int type) {
+    int ret = -1;
+
+    if (!rwlock) {
+        panic("rwlock_trylock: The input pointer is null");
+    }
+
+    if (!rwlock->init) {
+        panic("rwlock_trylock: The rwlock hasn't been intialized");
+    }
+
+    if ((type != RWLOCK_READ) && (type != RWLOCK_WRITE)) {
+        panic("rwlock_trylock: Invalid lock type %d", type);
+    }
+
+    mutex_lock(&(rwlock->mutex));
+    /* rw_acquire doesn't wait when the lock is open */
+    if ((type == RWLOCK_READ) ? read_open(rwlock) : write_open(rwlock)) {
+        ret = rw_acquire(rwlock, type, NULL);
+    }
+    mutex_unlock(&(rwlock->mutex));
+    return ret;
+}
+
+/** @brief Turn the caller's read lock into the write lock, if it is
+ *         the only reader.
+ *
+ *  @param rwlock The address of rwlock, read locked by the caller.
+ *  @return 0 if the caller holds the write lock now, -1 if there are
+ *          other readers, the caller still holds the read lock then.
+ */
+int rwlock_tryupgrade(rwlock_t *rwlock) {
+    int ret = -1;
+
+    if (!rwlock) {
+        panic("rwlock_tryupgrade: The input pointer is null");
+    }
+
+    if (!rwlock->init) {
+        panic("rwlock_tryupgrade: The rwlock hasn't been intialized");
+    }
+
+    mutex_lock(&(rwlock->mutex));
+    if ((rwlock->write_flag) || (rwlock->num_reader == 0)) {
+        panic("rwlock_tryupgrade: The caller isn't a reader");
+    }
+
+    /* the waiting writers are overtaken, the hold goes on */
+    if (rwlock->num_reader == 1) {
+        rwlock->num_reader = 0;
         rwlock->writer_tid = thr_getid();
         rwlock->write_flag = 1;
+        ret = 0;
+    }
+    mutex_unlock(&(rwlock->mutex));
+    return ret;
+}
 
+/** @brief Turn the caller's read lock into the write lock.
+ *
+ *  The caller takes the upgrader slot, which keeps new readers out, and
+ *  waits for the other readers to leave. It goes ahead of the waiting
+ *  writers, they can't get in before it anyway.
+ *
+ *  Two readers waiting for each other to leave would never wake up, so
+ *  there is only one slot. If it is taken, the caller has to unlock and
+ *  lock for writing instead.
+ *
+ *  @param rwlock The address of rwlock, read locked by the caller.
+ *  @return 0 if the caller holds the write lock now, -1 if another
+ *          reader is upgrading, the caller still holds the read lock then.
+ */
+int rwlock_upgrade(rwlock_t *rwlock) {
+    if (!rwlock) {
+        panic("rwlock_upgrade: The input pointer is null");
+    }
+
+    if (!rwlock->init) {
+        panic("rwlock_upgrade: The rwlock hasn't been intialized");
+    }
+
+    mutex_lock(&(rwlock->mutex));
+    if ((rwlock->write_flag) || (rwlock->num_reader == 0)) {
+        panic("rwlock_upgrade: The caller isn't a reader");
+    }
+
+    if (rwlock->upgrader) {
         mutex_unlock(&(rwlock->mutex));
-        return;
+        return -1;
     }
+
+    /* the last other reader to leave wakes us up */
+    rwlock->upgrader = 1;
+    while (rwlock->num_reader > 1) {
+        cond_wait(&(rwlock->upgrade_cv), &(rwlock->mutex));
+    }
+    rwlock->upgrader = 0;
+
+    /* the hold goes on */
+    rwlock->num_reader = 0;
+    rwlock->writer_tid = thr_getid();
+    rwlock->write_flag = 1;
+
+    mutex_unlock(&(rwlock->mutex));
+    return 0;
 }
 
 /** @brief Notify the waiting threads base on the state of the lock
  *
  *  Depend on if the caller is a reader or writer, this function will have
  *  different operation. If caller thread is last reader, it will signal
- *  the writer if there is any. If the caller thread is the writer and there
- *  is no writer waiting, it should wake up the waiting reader threads. The
- *  threads should come in a FIFO manner based on the current implementation
- *  of conditional variable.
+ *  the writer if there is any, and if only an upgrader is left, it
+ *  signals the upgrader. If the caller thread is the writer, it
+ *  starts a read phase for all the readers waiting, and only if there
+ *  is none it hands the lock to the next writer.
  *
  *  @param rwlock The address of rwlock.
  *  @return Void.
@@ -140,20 +419,24 @@ void rwlock_unlock(rwlock_t *rwlock) {
     if ((rwlock->write_flag) && (rwlock->writer_tid == thr_getid())) {
         /* clear write_flag */
         rwlock->write_flag = 0;
+        LOCKSTAT(lockstat_hold_end(&(rwlock->stat)));
 
-        /* Only when there is no writer is waiting,
-         * other readers can be waked up */
-        if (rwlock->num_wait_writer == 0) {
-            cond_signal(&(rwlock->reader_cv));
-        } else {
+        /* The readers that waited for us go first, then the
+         * next writer */
+        if (!start_read_phase(rwlock) && (rwlock->num_wait_writer > 0)) {
             cond_signal(&(rwlock->writer_cv));
         }
     }
     /* caller thread is reader */
     else {
         rwlock->num_reader--;
+        /* only the upgrader is left */
+        if ((rwlock->num_reader == 1) && (rwlock->upgrader)) {
+            cond_signal(&(rwlock->upgrade_cv));
+        }
         /* now the writer can get in */
-        if (rwlock->num_reader == 0) {
+        else if (rwlock->num_reader == 0) {
+            LOCKSTAT(lockstat_hold_end(&(rwlock->stat)));
             cond_signal(&(rwlock->writer_cv));
         }
     }
@@ -183,15 +466,18 @@ void rwlock_destroy(rwlock_t *rwlock) {
     mutex_destroy(&(rwlock->mutex));
     cond_destroy(&(rwlock->reader_cv));
     cond_destroy(&(rwlock->writer_cv));
+    cond_destroy(&(rwlock->upgrade_cv));
 
     /* now we are safe */
     rwlock->init = 0;
+    LOCKSTAT(lockstat_unregister(&(rwlock->stat)));
     return;
 }
 
 /** @brief Downgrade the thread to reader
  *
- *  This will make the caller thread become reader lock's holder.
+ *  This will make the caller thread become reader lock's holder. The
+ *  readers that were waiting for the caller join it in a read phase.
  *
  *  @param rwlock The address of rwlock.
  *  @return Void.
@@ -217,6 +503,7 @@ void rwlock_downgrade(rwlock_t *rwlock) {
     mutex_lock(&(rwlock->mutex));
     rwlock->write_flag = 0;
     rwlock->num_reader++;
+    start_read_phase(rwlock);
 
     /* now the caller thread is reader */
     mutex_unlock(&(rwlock->mutex));
@@ -3,15 +3,36 @@
  *
  *  This file contains methods for semaphores.
  *
+ *  The count is updated with atomic instructions only. A wait that finds
+ *  enough tokens and a signal that finds nobody waiting never touch the
+ *  mutex. A negative count is the number of tokens the waiters are still
+ *  missing. A signal that brings the count back up from below zero posts
+ *  wakeup permits for the waiters under the mutex, and a waiter sleeps on
+ *  the cv until there are enough permits to cover what it is missing.
+ *
+ *  A wait claims the tokens that are there right away and waits for the
+ *  rest, so later waiters can't take the tokens it claimed. The permits
+ *  are pooled, though, so a later waiter missing one token may go ahead
+ *  of a sem_wait_n still missing several.
+ *
  *  @author Che-Yuan Liang (cheyuanl)
  *  @bug No known bugs.
  */
 
 #include <assert.h> /* panic() */
 #include <cond.h>
+#include <cond_ext.h>
 #include <mutex.h>
 #include <sem_type.h>
+#include <sem_ext.h>
 #include <simics.h>
+#include <syscall.h>
+#include <thr_internals.h>
+
+/* Internal helper functions */
+static int sem_claim(sem_t *sem, int n);
+static void sem_sleep(sem_t *sem, int need);
+static void sem_post(sem_t *sem, int old, int n);
 
 /** @brief Initialize the semaphore
  *
@@ -43,7 +64,10 @@ int sem_init(sem_t *sem, int count) {
     }
 
     sem->count = count;
+    sem->wakeups = 0;
+    sem->nbatch = 0;
     sem->init = 1;
+    LOCKSTAT(lockstat_register(&(sem->stat), sem, "sem"));
 
     return 0;
 }
@@ -66,12 +90,17 @@ void sem_destroy(sem_t *sem) {
         panic("sem_destroy: The semaphore hasn't been initialized");
     }
 
+    if (sem->count < 0) {
+        panic("sem_destroy: Some threads are still waiting");
+    }
+
     /* delegate condition checking to cv and mutex */
     cond_destroy(&(sem->cv));
     mutex_destroy(&(sem->mutex));
 
     /* now we are safe */
     sem->init = 0;
+    LOCKSTAT(lockstat_unregister(&(sem->stat)));
 }
 
 /** @brief Wait until the count is greater than zero
@@ -81,6 +110,15 @@ void sem_destroy(sem_t *sem) {
  *  @param sem The address of semaphore.
  */
 void sem_wait(sem_t *sem) {
+    sem_wait_n(sem, 1);
+}
+
+/** @brief Take n tokens, waiting until they are there
+ *
+ *  @param sem The address of semaphore.
+ *  @param n The number of tokens, 0 returns right away.
+ */
+void sem_wait_n(sem_t *sem, int n) {
     /* check illegal calls */
     if (!sem) {
         panic("sem_wait: The input pointer in null");
@@ -90,17 +128,108 @@ void sem_wait(sem_t *sem) {
         panic("sem_wait: The semaphore hasn't been initialized");
     }
 
+    if (n < 0) {
+        panic("sem_wait: Invalid number of tokens %d", n);
+    }
+
+    int need = sem_claim(sem, n);
+    if (need > 0) {
+        mutex_lock(&(sem->mutex));
+        sem_sleep(sem, need);
+        mutex_unlock(&(sem->mutex));
+    }
+
+    return;
+}
+
+/** @brief Take a token only if there is one
+ *
+ *  @param sem The address of semaphore.
+ *  @return 0 if we took a token, -1 if the count was not positive.
+ */
+int sem_trywait(sem_t *sem) {
+    /* check illegal calls */
+    if (!sem) {
+        panic("sem_trywait: The input pointer in null");
+    }
+
+    if (!sem->init) {
+        panic("sem_trywait: The semaphore hasn't been initialized");
+    }
+
+    int count = sem->count;
+    while (count > 0) {
+        int old = cmpxchg_wrapper(&(sem->count), count, count - 1);
+        if (old == count) {
+            LOCKSTAT(xadd_wrapper((int *)&(sem->stat.acquired)));
+            return 0;
+        }
+        count = old;
+    }
+
+    return -1;
+}
+
+/** @brief Wait until the count is greater than zero, or a deadline
+ *
+ *  When the deadline comes, we give back the part of our claim no signal
+ *  has covered yet. The part some signal did cover is a permit on its
+ *  way, which we take and give back as a token.
+ *
+ *  @param sem The address of semaphore.
+ *  @param ticks The deadline, in get_ticks() units.
+ *  @return 0 if we decreased the count, -1 if the deadline came first.
+ */
+int sem_timedwait(sem_t *sem, unsigned int ticks) {
+    /* check illegal calls */
+    if (!sem) {
+        panic("sem_timedwait: The input pointer in null");
+    }
+
+    if (!sem->init) {
+        panic("sem_timedwait: The semaphore hasn't been initialized");
+    }
+
+    if (sem_claim(sem, 1) == 0) {
+        return 0;
+    }
+
     mutex_lock(&(sem->mutex));
 
-    while (sem->count <= 0) {
-        /* go to sleep */
-        cond_wait(&(sem->cv), &(sem->mutex));
+    int parks = 0;
+    while (sem->wakeups == 0) {
+        /* go to sleep, a permit may still have come in as we time out */
+        if (cond_timedwait(&(sem->cv), &(sem->mutex), ticks) < 0 &&
+            sem->wakeups == 0) {
+            break;
+        }
+        parks++;
     }
-    sem->count--;
+
+    /* timed out, take our claim back while no signal has covered it */
+    if (sem->wakeups == 0) {
+        int count = sem->count;
+        while (count < 0) {
+            int old = cmpxchg_wrapper(&(sem->count), count, count + 1);
+            if (old == count) {
+                mutex_unlock(&(sem->mutex));
+                return -1;
+            }
+            count = old;
+        }
+        /* too late, a permit for us is on its way */
+        while (sem->wakeups == 0) {
+            cond_wait(&(sem->cv), &(sem->mutex));
+        }
+    }
+    sem->wakeups--;
+    LOCKSTAT(xadd_wrapper((int *)&(sem->stat.acquired)));
+    LOCKSTAT(sem->stat.contended++);
+    LOCKSTAT(sem->stat.parks += parks);
 
     mutex_unlock(&(sem->mutex));
 
-    return;
+    return 0;
 }
 
 /** @brief Signal the threads waiting on this semaphore
@@ -108,22 +237,107 @@ void sem_wait(sem_t *sem) {
  *  @param sem The address of semaphore.
  */
 void sem_signal(sem_t *sem) {
+    sem_signal_n(sem, 1);
+}
+
+/** @brief Give n tokens back, waking up the waiters they cover at once
+ *
+ *  @param sem The address of semaphore.
+ *  @param n The number of tokens, 0 returns right away.
+ */
+void sem_signal_n(sem_t *sem, int n) {
     /* check illegal calls */
     if (!sem) {
-        panic("sem_wait: The input pointer in null");
+        panic("sem_signal: The input pointer in null");
     }
 
     if (!sem->init) {
-        panic("sem_wait: The semaphore hasn't been initialized");
+        panic("sem_signal: The semaphore hasn't been initialized");
+    }
+
+    if (n < 0) {
+        panic("sem_signal: Invalid number of tokens %d", n);
+    }
+
+    int old = xaddn_wrapper(&(sem->count), n);
+    /* somebody is missing tokens */
+    if (old < 0 && n > 0) {
+        sem_post(sem, old, n);
+    }
+
+    return;
+}
+
+/*****************************/
+/* Internal helper functions */
+/*****************************/
+
+/** @brief Take n tokens off the count.
+ *
+ *  @param sem The address of semaphore.
+ *  @param n The number of tokens.
+ *  @return The number of tokens that were not there, which we have to
+ *          wait for. The acquisition is counted only if that is 0, the
+ *          waiters count theirs once they have all the tokens.
+ */
+static int sem_claim(sem_t *sem, int n) {
+    int old = xaddn_wrapper(&(sem->count), -n);
+
+    if (old >= n) {
+        LOCKSTAT(xadd_wrapper((int *)&(sem->stat.acquired)));
+        return 0;
     }
+    return old > 0 ? n - old : n;
+}
+
+/** @brief Sleep until need permits are posted, and take them.
+ *
+ *  @note Caller must hold sem->mutex.
+ *
+ *  @param sem The address of semaphore.
+ *  @param need The number of permits.
+ *  @return Void.
+ */
+static void sem_sleep(sem_t *sem, int need) {
+    int parks = 0;
+
+    /* a batch waiter can't be served by cond_signal alone */
+    if (need > 1) {
+        sem->nbatch++;
+    }
+    while (sem->wakeups < need) {
+        /* go to sleep */
+        cond_wait(&(sem->cv), &(sem->mutex));
+        parks++;
+    }
+    if (need > 1) {
+        sem->nbatch--;
+    }
+    sem->wakeups -= need;
+    LOCKSTAT(xadd_wrapper((int *)&(sem->stat.acquired)));
+    LOCKSTAT(sem->stat.contended++);
+    LOCKSTAT(sem->stat.parks += parks);
+}
+
+/** @brief Post permits for the waiters a signal covered.
+ *
+ *  @param sem The address of semaphore.
+ *  @param old The count before the signal, below zero.
+ *  @param n The number of tokens signaled.
+ *  @return Void.
+ */
+static void sem_post(sem_t *sem, int old, int n) {
+    int permits = (n < -old) ? n : -old;
 
     mutex_lock(&(sem->mutex));
 
-    sem->count++;
-    /* signal the threads waiting on this semaphore */
-    cond_signal(&(sem->cv));
+    sem->wakeups += permits;
+    /* one permit, one single waiter, wake up just one */
+    if (permits == 1 && sem->nbatch == 0) {
+        cond_signal(&(sem->cv));
+    } else {
+        cond_broadcast(&(sem->cv));
+    }
 
     mutex_unlock(&(sem->mutex));
-
-    return;
 }
@@ -0,0 +1,157 @@
+/** @file seqlock.c
+ *  @brief Implementation of sequence lock.
+ *
+ *  Writers take the mutex and bump seq before and after they write, so
+ *  seq is odd while a write is in progress. Readers take no lock and
+ *  write nothing shared: they read seq, copy the data, and read seq
+ *  again. If seq was odd or has moved, a writer ran alongside and the
+ *  copy may be torn, so the reader copies again.
+ *
+ *  x86 keeps loads in order with loads and stores in order with stores.
+ *  So a reader that reads the same even seq before and after its copy
+ *  read no store of a later write, and every store of the write that
+ *  made seq that value. The calls into this file keep the compiler from
+ *  moving the copy across them.
+ *
+ *  Readers may starve under a stream of writers, this is meant for small
+ *  data that is written rarely.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <simics.h> /* lprintf() */
+#include <assert.h> /* panic() */
+#include <syscall.h> /* yield() */
+#include <mutex.h>
+#include <seqlock.h>
+#include <thr_internals.h>
+
+/** @brief Initialize the seqlock
+ *
+ *  This should be only called once before calling other
+ *  seqlock methods. The seqlock could be re-init after it is
+ *  successfully destroyed.
+ *
+ *  @param sl Address of seqlock.
+ *  @return 0 on success, -1 on error.
+ */
+int seqlock_init(seqlock_t *sl) {
+    /* check null pointer */
+    if (!sl) {
+        lprintf("Input seqlock is null");
+        return -1;
+    }
+    if (mutex_init(&(sl->mutex)) < 0) {
+        lprintf("Cannot initialize the mutex in seqlock");
+        return -1;
+    }
+
+    sl->seq = 0;
+    sl->init = 1;
+
+    return 0;
+}
+
+/** @brief Start a read section.
+ *
+ *  Waits for a write in progress to end.
+ *
+ *  @param sl The address of seqlock.
+ *  @return The sequence number to pass to seqlock_read_retry().
+ */
+int seqlock_read_begin(seqlock_t *sl) {
+    int seq;
+
+    if (!sl) {
+        panic("seqlock_read_begin: The input pointer is null");
+    }
+
+    if (!sl->init) {
+        panic("seqlock_read_begin: The seqlock hasn't been initialized");
+    }
+
+    /* the writer holds the mutex for a short while, let it finish */
+    while ((seq = sl->seq) & 1) {
+        yield(-1);
+    }
+
+    return seq;
+}
+
+/** @brief End a read section.
+ *
+ *  @param sl The address of seqlock.
+ *  @param seq The return value of the seqlock_read_begin().
+ *  @return 1 if a writer ran since seqlock_read_begin() and the read
+ *          has to be done again, 0 if what was read is consistent.
+ */
+int seqlock_read_retry(seqlock_t *sl, int seq) {
+    if (!sl) {
+        panic("seqlock_read_retry: The input pointer is null");
+    }
+
+    return sl->seq != seq;
+}
+
+/** @brief Acquire the lock for writing.
+ *
+ *  @param sl The address of seqlock.
+ *  @return Void.
+ */
+void seqlock_write_lock(seqlock_t *sl) {
+    if (!sl) {
+        panic("seqlock_write_lock: The input pointer is null");
+    }
+
+    if (!sl->init) {
+        panic("seqlock_write_lock: The seqlock hasn't been initialized");
+    }
+
+    mutex_lock(&(sl->mutex));
+    /* odd, readers may not trust what they read from now on */
+    xaddn_wrapper(&(sl->seq), 1);
+}
+
+/** @brief Release the lock for writing.
+ *
+ *  @param sl The address of seqlock.
+ *  @return Void.
+ */
+void seqlock_write_unlock(seqlock_t *sl) {
+    if (!sl) {
+        panic("seqlock_write_unlock: The input pointer is null");
+    }
+
+    if (!(sl->seq & 1)) {
+        panic("seqlock_write_unlock: The seqlock isn't write locked");
+    }
+
+    /* even again, after all the stores of this write */
+    xaddn_wrapper(&(sl->seq), 1);
+    mutex_unlock(&(sl->mutex));
+}
+
+/** @brief Destroy the seqlock.
+ *
+ *  @note Only after this instruction is done, the seqlock
+ *        can be called init again.
+ *
+ *  @param sl The address of seqlock.
+ *  @return Void.
+ */
+void seqlock_destroy(seqlock_t *sl) {
+    if (!sl) {
+        panic("seqlock_destroy: The input pointer is null");
+    }
+
+    if (!sl->init) {
+        panic("seqlock_destroy: The seqlock hasn't been initialized");
+    }
+
+    if (sl->seq & 1) {
+        panic("seqlock_destroy: The seqlock is write locked");
+    }
+
+    mutex_destroy(&(sl->mutex));
+    sl->init = 0;
+}
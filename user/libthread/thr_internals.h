@@ -8,6 +8,7 @@
 #define THR_INTERNALS_H
 
 #include <cond_type.h>
+#include <lockstat_type.h>
 #include <mutex_type.h>
 
 /** @brief Round down the bits to page size */
@@ -28,9 +29,73 @@ void *thr_stk_head;
 /** @brief The current thread stack address to be allocated */
 void *thr_stk_curr;
 
+/** @brief Default number of joined thread stacks kept mapped for reuse */
+#define THR_STK_CACHE_MAX 16
+
+/** @brief The number of joined thread stacks kept mapped for reuse.
+ *
+ *  Starts as THR_STK_CACHE_MAX. Programs may tune it after thr_init(),
+ *  0 unmaps every stack at join time.
+ */
+extern int thr_stk_cache_max;
+
 /** @brief Used for malloc lock */
 mutex_t malloc_mp;
 
+/** @brief Used for the pages and the list of live object pools, see
+ *  pool.c */
+mutex_t pool_mp;
+
+/** @brief Sleep/wakeup handshake between one waiter and one waker
+ *
+ *  The waiter sleeps in deschedule(&reject), the waker sets reject and
+ *  only calls make_runnable() if the waiter has announced it is asleep.
+ *  The waiter does not leave park_wait() until the waker is done with
+ *  the structure, so a late make_runnable() can never hit a later sleep.
+ */
+typedef struct park {
+    int reject; /* deschedule() reject flag, set by the waker */
+    int asleep; /* set by the waiter before it calls deschedule() */
+    int done;   /* set by the waker after its last touch of this struct */
+    int ktid;   /* kernel tid of the waiter */
+} park_t;
+
+/** @brief The number of thread-local storage keys */
+#define THR_KEYS_MAX 32
+
+/** @brief Rounds of destructor calls at thr_exit, see thr_key_run_dtors */
+#define THR_KEY_DTOR_ROUNDS 4
+
+/** @brief Read-mostly locks a thread can read-hold on the fast path */
+#define THR_RM_SLOTS 4
+
+/** @brief Size classes of small blocks cached per thread, see malloc.c */
+#define MALLOC_NCLASSES 5
+
+/** @brief Object pools a thread can cache free objects of, see pool.c */
+#define THR_POOL_SLOTS 4
+
+/** @brief A thread's free objects of one pool */
+typedef struct pool_cache {
+    void *pool;         /* the pool, NULL if the slot is unused */
+    int gen;            /* the pool's generation when the slot was claimed */
+    void *head;         /* the objects, linked through their first word */
+    int len;            /* the number of objects */
+} pool_cache_t;
+
+/** @brief A waiter parked on a mutex, queued in ticket order
+ *
+ *  A timed waiter that gives up leaves an abandoned node behind, so
+ *  mutex_unlock knows to skip its ticket.
+ */
+typedef struct mutex_node mutex_node_t;
+struct mutex_node {
+    int ticket;         /* the ticket held by this waiter */
+    int abandoned;      /* the waiter is gone, the node is malloc'd */
+    park_t park;        /* where this waiter sleeps */
+    mutex_node_t *next; /* next parked waiter, with a larger ticket */
+};
+
 /** @brief The state of thread */
 typedef enum thr_state {
     /* still installing the handler */
@@ -52,27 +117,133 @@ struct thr_stk_t {
     void *func;         /* child thread's wrapper function */
     void *args;         /* args for the child function */
     thr_stk_t *cv_next; /* pointer to next thread in the cv chain */
-    thr_stk_t *next;    /* pointer to next thread in thread list */
-    thr_stk_t *prev;    /* pointer to prev thread in thread list */
+    mutex_node_t cv_node; /* where this thread sleeps in cond_wait, and
+                             its place in the mutex queue once morphed */
+    mutex_t *cv_mp;     /* the mutex passed to cond_wait */
+    int cv_morphed;     /* woken up by the mutex, already holding it */
+    thr_stk_t *next;    /* pointer to next thread in table bucket */
+    thr_stk_t *prev;    /* pointer to prev thread in table bucket */
     int utid;           /* thread id from user's perspective */
     int ktid;           /* thread id from kernel's perspective */
     thr_state_t state;  /* state of this thread */
+    park_t start;       /* the gate the child waits at until it is set up */
     void *exit_status;  /* exit status place holder when thr_exit called */
     mutex_t mp;         /* mutex for this structure */
     cond_t cv;          /* conditional variable for this structure */
     int join_flag;      /* indicate if this thread is called by thr_join */
-    int zero;           /* the value indicates the ebp of begin of stack */
+    int join_waiters;   /* the number of joiners sleeping on cv */
+    int detached;       /* nobody joins it, it cleans up after itself */
+    int zombie;         /* set while in the zombie queue */
+    thr_stk_t *zombie_next; /* next thread in the zombie queue */
+    thr_stk_t *zombie_prev; /* prev thread in the zombie queue */
+    thr_stk_t *reclaim_next; /* next detached thread to reclaim */
+    void *tls[THR_KEYS_MAX]; /* thread-local values, indexed by key */
+    void *rm_slot[THR_RM_SLOTS]; /* rmlocks read-held, see rmlock.c */
+    void *mcache[MALLOC_NCLASSES]; /* free small blocks, see malloc.c */
+    int mcache_len[MALLOC_NCLASSES]; /* the number of blocks in mcache */
+    pool_cache_t pcache[THR_POOL_SLOTS]; /* free pool objects, see pool.c */
+    int pcache_seen;    /* pool destroys counted when pcache was checked */
+    int mcache_off;     /* set once the thread exits, frees skip the caches */
+    int vanished;       /* set right before the thread vanishes */
+    int zero;           /* the initial ebp of the thread, ends the ebp chain */
 };
 
-/** @brief xchg instruction wrapper */
+/** @brief Default number of spins in mutex_lock() before the waiter parks */
+#define MUTEX_SPIN_LIMIT 1024
+
+/** @brief The number of spins before a contended mutex_lock() parks.
+ *
+ *  Starts as MUTEX_SPIN_LIMIT. Programs may tune it after thr_init(),
+ *  0 means park right away.
+ */
+extern int mutex_spin_limit;
+
+/** @brief Default barrier size up to which a barrier is a single counter */
+#define BARRIER_TREE_MIN 8
+
+/** @brief Barriers for more threads than this are trees, see barrier.c.
+ *
+ *  Starts as BARRIER_TREE_MIN. Programs may tune it before barrier_init().
+ */
+extern int barrier_tree_min;
+
+/** @brief The longest the timer thread sleeps before it looks again */
+#define TIMER_MAX_SLEEP 5
+
+/** @brief A deadline served by the timer thread, see timer.c */
+typedef struct thr_timer thr_timer_t;
+struct thr_timer {
+    unsigned int when;  /* deadline, in get_ticks() units */
+    void (*fire)(thr_timer_t *t); /* called on the timer thread */
+    void *arg;          /* for fire */
+    int idx;            /* slot in the timer heap, -1 if not in the heap */
+    int firing;         /* set while fire is running */
+};
+
+/** @brief xadd instruction wrapper */
 int xadd_wrapper(int *ticket);
 
+/** @brief xchg instruction wrapper */
+int xchg_wrapper(int *lock, int val);
+
+/** @brief xadd instruction wrapper adding an arbitrary value */
+int xaddn_wrapper(int *counter, int val);
+
+/** @brief cmpxchg instruction wrapper, returns the old value */
+int cmpxchg_wrapper(int *target, int expected, int val);
+
+/** @brief Prepare a park for the waiter with kernel tid ktid */
+void park_init(park_t *pk, int ktid);
+
+/** @brief Sleep until someone calls park_wake() on pk */
+void park_wait(park_t *pk);
+
+/** @brief Wake up the waiter sleeping (or about to sleep) on pk */
+void park_wake(park_t *pk);
+
 /** @brief Get the pointer to this thread stack structure */
 thr_stk_t *get_thr_stk();
 
+/** @brief Check if pred holds for any thread in the thread table */
+int thr_tbl_any(int (*pred)(thr_stk_t *thr_stk, void *arg), void *arg);
+
+/** @brief Give an exiting thread's cached blocks back to the heap */
+void malloc_cache_flush(thr_stk_t *thr_stk);
+
+/** @brief Give an exiting thread's cached pool objects back to the pools */
+void pool_cache_flush(thr_stk_t *thr_stk);
+
+/** @brief Call the key destructors on an exiting thread's values */
+void thr_key_run_dtors(thr_stk_t *thr_stk);
+
+/** @brief Initialize the timer service */
+int timer_init(void);
+
+/** @brief Call t->fire on the timer thread once t->when has come */
+int timer_add(thr_timer_t *t);
+
+/** @brief Disarm t, and wait if it is firing right now */
+void timer_cancel(thr_timer_t *t);
+
 /** @brief Install handler for multi-threaded program */
 void install_handler(void);
 
 int mutex_underlocked(mutex_t *mp);
 
+/** @brief Queue a sleeping thread for the mutex, it wakes up holding it */
+void mutex_requeue(mutex_t *mp, mutex_node_t *node);
+
+#ifdef THR_LOCKSTATS
+/** @brief Run a lock statistics hook, only in THR_LOCKSTATS builds */
+#define LOCKSTAT(hook) do { hook; } while (0)
+
+void lockstat_register(lockstat_t *ls, void *lock, const char *kind);
+void lockstat_unregister(lockstat_t *ls);
+void lockstat_acquired(lockstat_t *ls, int spins, int parks);
+void lockstat_hold_begin(lockstat_t *ls);
+void lockstat_hold_end(lockstat_t *ls);
+#else
+#define LOCKSTAT(hook) do { } while (0)
+#endif /* THR_LOCKSTATS */
+
 #endif /* THR_INTERNALS_H */
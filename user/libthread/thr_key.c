@@ -0,0 +1,112 @@
+/** @file thr_key.c
+ *  @brief Thread-local storage.
+ *
+ *  A key is an index into the tls array of every thread's thr_stk_t, so
+ *  thr_getspecific() and thr_setspecific() are a get_thr_stk() and one
+ *  load or store. Keys are handed out by bumping a counter and are never
+ *  recycled, there are at most THR_KEYS_MAX of them.
+ *
+ *  When a thread exits, the destructor of every key is called on the
+ *  thread's non-NULL values, before joiners can see the thread exited.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+
+#include <stddef.h>
+#include <thread_ext.h>
+#include <thr_internals.h>
+
+/** @brief The number of keys handed out so far, may exceed THR_KEYS_MAX */
+static int thr_nkeys = 0;
+
+/** @brief The destructor of each key, NULL if it has none */
+static void (*thr_key_dtor[THR_KEYS_MAX])(void *);
+
+/** @brief Create a key for thread-local values.
+ *
+ *  The value of the new key is NULL in every thread.
+ *
+ *  @param keyp Where to store the key.
+ *  @param destructor Called with the value of a thread that exits with a
+ *         non-NULL value, may be NULL.
+ *  @return 0 on success, -1 if keyp is NULL or all keys are used.
+ */
+int thr_key_create(int *keyp, void (*destructor)(void *)) {
+    if (keyp == NULL) {
+        return -1;
+    }
+
+    int key = xaddn_wrapper(&thr_nkeys, 1);
+    if (key >= THR_KEYS_MAX) {
+        return -1;
+    }
+
+    /* no thread can hold a value for key yet, so no exiting thread
+     * looks at this destructor before we return */
+    thr_key_dtor[key] = destructor;
+    *keyp = key;
+    return 0;
+}
+
+/** @brief Get the calling thread's value of a key.
+ *
+ *  @param key A key from thr_key_create().
+ *  @return The value, NULL if it was never set or key is invalid.
+ */
+void *thr_getspecific(int key) {
+    if (key < 0 || key >= THR_KEYS_MAX || key >= thr_nkeys) {
+        return NULL;
+    }
+    return get_thr_stk()->tls[key];
+}
+
+/** @brief Set the calling thread's value of a key.
+ *
+ *  @param key A key from thr_key_create().
+ *  @param value The new value.
+ *  @return 0 on success, -1 if key is invalid.
+ */
+int thr_setspecific(int key, const void *value) {
+    if (key < 0 || key >= THR_KEYS_MAX || key >= thr_nkeys) {
+        return -1;
+    }
+    get_thr_stk()->tls[key] = (void *)value;
+    return 0;
+}
+
+/** @brief Run the destructors of an exiting thread.
+ *
+ *  A destructor may set values again, so we go over the keys up to
+ *  THR_KEY_DTOR_ROUNDS times. Every value is cleared before its
+ *  destructor is called.
+ *
+ *  @param thr_stk The exiting thread, must be the caller.
+ *  @return Void.
+ */
+void thr_key_run_dtors(thr_stk_t *thr_stk) {
+    int nkeys = thr_nkeys;
+    int round, key, again;
+
+    if (nkeys > THR_KEYS_MAX) {
+        nkeys = THR_KEYS_MAX;
+    }
+
+    for (round = 0; round < THR_KEY_DTOR_ROUNDS; round++) {
+        again = 0;
+        for (key = 0; key < nkeys; key++) {
+            void *value = thr_stk->tls[key];
+            void (*dtor)(void *) = thr_key_dtor[key];
+
+            if (value == NULL || dtor == NULL) {
+                continue;
+            }
+            thr_stk->tls[key] = NULL;
+            dtor(value);
+            again = 1;
+        }
+        if (!again) {
+            break;
+        }
+    }
+}
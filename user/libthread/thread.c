@@ -5,10 +5,7 @@
  *  and implementation of API for libthread.
  *
  *  @author Che-Yuan Liang (cheyuanl)
- *  @bug Currently we don't reuse the same stack address. Althouth the stack
- *  memory will be removed properly. The thread stack's starting point  will
- *  keep decreasing, until it hits brk.
- *  Also, we didn't check if the currently tid is duplicated, since it
+ *  @bug We didn't check if the currently tid is duplicated, since it
  *  is not likely to overflow the global_tid in the life time of a program..
  */
 
@@ -20,7 +17,9 @@
 #include <syscall.h>
 #include <thr_internals.h>
 #include <thread.h>
+#include <thread_ext.h>
 #include <stddef.h>
+#include <malloc.h> /* malloc(), free() */
 
 /** @brief Define esp align */
 #define ESP_ALIGN 4
@@ -30,16 +29,6 @@
 /** @brief The next utid to be issued */
 static int global_utid = 0;
 
-/** @brief Record the kernel tid of main(legacy) thread
- *
- *  This variable should be set when thr_init() is called.
- *  The purpose is to retrieve the main_thr_stk differently than what we do for
- *  normal thread's thr_stk_t.
- *  The underlying assumption is that thr_init will only be called once by
- *  the main thread.
- */
-static int main_thr_ktid;
-
 /** @brief The size of a thread stack
  *
  * This variable should be set once when thr_init is called.
@@ -47,20 +36,78 @@ static int main_thr_ktid;
  */
 static int stk_size;
 
-/** @brief The head of linked-list pointing to threads being created. */
-static thr_stk_t *head = NULL;
+/** @brief The size of the address range reserved for each thread stack
+ *
+ * This is stk_size rounded up to a power of 2, and every thread stack
+ * range is aligned to it. The header of a thread can then be found by
+ * rounding any address on its stack up to stk_slot. Only the top
+ * stk_size bytes of each range are mapped.
+ */
+static unsigned int stk_slot;
+
+/** @brief The number of joined stacks kept mapped for reuse */
+int thr_stk_cache_max = THR_STK_CACHE_MAX;
+
+/** @brief Joined thread stacks that are still mapped, linked by next.
+ *  Protected by create_mp. */
+static thr_stk_t *stk_cache = NULL;
+
+/** @brief The number of stacks in stk_cache */
+static int stk_cache_len = 0;
+
+/** @brief An unmapped stack range below thr_stk_curr */
+typedef struct stk_hole stk_hole_t;
+struct stk_hole {
+    void *hi;         /* the top of the range */
+    stk_hole_t *next; /* next unmapped range */
+};
+
+/** @brief Unmapped stack ranges to be reused before thr_stk_curr moves
+ *  down again. Protected by create_mp. */
+static stk_hole_t *stk_holes = NULL;
 
-/** @brief Lock to sync thr_create and the newly created child thread */
-static mutex_t fork_mp;
+/** @brief Detached threads that exited, linked by reclaim_next, since
+ *  joiners may still walk their next links. Their stacks go
+ *  back to the allocator once they have vanished. Protected by create_mp.
+ */
+static thr_stk_t *reclaim_list = NULL;
+
+/** @brief Exited threads nobody has joined yet, oldest first.
+ *
+ *  thr_exit appends joinable threads, and whoever takes a thread out of
+ *  the queue owns it and reaps it. thr_join, thr_join_any and thr_detach
+ *  all claim a dead thread this way, so only one of them gets it.
+ *  Protected by zombie_mp, lock order is thr_stk->mp -> zombie_mp.
+ */
+static thr_stk_t *zombie_head = NULL;
+static thr_stk_t *zombie_tail = NULL;
+static mutex_t zombie_mp;
+/** @brief Signaled when a thread is appended to the zombie queue */
+static cond_t zombie_cv;
+
+/** @brief The number of buckets in the thread table, a power of 2 */
+#define THR_TBL_SIZE 1024
+
+/** @brief Map a utid to its bucket in the thread table */
+#define THR_TBL_HASH(utid) ((utid) & (THR_TBL_SIZE - 1))
+
+/** @brief The thread table, indexed by utid.
+ *
+ *  Each bucket is a doubly linked list chained through thr_stk->next
+ *  and thr_stk->prev. utids are issued sequentially, so consecutive
+ *  threads land in different buckets and the chains stay short.
+ */
+static thr_stk_t *thr_tbl[THR_TBL_SIZE];
 
-/** @brief CV to sync thr_create and the newly created child thread  */
-static cond_t fork_cv;
+/** @brief The number of lock-free readers walking each thread table
+ *  bucket */
+static int thr_tbl_readers[THR_TBL_SIZE];
 
-/** @brief Lock to make sure thr_create is sequential */
+/** @brief Lock for the thread stack allocator */
 static mutex_t create_mp;
 
-/** @brief Lock to sync thread linked-list operation */
-static mutex_t thr_stk_list_mp;
+/** @brief Locks to serialize the writers of each thread table bucket */
+static mutex_t thr_tbl_mp[THR_TBL_SIZE];
 
 /** @breif Lock for join operation */
 static mutex_t join_mp;
@@ -75,128 +122,178 @@ static mutex_t join_mp;
  */
 thr_stk_t main_thr_stk;
 
-/* -- Utilities for linked list -- */
+/* -- Utilities for thread table -- */
 
 /*  @note There are three utilities find/insert/remove.
- *        Only one thread thread can execute one of three
- *        function at a time.
+ *        Insert and remove are serialized by the bucket's thr_tbl_mp,
+ *        so creators of different threads don't wait for each other.
+ *        Find takes no lock. A reader either holds join_mp, which keeps
+ *        the jointee's stack mapped, or brackets its find and the use of
+ *        the result with thr_tbl_read_begin/end on the utid's bucket.
  */
 
-/** @brief Serach for utid in thread list.
+/** @brief Enter a lock-free read section of a thread table bucket.
  *
- *  Search if the utid is in the thread list.
+ *  thr_remove waits for the read sections of its bucket to end, so the
+ *  thr_stk found inside one stays mapped until thr_tbl_read_end. Readers
+ *  of other buckets don't hold it up.
+ *
+ *  @param h The bucket.
+ *  @return Void.
+ */
+static void thr_tbl_read_begin(int h) {
+    xaddn_wrapper(&thr_tbl_readers[h], 1);
+}
+
+/** @brief Leave a lock-free read section of a thread table bucket.
+ *
+ *  @param h The bucket.
+ *  @return Void.
+ */
+static void thr_tbl_read_end(int h) {
+    xaddn_wrapper(&thr_tbl_readers[h], -1);
+}
+
+/** @brief Serach for utid in thread table.
+ *
+ *  Search if the utid is in the thread table. Only the utid's bucket is
+ *  walked. Writers publish a thr_stk only after its links are set up, and
+ *  a removed thr_stk keeps its next link, so no lock is needed here.
  *
  *  @param utid The user thread id issued by libthread.
  *  @return The address of utid's header struct. If not found, return NULL.
  */
 static thr_stk_t *thr_find(int utid) {
-    /* begin critical section */
-    mutex_lock(&thr_stk_list_mp);
+    thr_stk_t *curr_thr_stk = thr_tbl[THR_TBL_HASH(utid)];
 
-    /* rraverse from head */
-    thr_stk_t *curr_thr_stk = head;
     while (curr_thr_stk != NULL) {
         /* utid was found */
         if (curr_thr_stk->utid == utid) {
-            /* dnd critical section */
-            mutex_unlock(&thr_stk_list_mp);
             return curr_thr_stk;
         }
         curr_thr_stk = curr_thr_stk->next;
     }
 
-    /* dnd critical section */
-    mutex_unlock(&thr_stk_list_mp);
     /* utid was not found */
     return NULL;
 }
 
-/** @brief Insert utid to list.
+/** @brief Insert utid to table.
  *
  *  @param thr_stk Address of thr_stk.
  *  @return -1 if the input thr_stk is NULL.
  *             else it should success and return 0.
  */
 static int thr_insert(thr_stk_t *thr_stk) {
-    /* begin critical section */
-    mutex_lock(&thr_stk_list_mp);
-
     /* check pointer */
     if (thr_stk == NULL) {
-        /* end critical section */
-        mutex_unlock(&thr_stk_list_mp);
         return -1;
     }
 
     /* the thread should still in THR_UNRUNNABLE state */
     assert(thr_stk->state == THR_UNRUNNABLE);
 
-    /* no threads in the list */
-    if (head == NULL) {
-        head = thr_stk;
-    }
-    /* insert */
-    else {
-        /* set next */
-        thr_stk->next = head->next;
-        head->next = thr_stk;
-
-        /* set prev */
-        thr_stk->prev = head;
-        if (thr_stk->next) {
-            thr_stk->next->prev = thr_stk;
-        }
+    int h = THR_TBL_HASH(thr_stk->utid);
+    thr_stk_t **bucket = &thr_tbl[h];
+
+    /* begin critical section */
+    mutex_lock(&thr_tbl_mp[h]);
+
+    /* set up the links before the thr_stk becomes visible */
+    thr_stk->next = *bucket;
+    thr_stk->prev = NULL;
+    if (thr_stk->next) {
+        thr_stk->next->prev = thr_stk;
     }
+    /* publish */
+    *bucket = thr_stk;
 
     /* end critical section */
-    mutex_unlock(&thr_stk_list_mp);
+    mutex_unlock(&thr_tbl_mp[h]);
     return 0;
 }
 
-/** @brief Delete utid's thr_stk from thread list.
+/** @brief Delete utid's thr_stk from thread table.
+ *
+ *  When this returns, no lock-free reader can still see the thr_stk,
+ *  so the caller is free to unmap it.
  *
  *  @param thr_stk Address of thr_stk with utid.
  *  @return -1 thr_stk is empty, else success and return 0.
  *
 */
 static int thr_remove(thr_stk_t *thr_stk) {
-    /* begin critical section */
-    mutex_lock(&thr_stk_list_mp);
-
     /* nuul pointer */
     if (thr_stk == NULL) {
-        /* end critical section */
-        mutex_unlock(&thr_stk_list_mp);
         return -1;
     }
 
-    /* utid is the only element */
-    if (thr_stk == head) {
-        head = NULL;
-        /* end critical section */
-        mutex_unlock(&thr_stk_list_mp);
-        return 0;
-    }
+    int h = THR_TBL_HASH(thr_stk->utid);
+
+    /* begin critical section */
+    mutex_lock(&thr_tbl_mp[h]);
 
-    /* utid is the first element in list */
+    /* unlink, but leave thr_stk->next for readers standing on it */
     if (thr_stk->prev == NULL) {
-        head = thr_stk->next;
-        if (thr_stk->next) {
-            thr_stk->next->prev = NULL;
-        }
+        thr_tbl[h] = thr_stk->next;
     } else {
         thr_stk->prev->next = thr_stk->next;
-        if (thr_stk->next) {
-            thr_stk->next->prev = thr_stk->prev;
-        }
     }
+    if (thr_stk->next) {
+        thr_stk->next->prev = thr_stk->prev;
+    }
+
     /* end critical section */
-    mutex_unlock(&thr_stk_list_mp);
+    mutex_unlock(&thr_tbl_mp[h]);
+
+    /* wait for the readers of the bucket that might have seen it */
+    while (thr_tbl_readers[h] > 0) {
+        yield(-1);
+    }
     return 0;
 }
 
+/** @brief Check if pred holds for any thread in the thread table.
+ *
+ *  Walks each bucket in a lock-free read section of its own, so the
+ *  thr_stk passed to pred stays mapped while pred looks at it, and an
+ *  exiting thread only waits for the walk to leave its bucket. Threads
+ *  created or exiting during the walk may or may not be seen.
+ *
+ *  @param pred Called on each thread until it returns non-zero.
+ *  @param arg Passed to pred.
+ *  @return 1 if pred returned non-zero for some thread, else 0.
+ */
+int thr_tbl_any(int (*pred)(thr_stk_t *thr_stk, void *arg), void *arg) {
+    thr_stk_t *curr_thr_stk;
+    int i, found = 0;
+
+    for (i = 0; i < THR_TBL_SIZE && !found; i++) {
+        /* an empty bucket needs no read section */
+        if (thr_tbl[i] == NULL) {
+            continue;
+        }
+        thr_tbl_read_begin(i);
+        curr_thr_stk = thr_tbl[i];
+        while (curr_thr_stk != NULL && !found) {
+            found = pred(curr_thr_stk, arg);
+            curr_thr_stk = curr_thr_stk->next;
+        }
+        thr_tbl_read_end(i);
+    }
+
+    return found;
+}
+
 /* -- Definitions -- */
 
+/** @brief Mark the thread as vanished and vanish
+ *
+ *  @param vanished The flag to set, right before the vanish system call.
+ *  @return Never returns.
+ */
+void thr_vanish_asm(int *vanished);
+
 /** @breif ebp getter
  *  @return the value stored in ebp register
  */
@@ -226,7 +323,105 @@ static void *stk_alloc(void *hi, int nbyte) {
     }
 }
 
-/** @brief Free a thread stack from page.
+/** @brief Get a mapped thread stack.
+ *
+ *  Take a cached stack if there is one, so no system call is needed.
+ *  Otherwise map a new stack, in a previously unmapped range if there
+ *  is one, or else at thr_stk_curr.
+ *
+ *  @note Caller must hold create_mp.
+ *
+ *  @return The lowest address of the stack, NULL if it can't be mapped.
+ */
+static void *stk_get(void) {
+    /* reuse a stack that is still mapped */
+    if (stk_cache != NULL) {
+        thr_stk_t *thr_stk = stk_cache;
+        stk_cache = thr_stk->next;
+        stk_cache_len--;
+        return (void *)thr_stk + sizeof(thr_stk_t) - stk_size;
+    }
+
+    /* reuse an unmapped range */
+    if (stk_holes != NULL) {
+        stk_hole_t *hole = stk_holes;
+        void *lo = stk_alloc(hole->hi, stk_size);
+        if (lo != NULL) {
+            stk_holes = hole->next;
+            free(hole);
+        }
+        return lo;
+    }
+
+    /* move the watermark down */
+    void *lo = stk_alloc(thr_stk_curr, stk_size);
+    if (lo != NULL) {
+        /* substract thr_stk_curr one stk_slot down */
+        thr_stk_curr -= stk_slot;
+    }
+    return lo;
+}
+
+/** @brief Give back a thread stack that nobody runs on anymore.
+ *
+ *  Keep it mapped in the cache if there is room. Otherwise unmap it, and
+ *  give its range back to the watermark or remember it as a hole.
+ *
+ *  @note Caller must hold create_mp.
+ *
+ *  @param thr_stk The header of the stack.
+ *  @return -1 if the pages could not be removed, else 0.
+ */
+static int stk_put(thr_stk_t *thr_stk) {
+    /* nobody waits on them anymore, install_stk_header inits them again */
+    mutex_destroy(&thr_stk->mp);
+    cond_destroy(&thr_stk->cv);
+
+    if (stk_cache_len < thr_stk_cache_max) {
+        thr_stk->next = stk_cache;
+        stk_cache = thr_stk;
+        stk_cache_len++;
+        return 0;
+    }
+
+    /* get the lower bound of thr_stk */
+    void *stk_lo = (void *)thr_stk + sizeof(thr_stk_t) - stk_size;
+    void *hi = stk_lo + stk_size;
+    if (remove_pages(stk_lo) < 0) {
+        return -1;
+    }
+
+    /* the range is right above the watermark, move it back up */
+    if (hi - stk_slot == thr_stk_curr) {
+        thr_stk_curr += stk_slot;
+        /* and swallow the holes that are now above it */
+        stk_hole_t **pp = &stk_holes;
+        while (*pp != NULL) {
+            if ((*pp)->hi - stk_slot == thr_stk_curr) {
+                stk_hole_t *hole = *pp;
+                *pp = hole->next;
+                free(hole);
+                thr_stk_curr += stk_slot;
+                /* start over, a lower hole may be above it now */
+                pp = &stk_holes;
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+        return 0;
+    }
+
+    /* remember the range, if this fails the range is just lost */
+    stk_hole_t *hole = malloc(sizeof(stk_hole_t));
+    if (hole != NULL) {
+        hole->hi = hi;
+        hole->next = stk_holes;
+        stk_holes = hole;
+    }
+    return 0;
+}
+
+/** @brief Free a thread stack after its thread vanished.
  *
  *  @note This function is only used by thr_join. Since it contains
  *        pairs of locks interact with thr_join that ensure the
@@ -240,20 +435,164 @@ static int _remove_stk_frame(thr_stk_t *thr_stk) {
         return -1;
     }
 
-    /* =lock the jointee (finer grain)*/
-    mutex_lock(&thr_stk->mp);
-    /* get the lower bound of thr_stk */
-    void *stk_lo = (void *)thr_stk + sizeof(thr_stk_t) - stk_size;
+    /* the main thread's stack isn't ours to free */
+    if (thr_stk == &main_thr_stk) {
+        return 0;
+    }
+
+    /* the jointee may still be on its way to vanish, and it must be
+     * off the stack before the stack is reused or unmapped */
+    while (!thr_stk->vanished) {
+        yield(thr_stk->ktid);
+    }
+
     /* ===lock the thr_join operation */
     mutex_lock(&join_mp);
+    /* =lock the jointee (finer grain), waiting for other joiners to
+     * give it up */
+    mutex_lock(&thr_stk->mp);
     /* =unlock the jointee (finer grain) */
     mutex_unlock(&thr_stk->mp);
-    int status = remove_pages(stk_lo);
+
+    mutex_lock(&create_mp);
+    int status = stk_put(thr_stk);
+    mutex_unlock(&create_mp);
+
     /* ===unlock the thr_join operation */
     mutex_unlock(&join_mp);
     return status;
 }
 
+/* -- Utilities for the zombie queue -- */
+
+/** @brief Append an exiting thread to the zombie queue.
+ *
+ *  @param thr_stk The exiting thread, its mp held by the caller.
+ *  @return Void.
+ */
+static void zombie_put(thr_stk_t *thr_stk) {
+    mutex_lock(&zombie_mp);
+    thr_stk->zombie = 1;
+    thr_stk->zombie_next = NULL;
+    thr_stk->zombie_prev = zombie_tail;
+    if (zombie_tail != NULL) {
+        zombie_tail->zombie_next = thr_stk;
+    } else {
+        zombie_head = thr_stk;
+    }
+    zombie_tail = thr_stk;
+    cond_signal(&zombie_cv);
+    mutex_unlock(&zombie_mp);
+}
+
+/** @brief Unlink a thread from the zombie queue, zombie_mp held.
+ *
+ *  @param thr_stk A thread in the queue.
+ *  @return Void.
+ */
+static void zombie_unlink(thr_stk_t *thr_stk) {
+    if (thr_stk->zombie_prev != NULL) {
+        thr_stk->zombie_prev->zombie_next = thr_stk->zombie_next;
+    } else {
+        zombie_head = thr_stk->zombie_next;
+    }
+    if (thr_stk->zombie_next != NULL) {
+        thr_stk->zombie_next->zombie_prev = thr_stk->zombie_prev;
+    } else {
+        zombie_tail = thr_stk->zombie_prev;
+    }
+    thr_stk->zombie = 0;
+}
+
+/** @brief Take a given thread out of the zombie queue.
+ *
+ *  @param thr_stk An exited thread, its mp held by the caller.
+ *  @return 1 if the caller now owns the dead thread, 0 if somebody else
+ *          took it first.
+ */
+static int zombie_claim(thr_stk_t *thr_stk) {
+    int claimed = 0;
+
+    mutex_lock(&zombie_mp);
+    if (thr_stk->zombie) {
+        zombie_unlink(thr_stk);
+        claimed = 1;
+    }
+    mutex_unlock(&zombie_mp);
+
+    return claimed;
+}
+
+/** @brief Collect the status of a claimed thread and free it.
+ *
+ *  @param thr_stk A dead thread claimed from the zombie queue, its mp
+ *         held by the caller. The lock is released.
+ *  @param statusp Where to store the exit status, may be NULL.
+ *  @return 0 on success, -1 if the thread couldn't be cleaned up.
+ */
+static int thr_reap(thr_stk_t *thr_stk, void **statusp) {
+    /* indicate that the target thread was joined */
+    thr_stk->join_flag = 1;
+
+    /* retrieve the status */
+    if (statusp != NULL) {
+        *statusp = thr_stk->exit_status;
+    }
+
+    /* =unlock the target thr_stk */
+    mutex_unlock(&thr_stk->mp);
+
+    /* clean up the thr_stk, only one thread should do this! */
+    if (thr_remove(thr_stk) != 0) {
+        return -1;
+    }
+    if (_remove_stk_frame(thr_stk) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/** @brief Give the stacks of vanished detached threads back.
+ *
+ *  Detached threads can't free the stack they run on, so thr_exit leaves
+ *  them on reclaim_list. The next thr_create or thr_join collects the
+ *  ones that are off their stacks by now.
+ *
+ *  @return Void.
+ */
+static void reclaim_detached(void) {
+    /* nothing to do, don't touch the locks */
+    if (reclaim_list == NULL) {
+        return;
+    }
+
+    /* ===lock the thr_join operation, same order as _remove_stk_frame */
+    mutex_lock(&join_mp);
+    mutex_lock(&create_mp);
+
+    thr_stk_t **pp = &reclaim_list;
+    while (*pp != NULL) {
+        thr_stk_t *thr_stk = *pp;
+        /* still on its way to vanish, try next time */
+        if (!thr_stk->vanished) {
+            pp = &thr_stk->reclaim_next;
+            continue;
+        }
+        *pp = thr_stk->reclaim_next;
+        /* wait for joiners that are about to find it detached */
+        mutex_lock(&thr_stk->mp);
+        mutex_unlock(&thr_stk->mp);
+        if (stk_put(thr_stk) < 0) {
+            lprintf("warning! remove stk frame failed");
+        }
+    }
+
+    mutex_unlock(&create_mp);
+    /* ===unlock the thr_join operation */
+    mutex_unlock(&join_mp);
+}
+
 /** @brief Let the caller go to sleep before the target thread exit.
  *
  *  @param tid The target thread that caller is monitoring.
@@ -261,12 +600,17 @@ static int _remove_stk_frame(thr_stk_t *thr_stk) {
  *  @return 0 if the target thread exited, else return -1.
 */
 int thr_join(int tid, void **statusp) {
+    /* collect detached threads first */
+    reclaim_detached();
+
     /* ===lock the join operation */
     mutex_lock(&join_mp);
 
-    /* check if tid is currently registered */
+    /* check if tid is currently registered. join_mp keeps the stack
+     * from being removed under us */
     thr_stk_t *thr_stk = thr_find(tid);
     if (thr_stk == NULL) {
+        mutex_unlock(&join_mp);
         return -1;
     }
 
@@ -275,36 +619,141 @@ int thr_join(int tid, void **statusp) {
     /* ===unlock the join operation, so other threads can call join now */
     mutex_unlock(&join_mp);
 
+    /* a detached thread can't be joined */
+    if (thr_stk->detached) {
+        mutex_unlock(&thr_stk->mp);
+        return -1;
+    }
+
     /* sleep untill target thread wake this thread up */
+    thr_stk->join_waiters++;
     while (thr_stk->state != THR_EXITED) {
         cond_wait(&thr_stk->cv, &thr_stk->mp);
     }
+    thr_stk->join_waiters--;
 
     /* if the thread is under join already, return -1 */
-    if (thr_stk->join_flag) {
+    if (thr_stk->join_flag || !zombie_claim(thr_stk)) {
+        mutex_unlock(&thr_stk->mp);
         return -1;
     }
-    /* indicate that the target thread was called join if not.*/
-    else {
-        thr_stk->join_flag = 1;
+
+    return thr_reap(thr_stk, statusp);
+}
+
+/** @brief Wait for any joinable thread to exit and reap it.
+ *
+ *  Threads are reaped in the order they exited. This blocks until some
+ *  thread exits, even if there is no thread left that could.
+ *
+ *  @param tidp Where to store the tid of the reaped thread, may be NULL.
+ *  @param statusp Where to store its exit status, may be NULL.
+ *  @return 0 on success, -1 if the thread couldn't be cleaned up.
+ */
+int thr_join_any(int *tidp, void **statusp) {
+    /* collect detached threads first */
+    reclaim_detached();
+
+    mutex_lock(&zombie_mp);
+    while (zombie_head == NULL) {
+        cond_wait(&zombie_cv, &zombie_mp);
     }
+    /* taking it out of the queue makes it ours */
+    thr_stk_t *thr_stk = zombie_head;
+    zombie_unlink(thr_stk);
+    mutex_unlock(&zombie_mp);
 
-    /* retrieve the status */
-    if (statusp != NULL) {
-        *statusp = thr_stk->exit_status;
+    if (tidp != NULL) {
+        *tidp = thr_stk->utid;
     }
 
-    /* =unlock the target thr_stk */
-    mutex_unlock(&thr_stk->mp);
+    /* wait for thr_exit to leave the critical section */
+    mutex_lock(&thr_stk->mp);
+    return thr_reap(thr_stk, statusp);
+}
 
-    /* clean up the thr_stk, only one thread should do this! */
-    if (thr_remove(thr_stk) != 0) {
+/** @brief Join a batch of threads.
+ *
+ *  Joins every thread in tids, even if some of them fail.
+ *
+ *  @param tids The threads to join.
+ *  @param n The number of threads in tids.
+ *  @param statuses Where statuses[i] receives the exit status of tids[i],
+ *         may be NULL.
+ *  @return The number of threads that couldn't be joined, 0 if all went
+ *          well, -1 if the arguments are invalid.
+ */
+int thr_join_many(int *tids, int n, void **statuses) {
+    int i, failed = 0;
+
+    if (tids == NULL || n < 0) {
         return -1;
     }
-    if (_remove_stk_frame(thr_stk) != 0) {
+
+    for (i = 0; i < n; i++) {
+        if (thr_join(tids[i], statuses != NULL ? &statuses[i] : NULL) < 0) {
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+/** @brief Let a thread clean up after itself when it exits.
+ *
+ *  A detached thread can't be joined. If it already exited, its stack is
+ *  reclaimed right here, else thr_exit hands it to reclaim_list.
+ *
+ *  @param tid The thread to detach.
+ *  @return 0 on success. -1 if tid doesn't exist, is already detached,
+ *          or is being joined.
+ */
+int thr_detach(int tid) {
+    /* ===lock the join operation */
+    mutex_lock(&join_mp);
+
+    thr_stk_t *thr_stk = thr_find(tid);
+    if (thr_stk == NULL) {
+        mutex_unlock(&join_mp);
         return -1;
     }
 
+    /* =lock the target thr_stk */
+    mutex_lock(&thr_stk->mp);
+    /* ===unlock the join operation */
+    mutex_unlock(&join_mp);
+
+    /* someone is joining it, or it is detached already */
+    if (thr_stk->join_flag || thr_stk->join_waiters > 0 ||
+        thr_stk->detached) {
+        mutex_unlock(&thr_stk->mp);
+        return -1;
+    }
+
+    /* it exited before we came, reap it like a joiner would */
+    int exited = (thr_stk->state == THR_EXITED);
+    if (exited) {
+        /* thr_join_any got it first */
+        if (!zombie_claim(thr_stk)) {
+            mutex_unlock(&thr_stk->mp);
+            return -1;
+        }
+        thr_stk->join_flag = 1;
+    }
+    thr_stk->detached = 1;
+
+    /* =unlock the target thr_stk */
+    mutex_unlock(&thr_stk->mp);
+
+    if (exited) {
+        if (thr_remove(thr_stk) != 0) {
+            return -1;
+        }
+        if (_remove_stk_frame(thr_stk) != 0) {
+            return -1;
+        }
+    }
+
     return 0;
 }
 
@@ -317,18 +766,13 @@ int thr_join(int tid, void **statusp) {
 void thr_func_wrapper(void *(*func)(void *), void *args) {
     thr_stk_t *thr_stk = get_thr_stk();
 
-    /* wait until the ktid field is set by the creation thread */
-    mutex_lock(&fork_mp);
-    /* initial value is 0 */
-    while (thr_stk->state != THR_RUNNABLE) {
-        cond_wait(&fork_cv, &fork_mp);
-    }
-    mutex_unlock(&fork_mp);
+    /* wait until the ktid field is set by the creation thread. Only
+     * our own creator wakes us up */
+    park_wait(&thr_stk->start);
 
     void *ret_val = func(args);
 
     /* if func didn't call thr_exit, it will reach here */
-    thr_stk->state = THR_EXITED;
     thr_exit(ret_val);
 
     /* should never reach here */
@@ -350,13 +794,16 @@ int thr_yield(int tid) {
         return yield(-1);
     else {
         /* Find the thr_stk head using the utid */
+        thr_tbl_read_begin(THR_TBL_HASH(tid));
         thr_stk_t *thr_stk = thr_find(tid);
+        int ktid = thr_stk ? thr_stk->ktid : -1;
+        thr_tbl_read_end(THR_TBL_HASH(tid));
         /* The thr_stk does not exist */
         if (!thr_stk) {
             panic("The utid %d does not exist. \n", tid);
             return -1;
         } else {
-            return yield(thr_stk->ktid);
+            return yield(ktid);
         }
     }
 }
@@ -375,6 +822,12 @@ void thr_exit(void *status) {
      * the thread stack shouldn't be removed yet */
     assert(thr_stk != NULL);
 
+    /* destructors still run as this thread, before anyone can join it */
+    thr_key_run_dtors(thr_stk);
+    /* and they may free, so the cached blocks go back after them */
+    malloc_cache_flush(thr_stk);
+    pool_cache_flush(thr_stk);
+
     /* lock this thr_stk since we are going to write it */
     mutex_lock(&thr_stk->mp);
 
@@ -386,11 +839,36 @@ void thr_exit(void *status) {
        this point, signal to all of them, but only one of them will
        get the chance to join this thread.*/
     cond_broadcast(&thr_stk->cv);
+    /* nobody will join a detached thread, we clean up ourselves */
+    int detached = thr_stk->detached;
+    if (!detached) {
+        /* wait to be claimed by a joiner */
+        zombie_put(thr_stk);
+    }
 
     /* release the lock */
     mutex_unlock(&thr_stk->mp);
 
-    vanish();
+    if (detached) {
+        thr_remove(thr_stk);
+    }
+
+    /* the main thread's stack is not in a thread stack range */
+    if (thr_stk == &main_thr_stk) {
+        vanish();
+    }
+
+    /* we are still on the stack, let the next thr_create or thr_join
+     * reclaim it after we vanished */
+    if (detached) {
+        mutex_lock(&create_mp);
+        thr_stk->reclaim_next = reclaim_list;
+        reclaim_list = thr_stk;
+        mutex_unlock(&create_mp);
+    }
+
+    /* tell the joiner we are off the stack, and vanish */
+    thr_vanish_asm(&thr_stk->vanished);
 }
 
 /** @brief Setup the fields in thr_stk
@@ -412,13 +890,29 @@ thr_stk_t *install_stk_header(void *thr_stk_lo, void *args, void *func) {
     thr_stk->cv_next = NULL;
     thr_stk->next = NULL;
     thr_stk->prev = NULL;
-    thr_stk->utid = global_utid;
+    thr_stk->utid = xaddn_wrapper(&global_utid, 1);
     /* Initialize kernel assigned ID as 0 */
     thr_stk->ktid = 0;
+    /* The gate the child waits at until the creator sets ktid */
+    park_init(&thr_stk->start, 0);
     /* The thread shuoldn't be used before this state is cleared */
     thr_stk->state = THR_UNRUNNABLE;
     thr_stk->zero = 0;
     thr_stk->join_flag = 0;
+    thr_stk->join_waiters = 0;
+    thr_stk->detached = 0;
+    thr_stk->vanished = 0;
+    thr_stk->zombie = 0;
+    thr_stk->zombie_next = NULL;
+    thr_stk->zombie_prev = NULL;
+    thr_stk->reclaim_next = NULL;
+    memset(thr_stk->tls, 0, sizeof(thr_stk->tls));
+    memset(thr_stk->rm_slot, 0, sizeof(thr_stk->rm_slot));
+    memset(thr_stk->mcache, 0, sizeof(thr_stk->mcache));
+    memset(thr_stk->mcache_len, 0, sizeof(thr_stk->mcache_len));
+    memset(thr_stk->pcache, 0, sizeof(thr_stk->pcache));
+    thr_stk->pcache_seen = 0;
+    thr_stk->mcache_off = 0;
 
     mutex_init(&thr_stk->mp);
     cond_init(&thr_stk->cv);
@@ -441,8 +935,16 @@ int thr_init(unsigned int size) {
     /* round-up thread stack size to page size */
     stk_size = (int)PAGE_ROUNDUP(size + sizeof(thr_stk_t));
 
-    /* set the head of thread stack to be slightly lower then main_stk_lo */
-    thr_stk_head = PAGE_ROUNDDN(main_stk_lo);
+    /* round-up the reserved range to a power of 2 */
+    stk_slot = PAGE_SIZE;
+    while (stk_slot < stk_size) {
+        stk_slot <<= 1;
+    }
+
+    /* set the head of thread stack to be slightly lower then main_stk_lo,
+     * aligned to stk_slot */
+    thr_stk_head = (void *)((unsigned int)PAGE_ROUNDDN(main_stk_lo) &
+                            ~(stk_slot - 1));
 
     /* set the candidate address to allocate the stack */
     thr_stk_curr = thr_stk_head;
@@ -453,9 +955,6 @@ int thr_init(unsigned int size) {
     main_thr_stk.ktid = gettid();
     main_thr_stk.state = THR_UNRUNNABLE;
 
-    /* record the ktid of main thread */
-    main_thr_ktid = main_thr_stk.ktid;
-
     /* Initialize main thread's private lock and cv */
     mutex_init(&main_thr_stk.mp);
     cond_init(&main_thr_stk.cv);
@@ -463,25 +962,25 @@ int thr_init(unsigned int size) {
     /* Initialize the malloc lock. Malloc family would not be called
      * before thr_init. */
     mutex_init(&malloc_mp);
+    mutex_init(&pool_mp);
 
-    /* The whole process of thr_create should be serial, we do not
-     * want any part of it to be interleaved with another thr_create,
-     * since thr_create involves so many global operations */
+    /* Only the stack allocation of thr_create is serial, everything
+     * else about a new thread is private to its creator */
     mutex_init(&create_mp);
 
-    /* Initialize the lock and cv for thr_create. Let's say T1 creates
-     * T2. After thr_create, T2 has to wait until its ktid is installed
-     * by T1. */
-    mutex_init(&fork_mp);
-    cond_init(&fork_cv);
-
-    /* Initialize the mutex for thread-list */
-    mutex_init(&thr_stk_list_mp);
+    /* Initialize the mutexes for thread table */
+    int i;
+    for (i = 0; i < THR_TBL_SIZE; i++) {
+        mutex_init(&thr_tbl_mp[i]);
+    }
 
     /* Initialize the mutex for thr_join */
     mutex_init(&join_mp);
+    mutex_init(&zombie_mp);
+    timer_init();
+    cond_init(&zombie_cv);
 
-    /* add main thread to thread list */
+    /* add main thread to thread table */
     if (thr_insert(&main_thr_stk) < 0) {
         return -1;
     }
@@ -489,20 +988,26 @@ int thr_init(unsigned int size) {
     return 0;
 }
 
-/** @brief Create a new thread.
+/** @brief Spawn a new thread.
  *
- *  This will spawn a new thread, and keep track of the new thread
- *  before it is joined and cleaned.
+ *  Only the stack allocation is shared with other creators. The child
+ *  waits at its own start gate until we have filled in its ktid and
+ *  published it in the thread table, then we wake up just that child.
  *
  *  @param func The function to run.
  *  @param args The arguments of the function.
+ *  @param detached 1 if the new thread starts detached.
+ *  @return The utid of the new thread, -1 on error.
  */
-int thr_create(void *(*func)(void *), void *args) {
-    /* lock thr_create */
+static int thr_spawn(void *(*func)(void *), void *args, int detached) {
+    /* collect detached threads, their stacks may be reused right away */
+    reclaim_detached();
+
+    /* lock the stack allocator */
     mutex_lock(&create_mp);
 
     /* allocate the thread stack header and stack for the thread */
-    void *thr_stk_lo = stk_alloc(thr_stk_curr, stk_size);
+    void *thr_stk_lo = stk_get();
 
     mutex_unlock(&create_mp);
 
@@ -511,9 +1016,6 @@ int thr_create(void *(*func)(void *), void *args) {
         return -1;
     }
 
-    /* substract thr_stk_curr one stk_size down */
-    thr_stk_curr -= stk_size;
-
     /* install the header structure for child thread stack */
     thr_stk_t *thr_stk = install_stk_header(thr_stk_lo, args, (void *)func);
 
@@ -521,39 +1023,29 @@ int thr_create(void *(*func)(void *), void *args) {
 
     /* error. no thread was created */;
     if (ret < 0) {
-        if (_remove_stk_frame(thr_stk) < 0) {
+        /* nobody ever ran on it, give it back right away */
+        mutex_lock(&create_mp);
+        if (stk_put(thr_stk) < 0) {
             lprintf("warning! remove stk frame failed");
         }
-        return -1;
-    }
-
-    /* Store the ktid back to the newly created thread, and
-     * insert this thread to the list. We need to ensure these are
-     * done before the thread start to run */
-    mutex_lock(&fork_mp);
-
-    /* insert to thead list */
-    mutex_lock(&create_mp);
-    if (thr_insert(thr_stk) < 0) {
-        mutex_unlock(&fork_mp);
         mutex_unlock(&create_mp);
         return -1;
     }
 
-    mutex_unlock(&create_mp);
     /* setup the final piece of info before child can run */
     thr_stk->ktid = ret;
-    thr_stk->state = THR_RUNNABLE;
-
-    /* now the child can run */
-    cond_signal(&fork_cv);
+    thr_stk->start.ktid = ret;
+    thr_stk->detached = detached;
 
-    mutex_unlock(&fork_mp);
+    /* insert to thead table, so the utid can be joined */
+    thr_insert(thr_stk);
+    thr_stk->state = THR_RUNNABLE;
 
-    mutex_lock(&create_mp);
-    int ret_utid = global_utid++;
+    /* the child may exit and be joined once it is let go */
+    int ret_utid = thr_stk->utid;
 
-    mutex_unlock(&create_mp);
+    /* now the child can run */
+    park_wake(&thr_stk->start);
 
     /* Install handler */
     install_handler();
@@ -561,42 +1053,57 @@ int thr_create(void *(*func)(void *), void *args) {
     return ret_utid;
 }
 
+/** @brief Create a new thread.
+ *
+ *  This will spawn a new thread, and keep track of the new thread
+ *  before it is joined and cleaned.
+ *
+ *  @param func The function to run.
+ *  @param args The arguments of the function.
+ *  @return The utid of the new thread, -1 on error.
+ */
+int thr_create(void *(*func)(void *), void *args) {
+    return thr_spawn(func, args, 0);
+}
+
+/** @brief Create a new thread that is detached from the start.
+ *
+ *  @param func The function to run.
+ *  @param args The arguments of the function.
+ *  @return The utid of the new thread, -1 on error.
+ */
+int thr_create_detached(void *(*func)(void *), void *args) {
+    return thr_spawn(func, args, 1);
+}
+
 /** @brief Get the address of the thread stack header
  *
- *  Backtrack the ebp until it reach a special value (0).
+ *  Every thread stack lives at the top of its own stk_slot aligned range,
+ *  so rounding the current ebp up to stk_slot gives the top of the stack,
+ *  where the header is. The main thread's stack is above all of them.
  *
  *  @return The address of stack's header structure.
- *  @note   This function use ebp == 0 to as the terminate condition
- *          during stack backtrace. In a normal stack calling convention,
- *          the ebp shouldn't be zero, so this should be a reasonable value.
+ *  @note   This never enters the kernel. Before thr_init, thr_stk_head is
+ *          NULL and every caller is the main thread.
  */
 thr_stk_t *get_thr_stk() {
-    if (gettid() == main_thr_ktid) {
-        return &main_thr_stk;
-    }
+    unsigned int ebp = (unsigned int)get_ebp();
 
-    int *curr_ebp = get_ebp();
-    while (*curr_ebp != (int)NULL) {
-        curr_ebp = *(int **)(curr_ebp);
+    if (ebp >= (unsigned int)thr_stk_head) {
+        return &main_thr_stk;
     }
 
     /* Return the starting addr of thr_stk head. Which is
-     * thr_stk->ret_addr. Add one int entry to complement the curr_ebp
-     * size, which is the thr_stk->zero. */
-    curr_ebp = curr_ebp + 1 - sizeof(thr_stk_t) / sizeof(int);
+     * thr_stk->ret_addr, right below the top of the range. */
+    unsigned int hi = (ebp | (stk_slot - 1)) + 1;
 
-    return (thr_stk_t *)curr_ebp;
+    return (thr_stk_t *)(hi - sizeof(thr_stk_t));
 }
 
 /** @brief Get this thread's utid
  *  @return my_utid Caller's utid.
  */
 int thr_getid() {
-    /* main thread is special case */
-    if (gettid() == main_thr_ktid) {
-        return main_thr_stk.utid;
-    }
-
     thr_stk_t *thr_stk = get_thr_stk();
     int utid = thr_stk->utid;
 
@@ -0,0 +1,245 @@
+/** @file timer.c
+ *  @brief Timer service for the timed waits.
+ *
+ *  All pending timers of the process sit in one min-heap ordered by
+ *  deadline, served by a single detached timer thread. The thread sleeps
+ *  until the earliest deadline, fires every timer that is due and goes
+ *  back to sleep. It exits when the heap runs empty, so it never keeps
+ *  a finished program alive, and timer_add starts a new one when needed.
+ *
+ *  sleep() can't be cut short, so a timer added while the thread sleeps
+ *  towards a later deadline might be late. The thread never sleeps longer
+ *  than TIMER_MAX_SLEEP ticks in one go, which bounds that lateness.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+
+#include <malloc.h>
+#include <mutex.h>
+#include <simics.h> /* lprintf() */
+#include <stddef.h>
+#include <syscall.h>
+#include <thr_internals.h>
+#include <thread_ext.h>
+
+/** @brief The initial number of slots in the heap */
+#define TIMER_HEAP_MIN 16
+
+/** @brief The pending timers, heap[0] has the earliest deadline */
+static thr_timer_t **timer_heap = NULL;
+static int timer_len = 0;
+static int timer_cap = 0;
+
+/** @brief Set while a timer thread is serving the heap */
+static int timer_running = 0;
+
+/** @brief Protects everything above */
+static mutex_t timer_mp;
+
+/** @brief Tell whether timer a is due before timer b.
+ *
+ *  @return Non-zero if a's deadline comes first.
+ */
+static int timer_before(thr_timer_t *a, thr_timer_t *b) {
+    return (int)(a->when - b->when) < 0;
+}
+
+/** @brief Put a timer into a heap slot.
+ *  @return Void.
+ */
+static void timer_set(int idx, thr_timer_t *t) {
+    timer_heap[idx] = t;
+    t->idx = idx;
+}
+
+/** @brief Move the timer at idx up until its parent is earlier.
+ *  @return Void.
+ */
+static void timer_sift_up(int idx) {
+    thr_timer_t *t = timer_heap[idx];
+
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (!timer_before(t, timer_heap[parent])) {
+            break;
+        }
+        timer_set(idx, timer_heap[parent]);
+        idx = parent;
+    }
+    timer_set(idx, t);
+}
+
+/** @brief Move the timer at idx down until its children are later.
+ *  @return Void.
+ */
+static void timer_sift_down(int idx) {
+    thr_timer_t *t = timer_heap[idx];
+
+    while (1) {
+        int child = 2 * idx + 1;
+        if (child >= timer_len) {
+            break;
+        }
+        if (child + 1 < timer_len &&
+            timer_before(timer_heap[child + 1], timer_heap[child])) {
+            child++;
+        }
+        if (!timer_before(timer_heap[child], t)) {
+            break;
+        }
+        timer_set(idx, timer_heap[child]);
+        idx = child;
+    }
+    timer_set(idx, t);
+}
+
+/** @brief Take the timer at idx out of the heap.
+ *  @return Void.
+ */
+static void timer_delete(int idx) {
+    thr_timer_t *t = timer_heap[idx];
+    thr_timer_t *last;
+
+    timer_len--;
+    if (idx != timer_len) {
+        /* the last timer fills the hole, it may have to go either way */
+        last = timer_heap[timer_len];
+        timer_set(idx, last);
+        timer_sift_down(idx);
+        timer_sift_up(last->idx);
+    }
+    t->idx = -1;
+}
+
+/** @brief Take the earliest timer out of the heap and fire it.
+ *
+ *  Called with timer_mp held, which is dropped while fire runs.
+ *
+ *  @return Void.
+ */
+static void timer_fire_first(void) {
+    thr_timer_t *t = timer_heap[0];
+
+    /* fire it without the lock, the owner waits for firing */
+    timer_delete(0);
+    t->firing = 1;
+    mutex_unlock(&timer_mp);
+    t->fire(t);
+    /* last touch, timer_cancel may return after this */
+    t->firing = 0;
+    mutex_lock(&timer_mp);
+}
+
+/** @brief The timer thread.
+ *
+ *  @param arg Unused.
+ *  @return NULL once there are no timers left.
+ */
+static void *timer_main(void *arg) {
+    mutex_lock(&timer_mp);
+    while (timer_len > 0) {
+        thr_timer_t *t = timer_heap[0];
+        int delta = (int)(t->when - get_ticks());
+
+        if (delta > 0) {
+            if (delta > TIMER_MAX_SLEEP) {
+                delta = TIMER_MAX_SLEEP;
+            }
+            mutex_unlock(&timer_mp);
+            sleep(delta);
+            mutex_lock(&timer_mp);
+            continue;
+        }
+
+        /* due */
+        timer_fire_first();
+    }
+    timer_running = 0;
+    mutex_unlock(&timer_mp);
+
+    return NULL;
+}
+
+/** @brief Initialize the timer service, called by thr_init.
+ *  @return 0 on success, -1 on error.
+ */
+int timer_init(void) {
+    return mutex_init(&timer_mp);
+}
+
+/** @brief Arm a timer.
+ *
+ *  t->when, t->fire and t->arg must be set. fire runs on the timer
+ *  thread once get_ticks() reaches when, unless timer_cancel comes first.
+ *
+ *  If the timer thread can't be started, the timers other threads
+ *  added in the meantime are fired right away.
+ *
+ *  @param t The timer, must stay valid until timer_cancel returns.
+ *  @return 0 on success, -1 if the timer can't be armed.
+ */
+int timer_add(thr_timer_t *t) {
+    int start = 0;
+
+    t->firing = 0;
+
+    mutex_lock(&timer_mp);
+    if (timer_len == timer_cap) {
+        int cap = timer_cap ? 2 * timer_cap : TIMER_HEAP_MIN;
+        thr_timer_t **heap = realloc(timer_heap, cap * sizeof(*heap));
+        if (heap == NULL) {
+            mutex_unlock(&timer_mp);
+            return -1;
+        }
+        timer_heap = heap;
+        timer_cap = cap;
+    }
+    timer_set(timer_len, t);
+    timer_len++;
+    timer_sift_up(t->idx);
+
+    if (!timer_running) {
+        timer_running = 1;
+        start = 1;
+    }
+    mutex_unlock(&timer_mp);
+
+    if (start && thr_create_detached(timer_main, NULL) < 0) {
+        /* nobody serves the heap, take our timer back */
+        lprintf("warning! cannot start the timer thread");
+        mutex_lock(&timer_mp);
+        timer_running = 0;
+        if (t->idx >= 0) {
+            timer_delete(t->idx);
+        }
+        /* the timers added meanwhile counted on our thread, they fire
+         * early rather than never, unless someone starts a thread */
+        while (timer_len > 0 && !timer_running) {
+            timer_fire_first();
+        }
+        mutex_unlock(&timer_mp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** @brief Disarm a timer.
+ *
+ *  If the timer thread is firing it right now, wait until it is done.
+ *
+ *  @param t An armed timer.
+ *  @return Void.
+ */
+void timer_cancel(thr_timer_t *t) {
+    mutex_lock(&timer_mp);
+    if (t->idx >= 0) {
+        timer_delete(t->idx);
+    }
+    mutex_unlock(&timer_mp);
+
+    while (t->firing) {
+        yield(-1);
+    }
+}
@@ -0,0 +1,210 @@
+/** @file bench_barrier.c
+ *  @brief Barrier phase turnaround benchmark.
+ *
+ *  For 2 to 64 threads, every thread goes through PHASES phases,
+ *  meeting the others at a barrier at the end of each. We run it once
+ *  on barrier_t and once on the barrier people used to build from a
+ *  mutex, a counter and cond_broadcast, and report the elapsed ticks
+ *  and the ticks per 1000 phases.
+ *
+ *  Each thread also marks the phase it is in, and checks after every
+ *  barrier that nobody is still in an earlier phase or has already
+ *  left for a later one.
+ *
+ *     USAGE: bench_barrier [tree_min] [phases]
+ *
+ *  With tree_min 0 every barrier_t is a tree, with a huge tree_min
+ *  every barrier_t is a single counter.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex.h>
+#include <cond.h>
+#include <barrier.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Default number of phases */
+#define PHASES 500
+
+/** @brief The largest number of threads */
+#define MAX_THREADS 64
+
+/** @brief The hand-built barrier */
+typedef struct old_barrier {
+    int n;
+    int count;
+    int generation;
+    mutex_t mutex;
+    cond_t cv;
+} old_barrier_t;
+
+/** @brief The barrier under test */
+barrier_t bar;
+
+/** @brief The baseline barrier */
+old_barrier_t old_bar;
+
+/** @brief 1 to run on old_bar, 0 to run on bar */
+int use_old;
+
+/** @brief Phases per round */
+int phases = PHASES;
+
+/** @brief Threads in this round */
+int nthr;
+
+/** @brief The phase each thread is in */
+int phase_of[MAX_THREADS];
+
+/** @brief Threads that got 1 from barrier_wait, updated atomically */
+int serials;
+
+/** @brief Initialize the baseline barrier.
+ *
+ *  @param ob The barrier.
+ *  @param n The number of threads.
+ *  @return Void.
+ */
+void old_barrier_init(old_barrier_t *ob, int n)
+{
+    ob->n = n;
+    ob->count = 0;
+    ob->generation = 0;
+    mutex_init(&ob->mutex);
+    cond_init(&ob->cv);
+}
+
+/** @brief Wait at the baseline barrier.
+ *
+ *  @param ob The barrier.
+ *  @return 1 in the last thread to arrive, else 0.
+ */
+int old_barrier_wait(old_barrier_t *ob)
+{
+    int gen, last = 0;
+
+    mutex_lock(&ob->mutex);
+    gen = ob->generation;
+    if (++ob->count == ob->n) {
+        ob->count = 0;
+        ob->generation++;
+        cond_broadcast(&ob->cv);
+        last = 1;
+    } else {
+        while (gen == ob->generation)
+            cond_wait(&ob->cv, &ob->mutex);
+    }
+    mutex_unlock(&ob->mutex);
+    return last;
+}
+
+/** @brief Destroy the baseline barrier.
+ *
+ *  @param ob The barrier.
+ *  @return Void.
+ */
+void old_barrier_destroy(old_barrier_t *ob)
+{
+    mutex_destroy(&ob->mutex);
+    cond_destroy(&ob->cv);
+}
+
+/** @brief Go through the phases.
+ *
+ *  @param arg The thread's index.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    int id = (int)arg;
+    int p, i;
+
+    for (p = 1; p <= phases; p++) {
+        phase_of[id] = p;
+        if (use_old ? old_barrier_wait(&old_bar) : barrier_wait(&bar))
+            xadd_wrapper(&serials);
+        /* everybody has reached phase p, nobody is past p + 1 */
+        for (i = 0; i < nthr; i++) {
+            if (phase_of[i] < p || phase_of[i] > p + 1)
+                panic("bench_barrier: thread %d in phase %d during %d",
+                      i, phase_of[i], p);
+        }
+    }
+    return NULL;
+}
+
+/** @brief Run one round and print the result.
+ *
+ *  @return Void.
+ */
+void run(void)
+{
+    int tids[MAX_THREADS];
+    unsigned int start, ticks;
+    int i;
+
+    serials = 0;
+    for (i = 0; i < nthr; i++)
+        phase_of[i] = 0;
+    if (use_old)
+        old_barrier_init(&old_bar, nthr);
+    else if (barrier_init(&bar, nthr) < 0)
+        panic("bench_barrier: barrier_init failed");
+
+    start = get_ticks();
+    for (i = 0; i < nthr; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0) {
+            panic("bench_barrier: thr_create failed");
+        }
+    }
+    for (i = 0; i < nthr; i++)
+        thr_join(tids[i], NULL);
+    ticks = get_ticks() - start;
+
+    if (use_old)
+        old_barrier_destroy(&old_bar);
+    else
+        barrier_destroy(&bar);
+
+    if (serials != phases)
+        panic("bench_barrier: %d serial threads in %d phases",
+              serials, phases);
+    if (ticks == 0)
+        ticks = 1;
+
+    printf("%-8s %7d %10u %16u\n", use_old ? "mutex" : "barrier",
+           nthr, ticks, (ticks * 1000) / phases);
+    lprintf("bench_barrier: %s threads %d ticks %u",
+            use_old ? "mutex" : "barrier", nthr, ticks);
+}
+
+int main(int argc, char *argv[])
+{
+    thr_init(STACK_SIZE);
+
+    if (argc > 1)
+        barrier_tree_min = atoi(argv[1]);
+    if (argc > 2)
+        phases = atoi(argv[2]);
+
+    printf("tree above %d threads, %d phases\n", barrier_tree_min, phases);
+    printf("barrier  threads      ticks  ticks/kphase\n");
+    for (nthr = 2; nthr <= MAX_THREADS; nthr *= 2) {
+        use_old = 1;
+        run();
+        use_old = 0;
+        run();
+    }
+
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/** @file bench_malloc.c
+ *  @brief Multi-threaded malloc/free stress benchmark.
+ *
+ *  For 1 to 32 threads, every thread allocates ITERS blocks, mostly
+ *  small and now and then a big one, fills each with a pattern and
+ *  swaps it into a random slot of a shared table. The block it swaps
+ *  out, which another thread most likely allocated, is checked and
+ *  freed. So about every free is a cross-thread free.
+ *
+ *  We run it once through malloc/free, and once through _malloc/_free
+ *  under malloc_mp, which is what malloc/free used to be, and report
+ *  the elapsed ticks and the round trips per 1000 ticks.
+ *
+ *     USAGE: bench_malloc [iters]
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Default number of blocks per thread */
+#define ITERS 5000
+
+/** @brief The largest number of threads */
+#define MAX_THREADS 32
+
+/** @brief Slots in the shared table */
+#define NSLOTS 256
+
+/** @brief One block in BIG_EVERY is big */
+#define BIG_EVERY 64
+
+/** @brief The size of a big block */
+#define BIG_SIZE 2000
+
+/** @brief The largest small block */
+#define SMALL_MAX 256
+
+/** @brief Blocks in flight between the threads */
+void *slots[NSLOTS];
+
+/** @brief Blocks per thread */
+int iters = ITERS;
+
+/** @brief 1 to go through _malloc/_free under malloc_mp */
+int use_locked;
+
+/** @brief Allocate through the allocator under test.
+ *
+ *  @param size The size.
+ *  @return The block.
+ */
+void *bench_alloc(size_t size)
+{
+    void *p;
+
+    if (!use_locked)
+        return malloc(size);
+
+    mutex_lock(&malloc_mp);
+    p = _malloc(size);
+    mutex_unlock(&malloc_mp);
+    return p;
+}
+
+/** @brief Free through the allocator under test.
+ *
+ *  @param p The block.
+ *  @return Void.
+ */
+void bench_free(void *p)
+{
+    if (!use_locked) {
+        free(p);
+        return;
+    }
+
+    mutex_lock(&malloc_mp);
+    _free(p);
+    mutex_unlock(&malloc_mp);
+}
+
+/** @brief Check the pattern of a block and free it.
+ *
+ *  The first int of a block is its size, every byte after that is the
+ *  size's low byte.
+ *
+ *  @param p The block.
+ *  @return Void.
+ */
+void check_free(int *p)
+{
+    unsigned char *c = (unsigned char *)(p + 1);
+    int size = p[0];
+    int i;
+
+    for (i = 0; i < size - (int)sizeof(int); i++) {
+        if (c[i] != (unsigned char)size)
+            panic("bench_malloc: block %p of size %d is corrupted", p, size);
+    }
+    bench_free(p);
+}
+
+/** @brief Allocate, fill, swap and free.
+ *
+ *  @param arg The thread's index, the seed of its random numbers.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    unsigned int seed = (unsigned int)arg * 7919 + 1;
+    unsigned char *c;
+    int *p;
+    int i, j, size;
+
+    for (i = 0; i < iters; i++) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % BIG_EVERY == 0)
+            size = BIG_SIZE;
+        else
+            size = sizeof(int) + (seed >> 16) % (SMALL_MAX - sizeof(int));
+
+        p = bench_alloc(size);
+        if (!p)
+            panic("bench_malloc: out of memory");
+        p[0] = size;
+        c = (unsigned char *)(p + 1);
+        for (j = 0; j < size - (int)sizeof(int); j++)
+            c[j] = (unsigned char)size;
+
+        p = (int *)xchg_wrapper((int *)&slots[(seed >> 8) % NSLOTS], (int)p);
+        if (p)
+            check_free(p);
+    }
+    return NULL;
+}
+
+/** @brief Run one round with nthr threads and print the result.
+ *
+ *  @param nthr The number of threads.
+ *  @return Void.
+ */
+void run(int nthr)
+{
+    int tids[MAX_THREADS];
+    unsigned int start, ticks;
+    int i;
+
+    start = get_ticks();
+    for (i = 0; i < nthr; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0) {
+            panic("bench_malloc: thr_create failed");
+        }
+    }
+    for (i = 0; i < nthr; i++)
+        thr_join(tids[i], NULL);
+    ticks = get_ticks() - start;
+
+    for (i = 0; i < NSLOTS; i++) {
+        if (slots[i]) {
+            check_free(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+    if (ticks == 0)
+        ticks = 1;
+
+    printf("%-7s %7d %10u %12u\n", use_locked ? "locked" : "cached",
+           nthr, ticks, (nthr * iters * 1000) / ticks);
+    lprintf("bench_malloc: %s threads %d ticks %u",
+            use_locked ? "locked" : "cached", nthr, ticks);
+}
+
+int main(int argc, char *argv[])
+{
+    int nthr;
+
+    if (argc > 1)
+        iters = atoi(argv[1]);
+
+    thr_init(STACK_SIZE);
+
+    printf("%d blocks per thread, %d slots\n", iters, NSLOTS);
+    printf("malloc  threads      ticks  blocks/ktick\n");
+    for (nthr = 1; nthr <= MAX_THREADS; nthr *= 2) {
+        use_locked = 1;
+        run(nthr);
+        use_locked = 0;
+        run(nthr);
+    }
+
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/** @file bench_malloc_trace.c
+ *  @brief Trace-driven benchmark of the heap allocator.
+ *
+ *  Replays a synthetic trace straight on _malloc/_free/_realloc: mostly
+ *  small objects, some medium and a few large, freed in random order.
+ *  The number of live blocks doubles from one phase to the next, and in
+ *  each phase we time CHURN frees and mallocs at that live set size.
+ *
+ *  An allocator that scans the heap for a fit gets slower with every
+ *  phase, one with size-class free lists should stay flat. Run it on
+ *  both to compare. mm_checkheap() checks the heap after every phase,
+ *  and every block's contents are checked before it is freed.
+ *
+ *  After every phase we also print the heap size and how much of it the
+ *  live blocks use, and at the end the peak heap size and what is left of
+ *  the heap once everything is freed, to compare how much memory
+ *  allocators waste and give back on the same trace.
+ *
+ *     USAGE: bench_malloc_trace [max_live] [churn]
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <malloc.h>
+#include <simics.h>
+#include <syscall.h>
+#include <memlib.h>
+
+/** @brief Default largest number of live blocks */
+#define MAX_LIVE 8192
+
+/** @brief Default number of free/malloc pairs timed per phase */
+#define CHURN 4000
+
+/** @brief Live blocks in the first phase */
+#define FIRST_LIVE 256
+
+bool mm_checkheap(int lineno);
+
+/** @brief The live blocks */
+unsigned char **live;
+
+/** @brief The sizes of the live blocks */
+int *live_size;
+
+/** @brief The bytes asked for by the live blocks */
+int live_bytes;
+
+/** @brief The state of the random numbers */
+unsigned int seed = 1;
+
+/** @brief Get the next random number.
+ *
+ *  @return A number in [0, 32768).
+ */
+int next_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+/** @brief Draw a request size: 70% up to 64, 25% up to 512, 5% up to 8K.
+ *
+ *  @return The size.
+ */
+int trace_size(void)
+{
+    int r = next_rand() % 100;
+
+    if (r < 70)
+        return 1 + next_rand() % 64;
+    if (r < 95)
+        return 1 + next_rand() % 512;
+    return 1 + next_rand() % 8192;
+}
+
+/** @brief Allocate slot i and fill it with its pattern.
+ *
+ *  Every 16th allocation is made by growing a smaller block with
+ *  _realloc instead.
+ *
+ *  @param i The slot.
+ *  @return Void.
+ */
+void fill(int i)
+{
+    int size = trace_size();
+
+    if (next_rand() % 16 == 0) {
+        live[i] = _realloc(_malloc(size / 2 + 1), size);
+    } else {
+        live[i] = _malloc(size);
+    }
+    if (!live[i])
+        panic("bench_malloc_trace: out of memory");
+    live_size[i] = size;
+    live_bytes += size;
+    memset(live[i], i & 0xff, size);
+}
+
+/** @brief Check slot i's pattern and free it.
+ *
+ *  @param i The slot.
+ *  @return Void.
+ */
+void drop(int i)
+{
+    int j;
+
+    for (j = 0; j < live_size[i]; j++) {
+        if (live[i][j] != (i & 0xff))
+            panic("bench_malloc_trace: block %d is corrupted", i);
+    }
+    _free(live[i]);
+    live[i] = NULL;
+    live_bytes -= live_size[i];
+}
+
+int main(int argc, char *argv[])
+{
+    int max_live = MAX_LIVE;
+    int churn = CHURN;
+    unsigned int start, ticks;
+    int nlive, i, k, heap, peak = 0;
+
+    if (argc > 1)
+        max_live = atoi(argv[1]);
+    if (argc > 2)
+        churn = atoi(argv[2]);
+
+    live = _malloc(max_live * sizeof(unsigned char *));
+    live_size = _malloc(max_live * sizeof(int));
+    if (!live || !live_size)
+        panic("bench_malloc_trace: out of memory");
+
+    printf("%d pairs per phase\n", churn);
+    printf("   live      ticks   pairs/ktick    heap(KB)  used(%%)\n");
+    nlive = 0;
+    for (k = FIRST_LIVE; k <= max_live; k *= 2) {
+        /* grow the live set, in random order */
+        while (nlive < k)
+            fill(nlive++);
+
+        start = get_ticks();
+        for (i = 0; i < churn; i++) {
+            int victim = next_rand() % nlive;
+            drop(victim);
+            fill(victim);
+        }
+        ticks = get_ticks() - start;
+        if (ticks == 0)
+            ticks = 1;
+
+        if (!mm_checkheap(__LINE__))
+            panic("bench_malloc_trace: heap check failed");
+        heap = mem_heapsize();
+        if (heap > peak)
+            peak = heap;
+        printf("%7d %10u %13u %11d %8d\n", nlive, ticks, (churn * 1000) / ticks,
+               heap / 1024, (int)((long long)live_bytes * 100 / heap));
+        lprintf("bench_malloc_trace: live %d ticks %u heap %d",
+                nlive, ticks, heap);
+    }
+
+    for (i = 0; i < nlive; i++)
+        drop(i);
+    if (!mm_checkheap(__LINE__))
+        panic("bench_malloc_trace: heap check failed");
+
+    _free(live);
+    _free(live_size);
+    printf("peak heap %d KB, %d KB after freeing everything\n",
+           peak / 1024, mem_heapsize() / 1024);
+    printf("bench_malloc_trace: PASS\n");
+    return 0;
+}
@@ -0,0 +1,153 @@
+/** @file bench_mutex.c
+ *  @brief Contended mutex benchmark.
+ *
+ *  For 2 to 64 threads, every thread takes the same mutex ITERS times
+ *  and does a little work in the critical section. We report the
+ *  elapsed ticks and the throughput in lock round trips per 1000 ticks.
+ *
+ *  The CPU the waiters burn is measured indirectly: a probe thread
+ *  counts loop iterations while the workers run. Waiters that spin eat
+ *  the probe's timeslices, waiters that park leave them to the probe,
+ *  so a higher probe rate means less CPU wasted on waiting.
+ *
+ *     USAGE: bench_mutex [spin_limit] [iters]
+ *
+ *  Run it with a huge spin_limit to get the old pure ticket spin. With
+ *  a THR_LOCKSTATS build, the hottest locks are printed at the end.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex.h>
+#include <lockstat.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Default number of lock round trips per thread */
+#define ITERS 2000
+
+/** @brief Work done inside the critical section */
+#define CS_WORK 50
+
+/** @brief The largest number of worker threads */
+#define MAX_THREADS 64
+
+/** @brief The contended lock */
+mutex_t lock;
+
+/** @brief Protected by lock */
+int counter;
+
+/** @brief Round trips per thread */
+int iters = ITERS;
+
+/** @brief Set when the probe should exit */
+int stop;
+
+/** @brief Loop iterations done by the probe */
+int probe_count;
+
+/** @brief Hammer the lock.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    int i, j;
+
+    for (i = 0; i < iters; i++) {
+        mutex_lock(&lock);
+        for (j = 0; j < CS_WORK; j++)
+            counter++;
+        mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/** @brief Count how much CPU is left over for other work.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *probe(void *arg)
+{
+    while (!stop)
+        probe_count++;
+    return NULL;
+}
+
+/** @brief Run one round with nthr workers and print the result.
+ *
+ *  @param nthr The number of worker threads.
+ *  @return Void.
+ */
+void run(int nthr)
+{
+    int tids[MAX_THREADS];
+    int probe_tid;
+    unsigned int start, ticks;
+    int i;
+
+    counter = 0;
+    stop = 0;
+    probe_count = 0;
+
+    start = get_ticks();
+    probe_tid = thr_create(probe, NULL);
+    for (i = 0; i < nthr; i++) {
+        tids[i] = thr_create(worker, NULL);
+        if (tids[i] < 0) {
+            panic("bench_mutex: thr_create failed");
+        }
+    }
+    for (i = 0; i < nthr; i++)
+        thr_join(tids[i], NULL);
+    ticks = get_ticks() - start;
+
+    stop = 1;
+    thr_join(probe_tid, NULL);
+
+    if (counter != nthr * iters * CS_WORK) {
+        panic("bench_mutex: counter is %d, expected %d",
+              counter, nthr * iters * CS_WORK);
+    }
+    if (ticks == 0)
+        ticks = 1;
+
+    printf("%7d %7d %10u %12u %12u\n", nthr, nthr * iters, ticks,
+           (nthr * iters * 1000) / ticks, probe_count / ticks);
+    lprintf("bench_mutex: threads %d ops %d ticks %u probe/tick %u",
+            nthr, nthr * iters, ticks, probe_count / ticks);
+}
+
+int main(int argc, char *argv[])
+{
+    int nthr;
+
+    if (argc > 1)
+        mutex_spin_limit = atoi(argv[1]);
+    if (argc > 2)
+        iters = atoi(argv[2]);
+
+    thr_init(STACK_SIZE);
+    mutex_init(&lock);
+    thr_lockstats_name(&lock, "bench lock");
+
+    printf("spin limit %d, %d round trips per thread\n",
+           mutex_spin_limit, iters);
+    printf("threads     ops      ticks  ops/ktick   probe/tick\n");
+    for (nthr = 2; nthr <= MAX_THREADS; nthr *= 2)
+        run(nthr);
+    thr_lockstats_dump(5);
+
+    mutex_destroy(&lock);
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/** @file bench_mutex_latency.c
+ *  @brief Lock latency with and without a deadline.
+ *
+ *  A few worker threads take turns holding the lock for HOLD ticks. A
+ *  latency-sensitive thread wants the lock every tick. With mutex_lock
+ *  it waits behind every worker in line. With mutex_lock_until it gives
+ *  up after its budget and does something else. We report how long its
+ *  lock calls took, worst case and on average, and how often it got the
+ *  lock.
+ *
+ *     USAGE: bench_mutex_latency [budget] [rounds]
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief The number of workers holding the lock */
+#define NWORKERS 4
+
+/** @brief How long a worker holds the lock, in ticks */
+#define HOLD 2
+
+/** @brief Default deadline of a timed attempt, in ticks */
+#define BUDGET 1
+
+/** @brief Default number of lock attempts of the measured thread */
+#define ROUNDS 200
+
+/** @brief The contended lock */
+mutex_t lock;
+
+/** @brief Set when the workers should exit */
+int stop;
+
+/** @brief Hold the lock for HOLD ticks over and over.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    while (!stop) {
+        mutex_lock(&lock);
+        sleep(HOLD);
+        mutex_unlock(&lock);
+        yield(-1);
+    }
+    return NULL;
+}
+
+/** @brief Measure rounds lock attempts and print the result.
+ *
+ *  @param timed 1 to use mutex_lock_until, 0 to use mutex_lock.
+ *  @param budget The deadline of a timed attempt, in ticks.
+ *  @param rounds The number of attempts.
+ *  @return Void.
+ */
+void measure(int timed, int budget, int rounds)
+{
+    unsigned int start, took, worst = 0, total = 0;
+    int i, got = 0;
+
+    for (i = 0; i < rounds; i++) {
+        start = get_ticks();
+        if (!timed) {
+            mutex_lock(&lock);
+            got++;
+            mutex_unlock(&lock);
+        } else if (mutex_lock_until(&lock, start + budget) == 0) {
+            got++;
+            mutex_unlock(&lock);
+        }
+        took = get_ticks() - start;
+        total += took;
+        if (took > worst)
+            worst = took;
+        sleep(1);
+    }
+
+    printf("%-16s %8d %8d %10u %10u\n",
+           timed ? "mutex_lock_until" : "mutex_lock", rounds, got, worst,
+           total / rounds);
+    lprintf("bench_mutex_latency: %s got %d of %d worst %u total %u",
+            timed ? "timed" : "blocking", got, rounds, worst, total);
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NWORKERS];
+    int budget = BUDGET, rounds = ROUNDS;
+    int i;
+
+    if (argc > 1)
+        budget = atoi(argv[1]);
+    if (argc > 2)
+        rounds = atoi(argv[2]);
+
+    thr_init(STACK_SIZE);
+    mutex_init(&lock);
+
+    stop = 0;
+    for (i = 0; i < NWORKERS; i++) {
+        tids[i] = thr_create(worker, NULL);
+        if (tids[i] < 0)
+            panic("bench_mutex_latency: thr_create failed");
+    }
+
+    printf("%d workers holding for %d ticks, budget %d ticks\n",
+           NWORKERS, HOLD, budget);
+    printf("call               rounds      got      worst   avg ticks\n");
+    measure(0, budget, rounds);
+    measure(1, budget, rounds);
+
+    stop = 1;
+    for (i = 0; i < NWORKERS; i++)
+        thr_join(tids[i], NULL);
+
+    mutex_destroy(&lock);
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/** @file bench_pool.c
+ *  @brief Object pool against malloc/free benchmark.
+ *
+ *  For objects of 16 to 256 bytes and 1 to 8 threads, every thread
+ *  allocates HELD objects, marks the first and the last byte of each,
+ *  and then checks the marks and frees them, ROUNDS times. Only the
+ *  ends are touched, so the ticks are mostly the allocator's. We run it
+ *  once through malloc/free and once through a pool_t of that object
+ *  size, and report the elapsed ticks of both.
+ *
+ *  Every pool object must also be aligned as asked in pool_init().
+ *
+ *     USAGE: bench_pool [rounds]
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <pool.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Default number of rounds per thread */
+#define ROUNDS 500
+
+/** @brief Objects a thread holds at once */
+#define HELD 32
+
+/** @brief The largest number of threads */
+#define MAX_THREADS 8
+
+/** @brief The smallest and the largest object size */
+#define MIN_SIZE 16
+#define MAX_SIZE 256
+
+/** @brief The alignment asked of the pool */
+#define ALIGN 16
+
+/** @brief The pool under test */
+pool_t pool;
+
+/** @brief 1 to go through the pool, 0 through malloc/free */
+int use_pool;
+
+/** @brief The object size of this round */
+int obj_size;
+
+/** @brief Rounds per thread */
+int rounds = ROUNDS;
+
+/** @brief Allocate, fill, check and free.
+ *
+ *  @param arg The thread's index.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    unsigned char *held[HELD];
+    unsigned char mark;
+    int r, i;
+
+    for (r = 0; r < rounds; r++) {
+        mark = (unsigned char)((int)arg * 31 + r);
+        for (i = 0; i < HELD; i++) {
+            held[i] = use_pool ? pool_alloc(&pool) : malloc(obj_size);
+            if (!held[i])
+                panic("bench_pool: out of memory");
+            if (use_pool && (unsigned int)held[i] % ALIGN != 0)
+                panic("bench_pool: object %p is misaligned", held[i]);
+            held[i][0] = mark + i;
+            held[i][obj_size - 1] = mark + i;
+        }
+        for (i = 0; i < HELD; i++) {
+            if (held[i][0] != (unsigned char)(mark + i) ||
+                held[i][obj_size - 1] != (unsigned char)(mark + i))
+                panic("bench_pool: object %p is corrupted", held[i]);
+            if (use_pool)
+                pool_free(&pool, held[i]);
+            else
+                free(held[i]);
+        }
+    }
+    return NULL;
+}
+
+/** @brief Run one round with nthr threads.
+ *
+ *  @param nthr The number of threads.
+ *  @return The elapsed ticks.
+ */
+unsigned int run(int nthr)
+{
+    int tids[MAX_THREADS];
+    unsigned int start;
+    int i;
+
+    if (use_pool && pool_init(&pool, obj_size, ALIGN) < 0)
+        panic("bench_pool: pool_init failed");
+
+    start = get_ticks();
+    for (i = 0; i < nthr; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0) {
+            panic("bench_pool: thr_create failed");
+        }
+    }
+    for (i = 0; i < nthr; i++)
+        thr_join(tids[i], NULL);
+
+    if (use_pool)
+        pool_destroy(&pool);
+    return get_ticks() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int malloc_ticks, pool_ticks;
+    int nthr;
+
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+
+    thr_init(STACK_SIZE);
+
+    printf("%d rounds of %d objects per thread\n", rounds, HELD);
+    printf("   size threads  malloc ticks    pool ticks\n");
+    for (obj_size = MIN_SIZE; obj_size <= MAX_SIZE; obj_size *= 2) {
+        for (nthr = 1; nthr <= MAX_THREADS; nthr *= 2) {
+            use_pool = 0;
+            malloc_ticks = run(nthr);
+            use_pool = 1;
+            pool_ticks = run(nthr);
+
+            printf("%7d %7d %13u %13u\n", obj_size, nthr,
+                   malloc_ticks, pool_ticks);
+            lprintf("bench_pool: size %d threads %d malloc %u pool %u",
+                    obj_size, nthr, malloc_ticks, pool_ticks);
+        }
+    }
+
+    thr_exit(NULL);
+    return 0;
+}
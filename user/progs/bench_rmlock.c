@@ -0,0 +1,191 @@
+/** @file bench_rmlock.c
+ *  @brief Read-mostly lookup benchmark, rmlock against rwlock.
+ *
+ *  For 2 to 32 readers, every reader looks up a small table ITERS times
+ *  under the lock for reading, while one writer updates the table every
+ *  WRITE_GAP ticks. We run it once on rwlock_t and once on rmlock_t, and
+ *  report the elapsed ticks, the lookups per 1000 ticks and the number
+ *  of writes that got in.
+ *
+ *  Every write keeps all the entries of the table equal, so a reader
+ *  that sees two different entries has run alongside a writer.
+ *
+ *     USAGE: bench_rmlock [iters]
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <rwlock.h>
+#include <rmlock.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Default number of lookups per reader */
+#define ITERS 5000
+
+/** @brief Entries in the table */
+#define TABLE_SIZE 16
+
+/** @brief Ticks between two writes */
+#define WRITE_GAP 2
+
+/** @brief The largest number of reader threads */
+#define MAX_READERS 32
+
+/** @brief The rwlock guarding table in the rwlock rounds */
+rwlock_t rw;
+
+/** @brief The rmlock guarding table in the rmlock rounds */
+rmlock_t rm;
+
+/** @brief 1 to run on rm, 0 to run on rw */
+int use_rm;
+
+/** @brief The table readers look up */
+int table[TABLE_SIZE];
+
+/** @brief Lookups per reader */
+int iters = ITERS;
+
+/** @brief Set when the writer should exit */
+int stop;
+
+/** @brief Writes done in this round */
+int writes;
+
+/** @brief Take the lock of this round.
+ *
+ *  @param type RWLOCK_READ or RWLOCK_WRITE.
+ *  @return Void.
+ */
+void bench_lock(int type)
+{
+    if (use_rm)
+        rmlock_lock(&rm, type);
+    else
+        rwlock_lock(&rw, type);
+}
+
+/** @brief Release the lock of this round.
+ *
+ *  @return Void.
+ */
+void bench_unlock(void)
+{
+    if (use_rm)
+        rmlock_unlock(&rm);
+    else
+        rwlock_unlock(&rw);
+}
+
+/** @brief Look up the table over and over.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *reader(void *arg)
+{
+    int i, j;
+
+    for (i = 0; i < iters; i++) {
+        bench_lock(RWLOCK_READ);
+        for (j = 1; j < TABLE_SIZE; j++) {
+            if (table[j] != table[0])
+                panic("bench_rmlock: write during a lookup");
+        }
+        bench_unlock();
+    }
+    return NULL;
+}
+
+/** @brief Update the table now and then until stop is set.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *writer(void *arg)
+{
+    int j;
+
+    while (!stop) {
+        bench_lock(RWLOCK_WRITE);
+        for (j = 0; j < TABLE_SIZE; j++)
+            table[j]++;
+        writes++;
+        bench_unlock();
+        sleep(WRITE_GAP);
+    }
+    return NULL;
+}
+
+/** @brief Run one round with nreaders readers and print the result.
+ *
+ *  @param nreaders The number of reader threads.
+ *  @return Void.
+ */
+void run(int nreaders)
+{
+    int tids[MAX_READERS];
+    int writer_tid;
+    unsigned int start, ticks;
+    int i;
+
+    stop = 0;
+    writes = 0;
+
+    start = get_ticks();
+    writer_tid = thr_create(writer, NULL);
+    for (i = 0; i < nreaders; i++) {
+        tids[i] = thr_create(reader, NULL);
+        if (tids[i] < 0) {
+            panic("bench_rmlock: thr_create failed");
+        }
+    }
+    for (i = 0; i < nreaders; i++)
+        thr_join(tids[i], NULL);
+    ticks = get_ticks() - start;
+
+    stop = 1;
+    thr_join(writer_tid, NULL);
+
+    if (ticks == 0)
+        ticks = 1;
+
+    printf("%-6s %7d %10u %14u %7d\n", use_rm ? "rmlock" : "rwlock",
+           nreaders, ticks, (nreaders * iters * 1000) / ticks, writes);
+    lprintf("bench_rmlock: %s readers %d ticks %u writes %d",
+            use_rm ? "rmlock" : "rwlock", nreaders, ticks, writes);
+}
+
+int main(int argc, char *argv[])
+{
+    int nreaders;
+
+    if (argc > 1)
+        iters = atoi(argv[1]);
+
+    thr_init(STACK_SIZE);
+    rwlock_init(&rw);
+    rmlock_init(&rm);
+
+    printf("%d lookups per reader, a write every %d ticks\n",
+           iters, WRITE_GAP);
+    printf("lock   readers      ticks  lookups/ktick  writes\n");
+    for (nreaders = 2; nreaders <= MAX_READERS; nreaders *= 2) {
+        use_rm = 0;
+        run(nreaders);
+        use_rm = 1;
+        run(nreaders);
+    }
+
+    rmlock_destroy(&rm);
+    rwlock_destroy(&rw);
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,301 @@
+/** @file bench_rwlock.c
+ *  @brief Reader/writer lock benchmark, phase-fair against writer
+ *         preference.
+ *
+ *  For 2 to 32 readers and a few writers, every reader takes the lock
+ *  for reading ITERS times and every writer takes it for writing
+ *  ITERS / 8 times, with a little work inside. We run it once on
+ *  rwlock_t and once on a copy of the old writer-preference lock, and
+ *  report the elapsed ticks, the read throughput in read sections per
+ *  1000 ticks, and the longest wait a reader and a writer saw, in ticks.
+ *
+ *  Under writer preference a steady stream of writers keeps readers out
+ *  for long stretches, which shows in the reader wait column. The
+ *  phase-fair lock bounds it by one write phase.
+ *
+ *     USAGE: bench_rwlock [iters] [writers]
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex.h>
+#include <cond.h>
+#include <rwlock.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Default number of read sections per reader */
+#define ITERS 2000
+
+/** @brief Default number of writers */
+#define WRITERS 2
+
+/** @brief Work done inside a read or write section */
+#define CS_WORK 50
+
+/** @brief The largest number of reader threads */
+#define MAX_READERS 32
+
+/** @brief The largest number of writer threads */
+#define MAX_WRITERS 8
+
+/** @brief The writer-preference lock rwlock_t used to be.
+ *
+ *  Readers stay out as long as any writer holds the lock or waits for
+ *  it; an unlocking writer hands the lock to the next writer first.
+ */
+typedef struct old_rwlock {
+    int num_reader;
+    int num_wait_writer;
+    int write_flag;
+    cond_t writer_cv;
+    cond_t reader_cv;
+    mutex_t mutex;
+} old_rwlock_t;
+
+/** @brief The lock under test */
+rwlock_t lock;
+
+/** @brief The baseline lock */
+old_rwlock_t old_lock;
+
+/** @brief 1 to run on old_lock, 0 to run on lock */
+int use_old;
+
+/** @brief Written by the writers, read by the readers */
+int shared;
+
+/** @brief Read sections per reader */
+int iters = ITERS;
+
+/** @brief Number of writer threads */
+int nwriters = WRITERS;
+
+/** @brief The longest time a reader waited for the lock, in ticks */
+unsigned int reader_max_wait;
+
+/** @brief The longest time a writer waited for the lock, in ticks */
+unsigned int writer_max_wait;
+
+/** @brief Initialize the baseline lock.
+ *
+ *  @param rw The lock.
+ *  @return Void.
+ */
+void old_rwlock_init(old_rwlock_t *rw)
+{
+    rw->num_reader = 0;
+    rw->num_wait_writer = 0;
+    rw->write_flag = 0;
+    cond_init(&rw->writer_cv);
+    cond_init(&rw->reader_cv);
+    mutex_init(&rw->mutex);
+}
+
+/** @brief Lock the baseline lock.
+ *
+ *  @param rw The lock.
+ *  @param type RWLOCK_READ or RWLOCK_WRITE.
+ *  @return Void.
+ */
+void old_rwlock_lock(old_rwlock_t *rw, int type)
+{
+    mutex_lock(&rw->mutex);
+    if (type == RWLOCK_READ) {
+        while (rw->num_wait_writer > 0 || rw->write_flag)
+            cond_wait(&rw->reader_cv, &rw->mutex);
+        rw->num_reader++;
+    } else {
+        rw->num_wait_writer++;
+        while (rw->write_flag || rw->num_reader > 0)
+            cond_wait(&rw->writer_cv, &rw->mutex);
+        rw->num_wait_writer--;
+        rw->write_flag = 1;
+    }
+    mutex_unlock(&rw->mutex);
+}
+
+/** @brief Unlock the baseline lock.
+ *
+ *  @param rw The lock.
+ *  @return Void.
+ */
+void old_rwlock_unlock(old_rwlock_t *rw)
+{
+    mutex_lock(&rw->mutex);
+    if (rw->write_flag) {
+        rw->write_flag = 0;
+        if (rw->num_wait_writer == 0)
+            cond_broadcast(&rw->reader_cv);
+        else
+            cond_signal(&rw->writer_cv);
+    } else {
+        rw->num_reader--;
+        if (rw->num_reader == 0)
+            cond_signal(&rw->writer_cv);
+    }
+    mutex_unlock(&rw->mutex);
+}
+
+/** @brief Destroy the baseline lock.
+ *
+ *  @param rw The lock.
+ *  @return Void.
+ */
+void old_rwlock_destroy(old_rwlock_t *rw)
+{
+    cond_destroy(&rw->writer_cv);
+    cond_destroy(&rw->reader_cv);
+    mutex_destroy(&rw->mutex);
+}
+
+/** @brief Take the lock under test for this round and time the wait.
+ *
+ *  @param type RWLOCK_READ or RWLOCK_WRITE.
+ *  @param max_wait Updated with the wait if it is the longest so far.
+ *  @return Void.
+ */
+void bench_lock(int type, unsigned int *max_wait)
+{
+    unsigned int start = get_ticks();
+    unsigned int wait;
+
+    if (use_old)
+        old_rwlock_lock(&old_lock, type);
+    else
+        rwlock_lock(&lock, type);
+
+    /* racy max, good enough for a report */
+    wait = get_ticks() - start;
+    if (wait > *max_wait)
+        *max_wait = wait;
+}
+
+/** @brief Release the lock under test for this round.
+ *
+ *  @return Void.
+ */
+void bench_unlock(void)
+{
+    if (use_old)
+        old_rwlock_unlock(&old_lock);
+    else
+        rwlock_unlock(&lock);
+}
+
+/** @brief Read shared over and over.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *reader(void *arg)
+{
+    int i, j, seen;
+
+    for (i = 0; i < iters; i++) {
+        bench_lock(RWLOCK_READ, &reader_max_wait);
+        seen = shared;
+        for (j = 0; j < CS_WORK; j++) {
+            if (shared != seen)
+                panic("bench_rwlock: write during a read section");
+        }
+        bench_unlock();
+    }
+    return NULL;
+}
+
+/** @brief Update shared over and over.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *writer(void *arg)
+{
+    int i, j;
+
+    for (i = 0; i < iters / 8; i++) {
+        bench_lock(RWLOCK_WRITE, &writer_max_wait);
+        for (j = 0; j < CS_WORK; j++)
+            shared++;
+        bench_unlock();
+    }
+    return NULL;
+}
+
+/** @brief Run one round with nreaders readers and print the result.
+ *
+ *  @param nreaders The number of reader threads.
+ *  @return Void.
+ */
+void run(int nreaders)
+{
+    int tids[MAX_READERS + MAX_WRITERS];
+    unsigned int start, ticks;
+    int i, n = 0;
+
+    shared = 0;
+    reader_max_wait = 0;
+    writer_max_wait = 0;
+
+    start = get_ticks();
+    for (i = 0; i < nreaders + nwriters; i++) {
+        tids[n] = thr_create(i < nwriters ? writer : reader, NULL);
+        if (tids[n] < 0) {
+            panic("bench_rwlock: thr_create failed");
+        }
+        n++;
+    }
+    for (i = 0; i < n; i++)
+        thr_join(tids[i], NULL);
+    ticks = get_ticks() - start;
+
+    if (shared != nwriters * (iters / 8) * CS_WORK) {
+        panic("bench_rwlock: shared is %d, expected %d",
+              shared, nwriters * (iters / 8) * CS_WORK);
+    }
+    if (ticks == 0)
+        ticks = 1;
+
+    printf("%-6s %7d %10u %12u %10u %10u\n", use_old ? "old" : "fair",
+           nreaders, ticks, (nreaders * iters * 1000) / ticks,
+           reader_max_wait, writer_max_wait);
+    lprintf("bench_rwlock: %s readers %d ticks %u rwait %u wwait %u",
+            use_old ? "old" : "fair", nreaders, ticks,
+            reader_max_wait, writer_max_wait);
+}
+
+int main(int argc, char *argv[])
+{
+    int nreaders;
+
+    if (argc > 1)
+        iters = atoi(argv[1]);
+    if (argc > 2)
+        nwriters = atoi(argv[2]);
+    if (nwriters < 0 || nwriters > MAX_WRITERS)
+        panic("bench_rwlock: at most %d writers", MAX_WRITERS);
+
+    thr_init(STACK_SIZE);
+    rwlock_init(&lock);
+    old_rwlock_init(&old_lock);
+
+    printf("%d writers, %d read sections per reader\n", nwriters, iters);
+    printf("lock   readers      ticks  reads/ktick  max rwait  max wwait\n");
+    for (nreaders = 2; nreaders <= MAX_READERS; nreaders *= 2) {
+        use_old = 1;
+        run(nreaders);
+        use_old = 0;
+        run(nreaders);
+    }
+
+    old_rwlock_destroy(&old_lock);
+    rwlock_destroy(&lock);
+    thr_exit(NULL);
+    return 0;
+}
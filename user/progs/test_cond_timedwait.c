@@ -0,0 +1,160 @@
+/** @file test_cond_timedwait.c
+ *  @brief Test cond_timedwait and sem_timedwait.
+ *
+ *  A wait nobody signals must time out, not before its deadline. A wait
+ *  that is signaled in time must not. Then many timed waiters run at
+ *  once against a slow producer, and every wait must end either way.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex.h>
+#include <cond_ext.h>
+#include <sem_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Timed waiters in the crowd test */
+#define NTHR 16
+
+/** @brief Waits per crowd thread */
+#define ITERS 20
+
+mutex_t lock;
+cond_t cv;
+sem_t sem;
+
+/** @brief Tokens handed out by the producer, protected by lock */
+int tokens;
+
+/** @brief Waits that got a token or timed out, protected by lock */
+int got, timedout;
+
+/** @brief Signal the cv after a short nap.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *signaler(void *arg)
+{
+    sleep(2);
+    mutex_lock(&lock);
+    tokens++;
+    cond_signal(&cv);
+    mutex_unlock(&lock);
+    sem_signal(&sem);
+    return NULL;
+}
+
+/** @brief Wait for tokens with short deadlines.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *waiter(void *arg)
+{
+    int i, ret;
+
+    for (i = 0; i < ITERS; i++) {
+        mutex_lock(&lock);
+        ret = 0;
+        while (tokens == 0 && ret == 0)
+            ret = cond_timedwait(&cv, &lock, get_ticks() + 1 + i % 3);
+        if (tokens > 0) {
+            tokens--;
+            got++;
+        } else {
+            timedout++;
+        }
+        mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/** @brief Hand out tokens slowly.
+ *
+ *  @param arg The number of tokens.
+ *  @return NULL.
+ */
+void *producer(void *arg)
+{
+    int i;
+
+    for (i = 0; i < (int)arg; i++) {
+        mutex_lock(&lock);
+        tokens++;
+        if (i % 4 == 0)
+            cond_broadcast(&cv);
+        else
+            cond_signal(&cv);
+        mutex_unlock(&lock);
+        if (i % 8 == 0)
+            sleep(1);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NTHR + 1];
+    unsigned int start, deadline;
+    int i;
+
+    thr_init(STACK_SIZE);
+    mutex_init(&lock);
+    cond_init(&cv);
+    sem_init(&sem, 0);
+
+    /* nobody signals */
+    mutex_lock(&lock);
+    start = get_ticks();
+    deadline = start + 3;
+    if (cond_timedwait(&cv, &lock, deadline) == 0)
+        panic("test_cond_timedwait: unsignaled wait returned 0");
+    if ((int)(get_ticks() - deadline) < 0)
+        panic("test_cond_timedwait: timed out before the deadline");
+    mutex_unlock(&lock);
+    if (sem_timedwait(&sem, get_ticks() + 2) == 0)
+        panic("test_cond_timedwait: sem_timedwait got a zero semaphore");
+
+    /* signaled in time */
+    tids[0] = thr_create(signaler, NULL);
+    mutex_lock(&lock);
+    while (tokens == 0) {
+        if (cond_timedwait(&cv, &lock, get_ticks() + 1000) < 0)
+            panic("test_cond_timedwait: signaled wait timed out");
+    }
+    tokens--;
+    mutex_unlock(&lock);
+    if (sem_timedwait(&sem, get_ticks() + 1000) != 0)
+        panic("test_cond_timedwait: signaled sem_timedwait timed out");
+    thr_join(tids[0], NULL);
+
+    /* a crowd */
+    got = timedout = 0;
+    for (i = 0; i < NTHR; i++) {
+        tids[i] = thr_create(waiter, NULL);
+        if (tids[i] < 0)
+            panic("test_cond_timedwait: thr_create failed");
+    }
+    tids[NTHR] = thr_create(producer, (void *)(NTHR * ITERS / 2));
+    for (i = 0; i <= NTHR; i++)
+        thr_join(tids[i], NULL);
+    if (got + timedout != NTHR * ITERS)
+        panic("test_cond_timedwait: %d waits ended, expected %d",
+              got + timedout, NTHR * ITERS);
+    if (got + tokens != NTHR * ITERS / 2)
+        panic("test_cond_timedwait: tokens lost");
+
+    printf("test_cond_timedwait: PASS (%d got, %d timed out)\n", got,
+           timedout);
+    lprintf("test_cond_timedwait: PASS");
+    thr_exit(NULL);
+    return 0;
+}
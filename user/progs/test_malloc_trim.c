@@ -0,0 +1,155 @@
+/** @file test_malloc_trim.c
+ *  @brief Test that the heap allocator gives memory back.
+ *
+ *  First a burst: we allocate BURST_BLOCKS blocks, free them all, and
+ *  check that the heap shrinks back to about its size before the burst
+ *  instead of staying at its high-water mark. The slack it keeps at the
+ *  top must then serve a block without growing the heap again.
+ *
+ *  Then the very large blocks: each gets a run of pages of its own. We
+ *  fill them, grow one with _realloc, and check the contents. After they
+ *  are freed, their pages must be unmapped, so we can map them ourselves.
+ *
+ *  Last, very large blocks of growing sizes, each allocated before the
+ *  one before it is freed, as a growing realloc'd buffer does. That uses
+ *  up the ranges of addresses for runs, and then every block must still
+ *  come from the heap.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <malloc.h>
+#include <memlib.h>
+#include <simics.h>
+#include <syscall.h>
+
+/** @brief Blocks allocated in the burst */
+#define BURST_BLOCKS 2048
+
+/** @brief Size of a block of the burst */
+#define BURST_SIZE 4000
+
+/** @brief Number of very large blocks */
+#define NRUNS 4
+
+/** @brief Size of a very large block */
+#define RUN_SIZE (1024 * 1024)
+
+/** @brief Growing blocks, more than MEM_MAX_RUNS in memlib.c */
+#define GROW_BLOCKS 80
+
+bool mm_checkheap(int lineno);
+
+/** @brief The blocks of the burst */
+char *burst[BURST_BLOCKS];
+
+/** @brief The very large blocks */
+char *runs[NRUNS];
+
+/** @brief Check that every byte of a block is c.
+ *
+ *  @param p The block.
+ *  @param len Its size.
+ *  @param c The byte.
+ *  @return Void.
+ */
+void check_fill(char *p, int len, char c)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] != c)
+            panic("test_malloc_trim: block %p is corrupted at %d", p, i);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int before, top, after, i, len;
+    char *prev, *next;
+    void *page;
+
+    /* get the heap started */
+    _free(_malloc(1));
+    before = mem_heapsize();
+
+    for (i = 0; i < BURST_BLOCKS; i++) {
+        burst[i] = _malloc(BURST_SIZE);
+        if (!burst[i])
+            panic("test_malloc_trim: out of memory");
+        memset(burst[i], i, BURST_SIZE);
+    }
+    top = mem_heapsize();
+    for (i = 0; i < BURST_BLOCKS; i++) {
+        check_fill(burst[i], BURST_SIZE, (char)i);
+        _free(burst[i]);
+    }
+    after = mem_heapsize();
+    if (!mm_checkheap(__LINE__))
+        panic("test_malloc_trim: heap check failed");
+
+    printf("heap before %d, at the top %d, after %d bytes\n",
+           before, top, after);
+    if (after > before + 2 * mm_trim_threshold)
+        panic("test_malloc_trim: the heap was not trimmed");
+
+    _free(_malloc(mm_trim_threshold / 2));
+    if (mem_heapsize() != after)
+        panic("test_malloc_trim: no slack was kept at the top of the heap");
+
+    for (i = 0; i < NRUNS; i++) {
+        runs[i] = _malloc(RUN_SIZE);
+        if (!runs[i])
+            panic("test_malloc_trim: out of memory");
+        if ((unsigned int)runs[i] % 16 != 0)
+            panic("test_malloc_trim: run %p is misaligned", runs[i]);
+        memset(runs[i], i, RUN_SIZE);
+    }
+    /* runs are not on the heap */
+    if (mem_heapsize() != after)
+        panic("test_malloc_trim: a run went on the heap");
+
+    runs[0] = _realloc(runs[0], 2 * RUN_SIZE);
+    if (!runs[0])
+        panic("test_malloc_trim: out of memory");
+    check_fill(runs[0], RUN_SIZE, 0);
+
+    for (i = 0; i < NRUNS; i++) {
+        if (i > 0)
+            check_fill(runs[i], RUN_SIZE, (char)i);
+        _free(runs[i]);
+        /* the run is unmapped, its first page is ours to map */
+        page = (void *)((unsigned int)runs[i] & ~(PAGE_SIZE - 1));
+        if (new_pages(page, PAGE_SIZE) < 0)
+            panic("test_malloc_trim: run %p is still mapped", runs[i]);
+        remove_pages(page);
+    }
+
+    prev = NULL;
+    for (i = 0; i < GROW_BLOCKS; i++) {
+        len = mm_run_threshold + i * PAGE_SIZE;
+        next = _malloc(len);
+        if (!next)
+            panic("test_malloc_trim: growing block %d of %d bytes failed",
+                  i, len);
+        next[0] = next[len - 1] = (char)i;
+        if (prev) {
+            if (prev[0] != (char)(i - 1) || prev[len - PAGE_SIZE - 1] !=
+                (char)(i - 1))
+                panic("test_malloc_trim: growing block %p is corrupted",
+                      prev);
+            _free(prev);
+        }
+        prev = next;
+    }
+    _free(prev);
+    if (!mm_checkheap(__LINE__))
+        panic("test_malloc_trim: heap check failed");
+
+    printf("test_malloc_trim: PASS\n");
+    lprintf("test_malloc_trim: PASS");
+    return 0;
+}
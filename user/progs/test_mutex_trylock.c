@@ -0,0 +1,125 @@
+/** @file test_mutex_trylock.c
+ *  @brief Test mutex_trylock and mutex_lock_until.
+ *
+ *  First the single-threaded cases, then a mix of blocking, timed and
+ *  try lockers on one mutex. Timed lockers give up on their tickets all
+ *  the time, and every other locker must still get through, with the
+ *  counter matching the number of successful acquisitions.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Threads in the mixed test, a multiple of 3 */
+#define NTHR 9
+
+/** @brief Lock attempts per thread */
+#define ITERS 500
+
+/** @brief The lock everybody fights for */
+mutex_t lock;
+
+/** @brief Protected by lock */
+int counter;
+
+/** @brief Successful acquisitions, per thread */
+int got[NTHR];
+
+/** @brief Lock ITERS times, the way the argument says.
+ *
+ *  @param arg The thread's index, index % 3 picks the lock call.
+ *  @return NULL.
+ */
+void *locker(void *arg)
+{
+    int id = (int)arg;
+    int i, ok;
+
+    for (i = 0; i < ITERS; i++) {
+        switch (id % 3) {
+        case 0:
+            mutex_lock(&lock);
+            ok = 1;
+            break;
+        case 1:
+            ok = (mutex_lock_until(&lock, get_ticks() + i % 3) == 0);
+            break;
+        default:
+            ok = (mutex_trylock(&lock) == 0);
+            break;
+        }
+        if (ok) {
+            counter++;
+            got[id]++;
+            if (i % 50 == 0)
+                yield(-1);
+            mutex_unlock(&lock);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NTHR];
+    int i, total;
+
+    thr_init(STACK_SIZE);
+    mutex_init(&lock);
+
+    /* a free lock can be taken, a held one can't */
+    if (mutex_trylock(&lock) != 0)
+        panic("test_mutex_trylock: trylock of a free lock failed");
+    if (mutex_trylock(&lock) == 0)
+        panic("test_mutex_trylock: trylock of a held lock succeeded");
+    if (mutex_lock_until(&lock, get_ticks() + 5) == 0)
+        panic("test_mutex_trylock: lock_until of a held lock succeeded");
+    mutex_unlock(&lock);
+
+    /* the abandoned ticket must not block the lock */
+    if (mutex_lock_until(&lock, get_ticks() + 5) != 0)
+        panic("test_mutex_trylock: lock_until of a free lock failed");
+    mutex_unlock(&lock);
+    if (mutex_trylock(&lock) != 0)
+        panic("test_mutex_trylock: lock stuck after abandoned ticket");
+    mutex_unlock(&lock);
+
+    /* everybody at once */
+    for (i = 0; i < NTHR; i++) {
+        got[i] = 0;
+        tids[i] = thr_create(locker, (void *)i);
+        if (tids[i] < 0)
+            panic("test_mutex_trylock: thr_create failed");
+    }
+    total = 0;
+    for (i = 0; i < NTHR; i++) {
+        thr_join(tids[i], NULL);
+        total += got[i];
+    }
+    for (i = 0; i < NTHR; i += 3) {
+        if (got[i] != ITERS)
+            panic("test_mutex_trylock: blocking locker got %d of %d",
+                  got[i], ITERS);
+    }
+    if (counter != total)
+        panic("test_mutex_trylock: counter %d, expected %d", counter, total);
+    if (mutex_trylock(&lock) != 0)
+        panic("test_mutex_trylock: lock stuck at the end");
+    mutex_unlock(&lock);
+
+    mutex_destroy(&lock);
+    printf("test_mutex_trylock: PASS (%d of %d acquisitions)\n", total,
+           NTHR * ITERS);
+    lprintf("test_mutex_trylock: PASS");
+    thr_exit(NULL);
+    return 0;
+}
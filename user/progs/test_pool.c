@@ -0,0 +1,253 @@
+/** @file test_pool.c
+ *  @brief Test object pools under the threads' caches.
+ *
+ *  NTHREADS threads, the main thread among them, live through all the
+ *  ROUNDS rounds and use NPOOLS pools, more than a thread has cache
+ *  slots for. In each round every thread allocates HELD objects from
+ *  every pool and fills them with its mark. Then every thread checks and
+ *  frees the objects of the next thread, so objects are freed by another
+ *  thread than the one that allocated them.
+ *
+ *  Between the rounds the main thread starts a thread that fills its
+ *  caches and exits with them, checks that no pool has more slabs than
+ *  the objects in use can explain, and destroys some pools and
+ *  initializes them again at the same address with another object size.
+ *  The threads still have slots of the destroyed pools, which must not
+ *  hand out objects of the old slabs. Pool 0 is never destroyed, so the
+ *  objects of exited threads must come back to it.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <barrier.h>
+#include <pool.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Threads, the main thread included */
+#define NTHREADS 8
+
+/** @brief Pools, more than THR_POOL_SLOTS in thr_internals.h */
+#define NPOOLS 7
+
+/** @brief Rounds of allocating and freeing */
+#define ROUNDS 100
+
+/** @brief Objects a thread holds of each pool */
+#define HELD 16
+
+/** @brief Objects the exiting thread caches of each pool */
+#define SHORT_HELD 48
+
+/** @brief The most objects a thread caches, POOL_CACHE_MAX in pool.c */
+#define CACHE_MAX 64
+
+/** @brief Object sizes pools are initialized with */
+#define NSIZES 5
+int sizes[NSIZES] = { 16, 24, 64, 100, 256 };
+
+/** @brief The pools */
+pool_t pools[NPOOLS];
+
+/** @brief The object size of each pool */
+int obj_size[NPOOLS];
+
+/** @brief The objects each thread holds */
+unsigned char *held[NTHREADS][NPOOLS][HELD];
+
+/** @brief Separates the phases of a round */
+barrier_t bar;
+
+/** @brief The mark of an object.
+ *
+ *  @param id The thread that allocated it.
+ *  @param round The round.
+ *  @param p The pool.
+ *  @param i The object's index.
+ *  @return The byte to fill it with.
+ */
+unsigned char mark(int id, int round, int p, int i)
+{
+    return (unsigned char)(id * 131 + round * 31 + p * 7 + i + 1);
+}
+
+/** @brief Allocate an object and fill it with a mark.
+ *
+ *  @param p The pool.
+ *  @param c The mark.
+ *  @return The object.
+ */
+unsigned char *get(int p, unsigned char c)
+{
+    unsigned char *obj = pool_alloc(&pools[p]);
+
+    if (obj == NULL)
+        panic("test_pool: pool %d is out of memory", p);
+    memset(obj, c, obj_size[p]);
+    return obj;
+}
+
+/** @brief Check that an object still has its mark, and free it.
+ *
+ *  @param p The pool.
+ *  @param obj The object.
+ *  @param c The mark.
+ *  @return Void.
+ */
+void put(int p, unsigned char *obj, unsigned char c)
+{
+    int i;
+
+    for (i = 0; i < obj_size[p]; i++) {
+        if (obj[i] != c)
+            panic("test_pool: object %p of pool %d is corrupted", obj, p);
+    }
+    pool_free(&pools[p], obj);
+}
+
+/** @brief Initialize a pool.
+ *
+ *  @param p The pool.
+ *  @param size The object size.
+ *  @return Void.
+ */
+void init(int p, int size)
+{
+    if (pool_init(&pools[p], size, sizeof(void *)) < 0)
+        panic("test_pool: pool_init failed");
+    obj_size[p] = size;
+}
+
+/** @brief Fill the caches of every pool, and exit with them.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *short_lived(void *arg)
+{
+    unsigned char *objs[SHORT_HELD];
+    int p, i;
+
+    for (p = 0; p < NPOOLS; p++) {
+        for (i = 0; i < SHORT_HELD; i++)
+            objs[i] = get(p, mark(NTHREADS, 0, p, i));
+        for (i = 0; i < SHORT_HELD; i++)
+            put(p, objs[i], mark(NTHREADS, 0, p, i));
+    }
+    return NULL;
+}
+
+/** @brief Check that a pool has no more slabs than it needs.
+ *
+ *  At most every thread holds HELD objects and caches CACHE_MAX, and the
+ *  exiting thread caches CACHE_MAX. Each thread may also have left part
+ *  of a slab it took a batch from.
+ *
+ *  @param p The pool.
+ *  @return Void.
+ */
+void check_slabs(int p)
+{
+    int objs = NTHREADS * (HELD + CACHE_MAX) + CACHE_MAX;
+    int per_slab = pools[p].per_slab;
+    int most = (objs + per_slab - 1) / per_slab + NTHREADS + 1;
+    void *slab;
+    int n = 0;
+
+    for (slab = pools[p].slabs; slab != NULL; slab = *(void **)slab)
+        n++;
+    if (n > most)
+        panic("test_pool: pool %d has %d slabs, at most %d needed",
+              p, n, most);
+}
+
+/** @brief Run the rounds as one of the threads.
+ *
+ *  @param arg The thread's index, 0 for the main thread.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    int id = (int)arg;
+    int next = (id + 1) % NTHREADS;
+    int round, p, i, tid;
+
+    for (round = 0; round < ROUNDS; round++) {
+        for (p = 0; p < NPOOLS; p++) {
+            for (i = 0; i < HELD; i++)
+                held[id][p][i] = get(p, mark(id, round, p, i));
+        }
+        barrier_wait(&bar);
+
+        /* free the next thread's objects */
+        for (p = 0; p < NPOOLS; p++) {
+            for (i = 0; i < HELD; i++)
+                put(p, held[next][p][i], mark(next, round, p, i));
+        }
+        barrier_wait(&bar);
+
+        if (id == 0) {
+            tid = thr_create(short_lived, NULL);
+            if (tid < 0)
+                panic("test_pool: thr_create failed");
+            thr_join(tid, NULL);
+
+            for (p = 0; p < NPOOLS; p++)
+                check_slabs(p);
+
+            /* every pool but pool 0 is renewed every third round */
+            for (p = 1; p < NPOOLS; p++) {
+                if ((p + round) % 3 == 0) {
+                    pool_destroy(&pools[p]);
+                    init(p, sizes[(p + round) % NSIZES]);
+                }
+            }
+        }
+        barrier_wait(&bar);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NTHREADS];
+    int p, i;
+
+    thr_init(STACK_SIZE);
+
+    for (p = 0; p < NPOOLS; p++)
+        init(p, sizes[p % NSIZES]);
+    if (barrier_init(&bar, NTHREADS) < 0)
+        panic("test_pool: barrier_init failed");
+
+    for (i = 1; i < NTHREADS; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0)
+            panic("test_pool: thr_create failed");
+    }
+    worker((void *)0);
+    for (i = 1; i < NTHREADS; i++)
+        thr_join(tids[i], NULL);
+
+    /* the workers exited with objects cached, they are the pools' again */
+    for (p = 0; p < NPOOLS; p++)
+        check_slabs(p);
+    short_lived(NULL);
+    for (p = 0; p < NPOOLS; p++) {
+        check_slabs(p);
+        pool_destroy(&pools[p]);
+    }
+    barrier_destroy(&bar);
+
+    printf("test_pool: PASS\n");
+    lprintf("test_pool: PASS");
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/** @file test_rwlock_upgrade.c
+ *  @brief Test rwlock_trylock, rwlock_lock_until and the upgrades.
+ *
+ *  First some single-threaded checks of what trylock and tryupgrade
+ *  allow. Then workers mix every way of taking the lock, upgrading
+ *  half of their read sections, while counting the readers and writers
+ *  inside. A writer must always be alone, and every write must land.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <rwlock_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Worker threads */
+#define NTHR 8
+
+/** @brief Rounds per worker */
+#define ITERS 400
+
+/** @brief The lock under test */
+rwlock_t lock;
+
+/** @brief Readers inside, updated atomically */
+int readers;
+
+/** @brief Writers inside, updated atomically */
+int writers;
+
+/** @brief Protected by lock */
+int counter;
+
+/** @brief Writes that got in, updated atomically */
+int writes;
+
+/** @brief Check that a writer is alone and do a write.
+ *
+ *  @return Void.
+ */
+void write_section(void)
+{
+    if (xadd_wrapper(&writers) != 0 || readers != 0)
+        panic("test_rwlock_upgrade: writer is not alone");
+    counter++;
+    xadd_wrapper(&writes);
+    yield(-1);
+    xaddn_wrapper(&writers, -1);
+}
+
+/** @brief Take the lock in every way there is.
+ *
+ *  @param arg The worker's index.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    int id = (int)arg;
+    int i, got;
+
+    for (i = 0; i < ITERS; i++) {
+        switch ((id + i) % 4) {
+        case 0:
+            rwlock_lock(&lock, RWLOCK_READ);
+            got = 0;
+            break;
+        case 1:
+            got = rwlock_trylock(&lock, RWLOCK_READ);
+            break;
+        case 2:
+            got = rwlock_lock_until(&lock, RWLOCK_READ, get_ticks() + 1);
+            break;
+        default:
+            if (rwlock_lock_until(&lock, RWLOCK_WRITE, get_ticks() + 1) == 0) {
+                write_section();
+                rwlock_unlock(&lock);
+            }
+            continue;
+        }
+        if (got < 0)
+            continue;
+
+        xadd_wrapper(&readers);
+        if (writers != 0)
+            panic("test_rwlock_upgrade: reader next to a writer");
+        yield(-1);
+        xaddn_wrapper(&readers, -1);
+
+        /* leave the reader count before asking, the upgrade makes us a
+           writer if it works */
+        if (i % 2 == 0 && (rwlock_tryupgrade(&lock) == 0 ||
+                           rwlock_upgrade(&lock) == 0)) {
+            write_section();
+        }
+        rwlock_unlock(&lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NTHR];
+    int i;
+
+    thr_init(STACK_SIZE);
+    rwlock_init(&lock);
+
+    /* readers share, writers don't */
+    if (rwlock_trylock(&lock, RWLOCK_READ) < 0 ||
+        rwlock_trylock(&lock, RWLOCK_READ) < 0)
+        panic("test_rwlock_upgrade: trylock failed on a read lock");
+    if (rwlock_trylock(&lock, RWLOCK_WRITE) == 0)
+        panic("test_rwlock_upgrade: got the write lock next to readers");
+    if (rwlock_lock_until(&lock, RWLOCK_WRITE, get_ticks() + 2) == 0)
+        panic("test_rwlock_upgrade: lock_until did not time out");
+    if (rwlock_tryupgrade(&lock) == 0)
+        panic("test_rwlock_upgrade: upgraded next to another reader");
+    rwlock_unlock(&lock);
+    if (rwlock_tryupgrade(&lock) < 0)
+        panic("test_rwlock_upgrade: sole reader could not upgrade");
+    if (rwlock_trylock(&lock, RWLOCK_READ) == 0)
+        panic("test_rwlock_upgrade: got a read lock next to the writer");
+    rwlock_downgrade(&lock);
+    if (rwlock_upgrade(&lock) < 0)
+        panic("test_rwlock_upgrade: sole reader could not upgrade");
+    rwlock_unlock(&lock);
+
+    for (i = 0; i < NTHR; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0)
+            panic("test_rwlock_upgrade: thr_create failed");
+    }
+    for (i = 0; i < NTHR; i++)
+        thr_join(tids[i], NULL);
+
+    if (counter != writes)
+        panic("test_rwlock_upgrade: %d writes but counter is %d",
+              writes, counter);
+    if (rwlock_trylock(&lock, RWLOCK_WRITE) < 0)
+        panic("test_rwlock_upgrade: lock still held at the end");
+    rwlock_unlock(&lock);
+
+    rwlock_destroy(&lock);
+    printf("test_rwlock_upgrade: %d writes\n", writes);
+    printf("test_rwlock_upgrade: PASS\n");
+    lprintf("test_rwlock_upgrade: PASS");
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/** @file test_sem_batch.c
+ *  @brief Test sem_trywait, sem_wait_n and sem_signal_n.
+ *
+ *  Workers take one or several tokens of a small pool in every way the
+ *  semaphore offers and check that no more than POOL tokens are ever out
+ *  at once. At the end every token must be back.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <sem_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Tokens in the pool */
+#define POOL 3
+
+/** @brief Worker threads */
+#define NTHR 8
+
+/** @brief Rounds per worker */
+#define ITERS 300
+
+/** @brief The pool */
+sem_t sem;
+
+/** @brief Tokens taken out right now, updated atomically */
+int out;
+
+/** @brief Take tokens, hold them for a moment and give them back.
+ *
+ *  @param arg The worker's index.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    int id = (int)arg;
+    int i, j, k;
+
+    for (i = 0; i < ITERS; i++) {
+        k = 1;
+        switch ((id + i) % 4) {
+        case 0:
+            sem_wait(&sem);
+            break;
+        case 1:
+            k = 1 + i % POOL;
+            sem_wait_n(&sem, k);
+            break;
+        case 2:
+            if (sem_trywait(&sem) < 0)
+                continue;
+            break;
+        default:
+            if (sem_timedwait(&sem, get_ticks() + 1) < 0)
+                continue;
+            break;
+        }
+
+        for (j = 0; j < k; j++) {
+            if (xadd_wrapper(&out) >= POOL)
+                panic("test_sem_batch: more than %d tokens out", POOL);
+        }
+        yield(-1);
+        for (j = 0; j < k; j++)
+            xaddn_wrapper(&out, -1);
+
+        if (k > 1)
+            sem_signal_n(&sem, k);
+        else
+            sem_signal(&sem);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NTHR];
+    int i;
+
+    thr_init(STACK_SIZE);
+    sem_init(&sem, POOL);
+
+    for (i = 0; i < NTHR; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0)
+            panic("test_sem_batch: thr_create failed");
+    }
+    for (i = 0; i < NTHR; i++)
+        thr_join(tids[i], NULL);
+
+    /* all tokens are back, and nothing more */
+    for (i = 0; i < POOL; i++) {
+        if (sem_trywait(&sem) < 0)
+            panic("test_sem_batch: token %d is missing", i);
+    }
+    if (sem_trywait(&sem) == 0)
+        panic("test_sem_batch: an extra token showed up");
+    sem_signal_n(&sem, POOL);
+
+    sem_destroy(&sem);
+    printf("test_sem_batch: PASS\n");
+    lprintf("test_sem_batch: PASS");
+    thr_exit(NULL);
+    return 0;
+}
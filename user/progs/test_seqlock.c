@@ -0,0 +1,169 @@
+/** @file test_seqlock.c
+ *  @brief Stress test for seqlock_t.
+ *
+ *  Writers keep every field of a small view struct equal to the same
+ *  generation number and bump it over and over. Readers copy the struct
+ *  out with seqlock_read_begin/retry, and now and then yield in the
+ *  middle of the copy so that writers run across it.
+ *
+ *  A copy with fields from different generations is torn. Every torn
+ *  copy must be caught by seqlock_read_retry(), and every copy it lets
+ *  through must be whole. At the end we print how many torn copies were
+ *  caught; the test fails if none was, since then the retry path never
+ *  ran.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread.h>
+#include <seqlock.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Reader threads */
+#define NREADERS 6
+
+/** @brief Writer threads */
+#define NWRITERS 2
+
+/** @brief Copies per reader */
+#define ITERS 3000
+
+/** @brief Writes per writer */
+#define WRITES 3000
+
+/** @brief Fields in the view */
+#define NFIELDS 8
+
+/** @brief The shared data, like a view's base and step */
+typedef struct view {
+    int field[NFIELDS];
+} view_t;
+
+/** @brief Guards view */
+seqlock_t sl;
+
+/** @brief Protected by sl */
+view_t view;
+
+/** @brief Torn copies caught by seqlock_read_retry(), updated atomically */
+int torn;
+
+/** @brief Copies that had to be done again, updated atomically */
+int retries;
+
+/** @brief Check if all fields of a copy are from the same write.
+ *
+ *  @param v The copy.
+ *  @return 1 if it is whole, 0 if it is torn.
+ */
+int whole(view_t *v)
+{
+    int i;
+
+    for (i = 1; i < NFIELDS; i++) {
+        if (v->field[i] != v->field[0])
+            return 0;
+    }
+    return 1;
+}
+
+/** @brief Copy the view out over and over.
+ *
+ *  @param arg The reader's index.
+ *  @return NULL.
+ */
+void *reader(void *arg)
+{
+    int id = (int)arg;
+    view_t copy;
+    int i, j, seq, last = 0;
+
+    for (i = 0; i < ITERS; i++) {
+        for (;;) {
+            seq = seqlock_read_begin(&sl);
+            for (j = 0; j < NFIELDS; j++) {
+                copy.field[j] = view.field[j];
+                /* let a writer run in the middle of the copy */
+                if (j == NFIELDS / 2 && (i + id) % 3 == 0)
+                    yield(-1);
+            }
+            if (!seqlock_read_retry(&sl, seq))
+                break;
+            xadd_wrapper(&retries);
+            if (!whole(&copy))
+                xadd_wrapper(&torn);
+        }
+
+        if (!whole(&copy))
+            panic("test_seqlock: torn copy was not retried");
+        /* the writes are ordered, we never see one undone */
+        if (copy.field[0] < last)
+            panic("test_seqlock: generation went back from %d to %d",
+                  last, copy.field[0]);
+        last = copy.field[0];
+    }
+    return NULL;
+}
+
+/** @brief Bump the generation over and over.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *writer(void *arg)
+{
+    int i, j, gen;
+
+    for (i = 0; i < WRITES; i++) {
+        seqlock_write_lock(&sl);
+        gen = view.field[0] + 1;
+        for (j = 0; j < NFIELDS; j++) {
+            view.field[j] = gen;
+            if (j == NFIELDS / 2 && i % 5 == 0)
+                yield(-1);
+        }
+        seqlock_write_unlock(&sl);
+        if (i % 2 == 0)
+            yield(-1);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NREADERS + NWRITERS];
+    int i;
+
+    thr_init(STACK_SIZE);
+    seqlock_init(&sl);
+
+    for (i = 0; i < NREADERS + NWRITERS; i++) {
+        if (i < NWRITERS)
+            tids[i] = thr_create(writer, NULL);
+        else
+            tids[i] = thr_create(reader, (void *)i);
+        if (tids[i] < 0)
+            panic("test_seqlock: thr_create failed");
+    }
+    for (i = 0; i < NREADERS + NWRITERS; i++)
+        thr_join(tids[i], NULL);
+
+    if (view.field[0] != NWRITERS * WRITES || !whole(&view))
+        panic("test_seqlock: lost a write, generation %d", view.field[0]);
+    if (torn == 0)
+        panic("test_seqlock: no torn copy was seen, raise ITERS");
+
+    seqlock_destroy(&sl);
+    printf("test_seqlock: %d retries, %d torn copies caught\n",
+           retries, torn);
+    printf("test_seqlock: PASS\n");
+    lprintf("test_seqlock: PASS");
+    thr_exit(NULL);
+    return 0;
+}
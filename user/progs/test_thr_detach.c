@@ -0,0 +1,127 @@
+/** @file test_thr_detach.c
+ *  @brief Test that detached threads clean up after themselves.
+ *
+ *  First a thread created detached exits, and the stack it ran on must
+ *  be handed to a thread created after it. Then a thread is detached
+ *  after it exited, which reaps it right away, so it can't be joined or
+ *  detached again, and its stack is reused too. Last, a thread detached
+ *  while it runs can't be joined either.
+ *
+ *  A thread's stack is told by the address of the argument of where(),
+ *  which is the same in every thread that runs on the same stack.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Threads created before a reclaimed stack must have come back */
+#define TRIES 32
+
+/** @brief Ticks for an exiting thread to get off its stack */
+#define SETTLE 5
+
+/** @brief Set to let block() return */
+volatile int go = 0;
+
+/** @brief Tell where the thread's stack is.
+ *
+ *  @param arg Where to store the address of arg.
+ *  @return NULL.
+ */
+void *where(void *arg)
+{
+    *(void * volatile *)arg = &arg;
+    return NULL;
+}
+
+/** @brief Wait until go is set.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *block(void *arg)
+{
+    while (!go)
+        yield(-1);
+    return NULL;
+}
+
+/** @brief Run where() in a new joinable thread.
+ *
+ *  @return The address where() stored.
+ */
+void *where_next(void)
+{
+    void * volatile addr = NULL;
+    int tid;
+
+    tid = thr_create(where, (void *)&addr);
+    if (tid < 0)
+        panic("test_thr_detach: thr_create failed");
+    if (thr_join(tid, NULL) < 0)
+        panic("test_thr_detach: thr_join failed");
+    return addr;
+}
+
+int main(int argc, char *argv[])
+{
+    void * volatile det_addr = NULL;
+    void * volatile addr = NULL;
+    int i, tid;
+
+    thr_init(STACK_SIZE);
+
+    /* a detached thread's stack goes to the next threads */
+    if (thr_create_detached(where, (void *)&det_addr) < 0)
+        panic("test_thr_detach: thr_create_detached failed");
+    while (det_addr == NULL)
+        yield(-1);
+    for (i = 0; i < TRIES; i++) {
+        if (where_next() == det_addr)
+            break;
+        sleep(1);
+    }
+    if (i == TRIES)
+        panic("test_thr_detach: the detached thread's stack was not reused");
+
+    /* detaching a thread that exited reaps it */
+    tid = thr_create(where, (void *)&addr);
+    if (tid < 0)
+        panic("test_thr_detach: thr_create failed");
+    while (addr == NULL)
+        yield(-1);
+    sleep(SETTLE);
+    if (thr_detach(tid) < 0)
+        panic("test_thr_detach: thr_detach of an exited thread failed");
+    if (thr_join(tid, NULL) == 0)
+        panic("test_thr_detach: joined a detached thread");
+    if (thr_detach(tid) == 0)
+        panic("test_thr_detach: detached a reaped thread");
+    if (where_next() != addr)
+        panic("test_thr_detach: the reaped thread's stack was not reused");
+
+    /* a running thread, detached, can't be joined */
+    tid = thr_create(block, NULL);
+    if (tid < 0)
+        panic("test_thr_detach: thr_create failed");
+    if (thr_detach(tid) < 0)
+        panic("test_thr_detach: thr_detach of a running thread failed");
+    if (thr_detach(tid) == 0)
+        panic("test_thr_detach: detached a thread twice");
+    if (thr_join(tid, NULL) == 0)
+        panic("test_thr_detach: joined a detached thread");
+    go = 1;
+
+    printf("test_thr_detach: PASS\n");
+    lprintf("test_thr_detach: PASS");
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,81 @@
+/** @file test_thr_join_any.c
+ *  @brief Reap workers with thr_join_any and thr_join_many.
+ *
+ *  Workers sleep for different times and exit with their index. The
+ *  first batch is reaped in exit order with thr_join_any, the second with
+ *  thr_join_many. Every status must come back exactly once.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Workers in each batch */
+#define NTHR 16
+
+/** @brief Sleep for a while and exit with the argument.
+ *
+ *  @param arg The worker's index.
+ *  @return arg.
+ */
+void *worker(void *arg)
+{
+    sleep((NTHR - (int)arg) % 5);
+    return arg;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NTHR];
+    void *statuses[NTHR];
+    int seen[NTHR];
+    int i, tid;
+    void *status;
+
+    thr_init(STACK_SIZE);
+
+    /* batch 1, join any */
+    for (i = 0; i < NTHR; i++) {
+        seen[i] = 0;
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0)
+            panic("test_thr_join_any: thr_create failed");
+    }
+    for (i = 0; i < NTHR; i++) {
+        if (thr_join_any(&tid, &status) < 0)
+            panic("test_thr_join_any: thr_join_any failed");
+        if ((int)status < 0 || (int)status >= NTHR ||
+            tids[(int)status] != tid || seen[(int)status]++)
+            panic("test_thr_join_any: bad status %d for tid %d",
+                  (int)status, tid);
+    }
+    /* they are gone */
+    if (thr_join(tids[0], NULL) == 0)
+        panic("test_thr_join_any: joined a reaped thread");
+
+    /* batch 2, join many */
+    for (i = 0; i < NTHR; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0)
+            panic("test_thr_join_any: thr_create failed");
+    }
+    if (thr_join_many(tids, NTHR, statuses) != 0)
+        panic("test_thr_join_any: thr_join_many failed");
+    for (i = 0; i < NTHR; i++) {
+        if ((int)statuses[i] != i)
+            panic("test_thr_join_any: status %d is %d", i,
+                  (int)statuses[i]);
+    }
+
+    printf("test_thr_join_any: PASS\n");
+    lprintf("test_thr_join_any: PASS");
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,153 @@
+/** @file test_thr_key.c
+ *  @brief Test thread-local values and their destructors.
+ *
+ *  Every worker sets its own value of a key and checks that it reads it
+ *  back. When the worker exits, the destructor must run exactly once on
+ *  that value, and once more for a value the destructor sets again. A
+ *  key that was not created yet must be refused.
+ *
+ *  At last the main thread sets a value and calls thr_exit(). A watcher
+ *  thread waits for the destructor to run on the main thread's value.
+ *
+ *  @author Che-Yuan Liang (cheyuanl)
+ *  @bug No known bugs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <simics.h>
+#include <syscall.h>
+#include <thread_ext.h>
+
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief Number of workers */
+#define NTHREADS 8
+
+/** @brief Ticks the watcher waits for the main thread's destructor */
+#define TIMEOUT 500
+
+/** @brief The key with a counting destructor */
+int key;
+
+/** @brief The key whose destructor sets the value again once */
+int again_key;
+
+/** @brief Destructor calls on the value of each worker */
+volatile int seen[NTHREADS];
+
+/** @brief Destructor calls on the value of each worker for again_key */
+volatile int again_seen[NTHREADS];
+
+/** @brief Destructor calls on the value of the main thread */
+volatile int main_seen = 0;
+
+/** @brief Count a destructor call.
+ *
+ *  @param value The counter of the exiting thread.
+ *  @return Void.
+ */
+void count(void *value)
+{
+    (*(volatile int *)value)++;
+}
+
+/** @brief Count a destructor call, and set the value again the first
+ *         time.
+ *
+ *  @param value The counter of the exiting thread.
+ *  @return Void.
+ */
+void count_again(void *value)
+{
+    if ((*(volatile int *)value)++ == 0)
+        thr_setspecific(again_key, value);
+}
+
+/** @brief Set and check this worker's values.
+ *
+ *  @param arg The worker's index.
+ *  @return NULL.
+ */
+void *worker(void *arg)
+{
+    int i = (int)arg;
+
+    if (thr_getspecific(key) != NULL)
+        panic("test_thr_key: a new thread has a value");
+    if (thr_setspecific(key, (void *)&seen[i]) < 0 ||
+        thr_setspecific(again_key, (void *)&again_seen[i]) < 0)
+        panic("test_thr_key: thr_setspecific failed");
+    yield(-1);
+    if (thr_getspecific(key) != &seen[i] ||
+        thr_getspecific(again_key) != &again_seen[i])
+        panic("test_thr_key: worker %d read a wrong value", i);
+    return NULL;
+}
+
+/** @brief Wait for the destructor on the main thread's value.
+ *
+ *  @param arg Unused.
+ *  @return NULL.
+ */
+void *watcher(void *arg)
+{
+    unsigned int deadline = get_ticks() + TIMEOUT;
+
+    while (main_seen == 0) {
+        if (get_ticks() > deadline)
+            panic("test_thr_key: the main thread's destructor did not run");
+        yield(-1);
+    }
+    if (main_seen != 1)
+        panic("test_thr_key: the main thread's destructor ran %d times",
+              main_seen);
+
+    printf("test_thr_key: PASS\n");
+    lprintf("test_thr_key: PASS");
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int tids[NTHREADS];
+    int i;
+
+    thr_init(STACK_SIZE);
+
+    if (thr_key_create(&key, count) < 0 ||
+        thr_key_create(&again_key, count_again) < 0)
+        panic("test_thr_key: thr_key_create failed");
+
+    /* the next key is not created yet */
+    if (thr_setspecific(again_key + 1, (void *)&main_seen) == 0)
+        panic("test_thr_key: set a key that was not created");
+    if (thr_getspecific(again_key + 1) != NULL)
+        panic("test_thr_key: got a key that was not created");
+    if (thr_setspecific(-1, (void *)&main_seen) == 0)
+        panic("test_thr_key: set a negative key");
+
+    for (i = 0; i < NTHREADS; i++) {
+        tids[i] = thr_create(worker, (void *)i);
+        if (tids[i] < 0)
+            panic("test_thr_key: thr_create failed");
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        if (thr_join(tids[i], NULL) < 0)
+            panic("test_thr_key: thr_join failed");
+        if (seen[i] != 1)
+            panic("test_thr_key: destructor ran %d times for worker %d",
+                  seen[i], i);
+        if (again_seen[i] != 2)
+            panic("test_thr_key: set-again destructor ran %d times "
+                  "for worker %d", again_seen[i], i);
+    }
+
+    /* the main thread's values are destroyed in thr_exit too */
+    if (thr_setspecific(key, (void *)&main_seen) < 0)
+        panic("test_thr_key: thr_setspecific failed");
+    if (thr_create(watcher, NULL) < 0)
+        panic("test_thr_key: thr_create failed");
+    thr_exit(NULL);
+    return 0;
+}